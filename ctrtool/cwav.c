@@ -6,9 +6,18 @@
 #include "cwav.h"
 #include "utils.h"
 #include "stream.h"
+#include "thread.h"
+#include "ctr.h"
+
+#ifndef _WIN32
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
 
 #define BUFFERSIZE (4*1024)
 #define SAMPLECOUNT 1024
+#define CWAV_THREAD_MINSAMPLES (256*1024)
 
 static const int ima_adpcm_step_table[89] = { 
   7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 
@@ -52,7 +61,7 @@ void cwav_set_usersettings(cwav_context* ctx, settings* usersettings)
 	ctx->usersettings = usersettings;
 }
 
-void cwav_process(cwav_context* ctx, u32 actions)
+void cwav_read_info(cwav_context* ctx)
 {
 	u32 i;
 	u32 infoheaderoffset;
@@ -104,7 +113,11 @@ void cwav_process(cwav_context* ctx, u32 actions)
 			}
 		}
 	}
-	
+}
+
+void cwav_process(cwav_context* ctx, u32 actions)
+{
+	cwav_read_info(ctx);
 
 	if (actions & InfoFlag)
 	{
@@ -127,36 +140,85 @@ void cwav_process(cwav_context* ctx, u32 actions)
 void cwav_write_wav_header(cwav_context* ctx, stream_out_context* outstreamctx, u32 size)
 {
 	wav_pcm_header header;
+
+	cwav_build_wav_header(ctx, &header, size);
+	stream_out_buffer(outstreamctx, &header, sizeof(wav_pcm_header));
+}
+
+void cwav_build_wav_header(cwav_context* ctx, wav_pcm_header* header, u32 size)
+{
 	u32 samplerate = getle32(ctx->infoheader.samplerate);
 	u32 channelcount = ctx->channelcount;
 
 
-	putle32(header.chunkid, 0x46464952);
-	putle32(header.chunksize, 36 + size);
-	putle32(header.format, 0x45564157);
-	putle32(header.subchunk1id, 0x20746d66);
-	putle32(header.subchunk1size, 16);
-	putle16(header.audioformat, 1);
-	putle16(header.numchannels, channelcount);
-	putle32(header.samplerate, samplerate);
-	putle32(header.byterate, samplerate * channelcount * 2);
-	putle16(header.blockalign, channelcount * 2);
-	putle16(header.bitspersample, 16);
+	putle32(header->chunkid, 0x46464952);
+	putle32(header->chunksize, 36 + size);
+	putle32(header->format, 0x45564157);
+	putle32(header->subchunk1id, 0x20746d66);
+	putle32(header->subchunk1size, 16);
+	putle16(header->audioformat, 1);
+	putle16(header->numchannels, channelcount);
+	putle32(header->samplerate, samplerate);
+	putle32(header->byterate, samplerate * channelcount * 2);
+	putle16(header->blockalign, channelcount * 2);
+	putle16(header->bitspersample, 16);
+
+	putle32(header->subchunk2id, 0x61746164);
+	putle32(header->subchunk2size, size);
+}
+
+void cwav_loopcache_init(cwav_loopcache* cache)
+{
+	memset(cache, 0, sizeof(cwav_loopcache));
+}
+
+int cwav_loopcache_append(cwav_loopcache* cache, const u8* data, u32 size)
+{
+	if (cache->size + size > cache->capacity)
+	{
+		u32 capacity = cache->capacity? cache->capacity : BUFFERSIZE;
+		u8* buffer;
 
-	putle32(header.subchunk2id, 0x61746164);
-	putle32(header.subchunk2size, size);
+		while(capacity < cache->size + size)
+			capacity *= 2;
 
-	stream_out_buffer(outstreamctx, &header, sizeof(wav_pcm_header));
+		buffer = realloc(cache->buffer, capacity);
+		if (buffer == 0)
+		{
+			fprintf(stderr, "Error allocating memory\n");
+			return 0;
+		}
+
+		cache->buffer = buffer;
+		cache->capacity = capacity;
+	}
+
+	memcpy(cache->buffer + cache->size, data, size);
+	cache->size += size;
+
+	return 1;
+}
+
+void cwav_loopcache_destroy(cwav_loopcache* cache)
+{
+	free(cache->buffer);
+
+	cache->buffer = 0;
+	cache->size = 0;
+	cache->capacity = 0;
 }
 
 int cwav_dspadpcm_decode_to_wav(cwav_context* ctx, stream_out_context* outstreamctx)
 {
-	u32 s, c, i;
+	u32 i;
 	int result = 0;
 	cwav_dspadpcmstate state;
+	cwav_loopcache loopcache;
 	u32 loopcount = settings_get_cwav_loopcount(ctx->usersettings);
 
+
 	cwav_dspadpcm_init(&state);
+	cwav_loopcache_init(&loopcache);
 
 	if (0 == cwav_dspadpcm_allocate(&state, ctx))
 		goto clean;
@@ -165,51 +227,63 @@ int cwav_dspadpcm_decode_to_wav(cwav_context* ctx, stream_out_context* outstream
 	{
 		int isloop = (i != 0);
 
+		// every loop pass decodes the same region from the same loop state, so replay the first one
+		if (i > 1)
+		{
+			if (!stream_out_buffer(outstreamctx, loopcache.buffer, loopcache.size))
+			{
+				fprintf(stderr, "Error writing output stream\n");
+				goto clean;
+			}
+			continue;
+		}
+
 		if (0 == cwav_dspadpcm_setup(&state, ctx, isloop))
 			goto clean;
 
 		while(1)
 		{
+			u32 size;
+
 			if (0 == cwav_dspadpcm_decode(&state, ctx))
 				goto clean;
 
 			if (state.samplecountavailable == 0)
 				break;
 
-			for(s=0; s<state.samplecountavailable; s++)
+			size = state.samplecountavailable * ctx->channelcount * 2;
+			if (!stream_out_buffer(outstreamctx, state.samplebuffer, size))
 			{
-				for(c=0; c<ctx->channelcount; c++)
-				{
-					s16 sampledata = state.channelstate[c].samplebuffer[s];
+				fprintf(stderr, "Error writing output stream\n");
+				goto clean;
+			}
 
-					if (!stream_out_byte(outstreamctx, 0xFF & sampledata) || !stream_out_byte(outstreamctx, 0xFF & (sampledata>>8)))
-					{
-						fprintf(stderr, "Error writing output stream\n");
-						goto clean;
-					}
-				}
-			}	
+			if (isloop && loopcount > 1 && !cwav_loopcache_append(&loopcache, state.samplebuffer, size))
+				goto clean;
 		}
 	}
 
 	result = 1;
 
 clean:
+	cwav_loopcache_destroy(&loopcache);
 	cwav_dspadpcm_destroy(&state);
 
 	return result;
 }
 
-
 int cwav_imaadpcm_decode_to_wav(cwav_context* ctx, stream_out_context* outstreamctx)
 {
-	u32 s, c, i;
+	u32 i;
 	int result = 0;
 	cwav_imaadpcmstate state;
+	cwav_loopcache loopcache;
 	u32 loopcount = settings_get_cwav_loopcount(ctx->usersettings);
 
 
 	cwav_imaadpcm_init(&state);
+	cwav_loopcache_init(&loopcache);
+
 	if (0 == cwav_imaadpcm_allocate(&state, ctx))
 		goto clean;
 
@@ -217,52 +291,62 @@ int cwav_imaadpcm_decode_to_wav(cwav_context* ctx, stream_out_context* outstream
 	{
 		int isloop = (i != 0);
 
+		// every loop pass decodes the same region from the same loop state, so replay the first one
+		if (i > 1)
+		{
+			if (!stream_out_buffer(outstreamctx, loopcache.buffer, loopcache.size))
+			{
+				fprintf(stderr, "Error writing output stream\n");
+				goto clean;
+			}
+			continue;
+		}
+
 		if (0 == cwav_imaadpcm_setup(&state, ctx, isloop))
 			goto clean;
 
 		while(1)
 		{
+			u32 size;
+
 			if (0 == cwav_imaadpcm_decode(&state, ctx))
 				goto clean;
 
 			if (state.samplecountavailable == 0)
 				break;
 
-			for(s=0; s<state.samplecountavailable; s++)
+			size = state.samplecountavailable * ctx->channelcount * 2;
+			if (!stream_out_buffer(outstreamctx, state.samplebuffer, size))
 			{
-				for(c=0; c<ctx->channelcount; c++)
-				{
-					s16 sampledata = state.channelstate[c].samplebuffer[s];
+				fprintf(stderr, "Error writing output stream\n");
+				goto clean;
+			}
 
-					if (!stream_out_byte(outstreamctx, 0xFF & sampledata) || !stream_out_byte(outstreamctx, 0xFF & (sampledata>>8)))
-					{
-						fprintf(stderr, "Error writing output stream\n");
-						goto clean;
-					}
-				}
-			}	
+			if (isloop && loopcount > 1 && !cwav_loopcache_append(&loopcache, state.samplebuffer, size))
+				goto clean;
 		}
 	}
 
 	result = 1;
 
 clean:
+	cwav_loopcache_destroy(&loopcache);
 	cwav_imaadpcm_destroy(&state);
 
 	return result;
 }
 
-
 int cwav_pcm_decode_to_wav(cwav_context* ctx, stream_out_context* outstreamctx)
 {
-	u32 s, c, i;
+	u32 i;
 	int result = 0;
 	cwav_pcmstate state;
+	cwav_loopcache loopcache;
 	u32 loopcount = settings_get_cwav_loopcount(ctx->usersettings);
 
 
 	cwav_pcm_init(&state);
-
+	cwav_loopcache_init(&loopcache);
 
 	if (0 == cwav_pcm_allocate(&state, ctx))
 		goto clean;
@@ -271,36 +355,46 @@ int cwav_pcm_decode_to_wav(cwav_context* ctx, stream_out_context* outstreamctx)
 	{
 		int isloop = (i != 0);
 
+		// every loop pass decodes the same region from the same loop state, so replay the first one
+		if (i > 1)
+		{
+			if (!stream_out_buffer(outstreamctx, loopcache.buffer, loopcache.size))
+			{
+				fprintf(stderr, "Error writing output stream\n");
+				goto clean;
+			}
+			continue;
+		}
+
 		if (0 == cwav_pcm_setup(&state, ctx, isloop))
 			goto clean;
 
 		while(1)
 		{
+			u32 size;
+
 			if (0 == cwav_pcm_decode(&state, ctx))
 				goto clean;
 
 			if (state.samplecountavailable == 0)
 				break;
 
-			for(s=0; s<state.samplecountavailable; s++)
+			size = state.samplecountavailable * ctx->channelcount * 2;
+			if (!stream_out_buffer(outstreamctx, state.samplebuffer, size))
 			{
-				for(c=0; c<ctx->channelcount; c++)
-				{
-					s16 sampledata = state.channelstate[c].samplebuffer[s];
+				fprintf(stderr, "Error writing output stream\n");
+				goto clean;
+			}
 
-					if (!stream_out_byte(outstreamctx, 0xFF & sampledata) || !stream_out_byte(outstreamctx, 0xFF & (sampledata>>8)))
-					{
-						fprintf(stderr, "Error writing output stream\n");
-						goto clean;
-					}
-				}
-			}	
+			if (isloop && loopcount > 1 && !cwav_loopcache_append(&loopcache, state.samplebuffer, size))
+				goto clean;
 		}
 	}
 
 	result = 1;
 
 clean:
+	cwav_loopcache_destroy(&loopcache);
 	cwav_pcm_destroy(&state);
 
 	return result;
@@ -360,6 +454,518 @@ clean:
 	return result;
 }
 
+// append decoded samples to a pass buffer, never writing past its allocation
+static int cwav_decode_pass_append(u8* pcm, u64 pcmsize, u32* pos, const u8* samplebuffer, u32 samplecount, u32 channelcount)
+{
+	u64 size = (u64)samplecount * channelcount * 2;
+
+	if (size > pcmsize - *pos)
+	{
+		fprintf(stderr, "Error decoded more samples than expected\n");
+		return 0;
+	}
+
+	memcpy(pcm + *pos, samplebuffer, size);
+	*pos += size;
+
+	return 1;
+}
+
+// decode one whole pass into a freshly allocated interleaved pcm buffer
+int cwav_decode_pass(cwav_context* ctx, int isloop, int channelthreads, u8** buffer, u32* size)
+{
+	int result = 0;
+	u32 pos = 0;
+	u32 samplecount;
+	u64 pcmsize;
+	u8* pcm = 0;
+
+
+	*buffer = 0;
+	*size = 0;
+
+	if (ctx->channel == 0)
+		return 0;
+
+	if (isloop)
+		samplecount = getle32(ctx->infoheader.loopend) - getle32(ctx->infoheader.loopstart);
+	else
+		samplecount = getle32(ctx->infoheader.loopend);
+
+	if (samplecount == 0)
+		return 1;
+
+	pcmsize = (u64)samplecount * ctx->channelcount * 2;
+	if (pcmsize > UINT32_MAX)
+	{
+		fprintf(stderr, "Error sound data too large\n");
+		return 0;
+	}
+
+	pcm = malloc(pcmsize);
+	if (pcm == 0)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		return 0;
+	}
+
+	if (ctx->infoheader.encoding == CWAV_ENCODING_DSPADPCM)
+	{
+		cwav_dspadpcmstate state;
+
+		cwav_dspadpcm_init(&state);
+		if (cwav_dspadpcm_allocate(&state, ctx) && cwav_dspadpcm_setup(&state, ctx, isloop))
+		{
+			if (channelthreads && ctx->channelcount > 1 && samplecount >= CWAV_THREAD_MINSAMPLES)
+			{
+				result = cwav_dspadpcm_decode_threaded(&state, ctx, pcm);
+				pos = pcmsize;
+			}
+			else
+			{
+				while((result = cwav_dspadpcm_decode(&state, ctx)) && state.samplecountavailable)
+				{
+					if (0 == (result = cwav_decode_pass_append(pcm, pcmsize, &pos, state.samplebuffer, state.samplecountavailable, ctx->channelcount)))
+						break;
+				}
+			}
+		}
+		cwav_dspadpcm_destroy(&state);
+	}
+	else if (ctx->infoheader.encoding == CWAV_ENCODING_IMAADPCM)
+	{
+		cwav_imaadpcmstate state;
+
+		cwav_imaadpcm_init(&state);
+		if (cwav_imaadpcm_allocate(&state, ctx) && cwav_imaadpcm_setup(&state, ctx, isloop))
+		{
+			while((result = cwav_imaadpcm_decode(&state, ctx)) && state.samplecountavailable)
+			{
+				if (0 == (result = cwav_decode_pass_append(pcm, pcmsize, &pos, state.samplebuffer, state.samplecountavailable, ctx->channelcount)))
+					break;
+			}
+		}
+		cwav_imaadpcm_destroy(&state);
+	}
+	else if (ctx->infoheader.encoding == CWAV_ENCODING_PCM16 || ctx->infoheader.encoding == CWAV_ENCODING_PCM8)
+	{
+		cwav_pcmstate state;
+
+		cwav_pcm_init(&state);
+		if (cwav_pcm_allocate(&state, ctx) && cwav_pcm_setup(&state, ctx, isloop))
+		{
+			while((result = cwav_pcm_decode(&state, ctx)) && state.samplecountavailable)
+			{
+				if (0 == (result = cwav_decode_pass_append(pcm, pcmsize, &pos, state.samplebuffer, state.samplecountavailable, ctx->channelcount)))
+					break;
+			}
+		}
+		cwav_pcm_destroy(&state);
+	}
+
+	if (!result)
+	{
+		free(pcm);
+		return 0;
+	}
+
+	*buffer = pcm;
+	*size = pos;
+
+	return 1;
+}
+
+// decode the whole sound in memory and write the wav file with a single vectored write
+int cwav_save_to_wav_vectored(cwav_context* ctx, const char* filepath, int channelthreads)
+{
+	u32 i;
+	int result = 0;
+	FILE* outfile = 0;
+	u8* mainbuffer = 0;
+	u8* loopbuffer = 0;
+	u32 mainsize = 0;
+	u32 loopsize = 0;
+	u64 datasize;
+	wav_pcm_header header;
+	stream_vector* vectors = 0;
+	u32 loopcount = settings_get_cwav_loopcount(ctx->usersettings);
+
+
+	if (ctx->channelcount == 0)
+		goto clean;
+
+	if (0 == cwav_decode_pass(ctx, 0, channelthreads, &mainbuffer, &mainsize))
+		goto clean;
+
+	if (loopcount && 0 == cwav_decode_pass(ctx, 1, channelthreads, &loopbuffer, &loopsize))
+		goto clean;
+
+	// the riff chunk size is 32-bit, so the wav cannot grow past 4 GiB
+	datasize = mainsize + (u64)loopsize * loopcount;
+	if (datasize > UINT32_MAX - 36)
+	{
+		fprintf(stderr, "Error wav output would exceed 4 GiB\n");
+		goto clean;
+	}
+
+	vectors = malloc(sizeof(stream_vector) * (2 + loopcount));
+	if (vectors == 0)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		goto clean;
+	}
+
+	cwav_build_wav_header(ctx, &header, datasize);
+
+	vectors[0].buffer = &header;
+	vectors[0].size = sizeof(wav_pcm_header);
+	vectors[1].buffer = mainbuffer;
+	vectors[1].size = mainsize;
+	for(i=0; i<loopcount; i++)
+	{
+		vectors[2+i].buffer = loopbuffer;
+		vectors[2+i].size = loopsize;
+	}
+
+	fprintf(stdout, "Saving sound data to %s...\n", filepath);
+	outfile = fopen(filepath, "wb");
+	if (!outfile)
+	{
+		fprintf(stderr, "Error could not open file %s for writing.\n", filepath);
+		goto clean;
+	}
+
+	if (0 == stream_write_vectored(outfile, vectors, 2 + loopcount))
+	{
+		fprintf(stderr, "Error writing output stream\n");
+		goto clean;
+	}
+
+	result = 1;
+
+clean:
+	if (outfile)
+		fclose(outfile);
+
+	free(vectors);
+	free(mainbuffer);
+	free(loopbuffer);
+
+	return result;
+}
+
+static int cwav_batch_has_extension(const char* name)
+{
+	const char* ext = strrchr(name, '.');
+
+	if (ext == 0)
+		return 0;
+
+#ifdef _WIN32
+	return (_stricmp(ext, ".bcwav") == 0 || _stricmp(ext, ".cwav") == 0);
+#else
+	return (strcasecmp(ext, ".bcwav") == 0 || strcasecmp(ext, ".cwav") == 0);
+#endif
+}
+
+static int cwav_batch_push(cwav_batch_context* ctx, const char* path)
+{
+	if (strlen(path) >= MAX_PATH)
+	{
+		fprintf(stderr, "Error path too long %s\n", path);
+		return 0;
+	}
+
+	if (ctx->inputcount >= ctx->inputcapacity)
+	{
+		u32 capacity = ctx->inputcapacity? ctx->inputcapacity * 2 : 64;
+		filepath* inputs = realloc(ctx->inputs, sizeof(filepath) * capacity);
+
+		if (inputs == 0)
+		{
+			fprintf(stderr, "Error allocating memory\n");
+			return 0;
+		}
+
+		ctx->inputs = inputs;
+		ctx->inputcapacity = capacity;
+	}
+
+	filepath_set(&ctx->inputs[ctx->inputcount++], path);
+
+	return 1;
+}
+
+// queue an input file, or every .bcwav/.cwav file directly inside an input directory
+static int cwav_batch_add_input(cwav_batch_context* ctx, const char* path)
+{
+	char entrypath[MAX_PATH];
+#ifdef _WIN32
+	WIN32_FIND_DATAA finddata;
+	HANDLE find;
+	DWORD attributes = GetFileAttributesA(path);
+
+	if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY))
+		return cwav_batch_push(ctx, path);
+
+	snprintf(entrypath, MAX_PATH, "%s\\*", path);
+	find = FindFirstFileA(entrypath, &finddata);
+	if (find == INVALID_HANDLE_VALUE)
+		return 1;
+
+	do
+	{
+		if ((finddata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || !cwav_batch_has_extension(finddata.cFileName))
+			continue;
+
+		if (snprintf(entrypath, MAX_PATH, "%s%c%s", path, PATH_SEPERATOR, finddata.cFileName) >= MAX_PATH)
+		{
+			fprintf(stderr, "Error path too long %s%c%s\n", path, PATH_SEPERATOR, finddata.cFileName);
+			continue;
+		}
+
+		if (!cwav_batch_push(ctx, entrypath))
+		{
+			FindClose(find);
+			return 0;
+		}
+	}
+	while(FindNextFileA(find, &finddata));
+
+	FindClose(find);
+#else
+	struct stat st;
+	DIR* dir;
+	struct dirent* entry;
+
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+		return cwav_batch_push(ctx, path);
+
+	dir = opendir(path);
+	if (dir == 0)
+	{
+		fprintf(stderr, "Error could not open directory %s\n", path);
+		return 0;
+	}
+
+	while((entry = readdir(dir)) != 0)
+	{
+		if (!cwav_batch_has_extension(entry->d_name))
+			continue;
+
+		if (snprintf(entrypath, MAX_PATH, "%s%c%s", path, PATH_SEPERATOR, entry->d_name) >= MAX_PATH)
+		{
+			fprintf(stderr, "Error path too long %s%c%s\n", path, PATH_SEPERATOR, entry->d_name);
+			continue;
+		}
+
+		if (stat(entrypath, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (!cwav_batch_push(ctx, entrypath))
+		{
+			closedir(dir);
+			return 0;
+		}
+	}
+
+	closedir(dir);
+#endif
+
+	return 1;
+}
+
+// the wav name is the input file name without its extension
+static const char* cwav_batch_output_name(const char* path, int* namelen)
+{
+	const char* name;
+	const char* ext;
+
+	name = strrchr(path, PATH_SEPERATOR);
+	name = name? name + 1 : path;
+	ext = strrchr(name, '.');
+	if (ext == 0)
+		ext = name + strlen(name);
+
+	*namelen = (int)(ext - name);
+	return name;
+}
+
+static int cwav_batch_compare_output_name(const void* a, const void* b)
+{
+	const char* patha = ((const filepath*)a)->pathname;
+	const char* pathb = ((const filepath*)b)->pathname;
+	int lena, lenb, result;
+	const char* namea = cwav_batch_output_name(patha, &lena);
+	const char* nameb = cwav_batch_output_name(pathb, &lenb);
+
+#ifdef _WIN32
+	result = _strnicmp(namea, nameb, lena < lenb? lena : lenb);
+#else
+	result = strncmp(namea, nameb, lena < lenb? lena : lenb);
+#endif
+	if (result == 0)
+		result = lena - lenb;
+	return result;
+}
+
+// every input is written to outdir/<name>.wav, so inputs sharing a name from different directories would overwrite each other
+static int cwav_batch_check_output_names(cwav_batch_context* ctx)
+{
+	u32 i;
+	int namelen;
+	const char* name;
+
+	qsort(ctx->inputs, ctx->inputcount, sizeof(filepath), cwav_batch_compare_output_name);
+
+	for(i=1; i<ctx->inputcount; i++)
+	{
+		if (cwav_batch_compare_output_name(&ctx->inputs[i-1], &ctx->inputs[i]) != 0)
+			continue;
+
+		name = cwav_batch_output_name(ctx->inputs[i].pathname, &namelen);
+		fprintf(stderr, "Error %s and %s would both be converted to %.*s.wav\n", ctx->inputs[i-1].pathname, ctx->inputs[i].pathname, namelen, name);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int cwav_batch_convert_file(cwav_batch_context* batchctx, filepath* inpath)
+{
+	cwav_context ctx;
+	char outpath[MAX_PATH];
+	const char* name;
+	int namelen;
+	FILE* infile;
+	int result = 0;
+
+
+	name = cwav_batch_output_name(inpath->pathname, &namelen);
+
+	if (strlen(batchctx->outdir) + namelen + 6 >= MAX_PATH)
+	{
+		fprintf(stderr, "Error path too long for %s\n", inpath->pathname);
+		return 0;
+	}
+	snprintf(outpath, MAX_PATH, "%s%c%.*s.wav", batchctx->outdir, PATH_SEPERATOR, namelen, name);
+
+	infile = fopen(inpath->pathname, "rb");
+	if (infile == 0)
+	{
+		fprintf(stderr, "Error could not open input file %s\n", inpath->pathname);
+		return 0;
+	}
+
+	cwav_init(&ctx);
+	cwav_set_file(&ctx, infile);
+	fseek(infile, 0, SEEK_END);
+	cwav_set_size(&ctx, ftell(infile));
+	cwav_set_usersettings(&ctx, batchctx->usersettings);
+	cwav_read_info(&ctx);
+
+	if (getle32(ctx.header.magic) != MAGIC_CWAV)
+		fprintf(stderr, "Error %s is not a CWAV file\n", inpath->pathname);
+	else
+		result = cwav_save_to_wav_vectored(&ctx, outpath, batchctx->channelthreads);
+
+	free(ctx.channel);
+	fclose(infile);
+
+	return result;
+}
+
+static void cwav_batch_worker(void* arg)
+{
+	cwav_batch_context* ctx = (cwav_batch_context*)arg;
+
+	while(1)
+	{
+		u32 index;
+
+		mutex_lock(&ctx->mutex);
+		index = ctx->nextinput++;
+		mutex_unlock(&ctx->mutex);
+
+		if (index >= ctx->inputcount)
+			break;
+
+		if (0 == cwav_batch_convert_file(ctx, &ctx->inputs[index]))
+		{
+			mutex_lock(&ctx->mutex);
+			ctx->failcount++;
+			mutex_unlock(&ctx->mutex);
+		}
+	}
+}
+
+// convert every input file (or directory of CWAV files) to wav in the wav output directory
+int cwav_batch_process(settings* usersettings, char** inputs, u32 inputcount)
+{
+	u32 i;
+	u32 workercount = settings_get_job_count(usersettings);
+	filepath* outdir = settings_get_wav_dir_path(usersettings);
+	cwav_batch_context ctx;
+	thread_context* workers = 0;
+
+
+	memset(&ctx, 0, sizeof(cwav_batch_context));
+	ctx.usersettings = usersettings;
+	ctx.outdir = outdir->pathname;
+
+	for(i=0; i<inputcount; i++)
+	{
+		if (!cwav_batch_add_input(&ctx, inputs[i]))
+			goto clean;
+	}
+
+	if (ctx.inputcount == 0)
+	{
+		fprintf(stderr, "Error no CWAV input files\n");
+		goto clean;
+	}
+
+	if (!cwav_batch_check_output_names(&ctx))
+	{
+		ctx.failcount = ctx.inputcount;
+		goto clean;
+	}
+
+	makedir(ctx.outdir);
+
+	if (workercount == 0)
+		workercount = thread_cpu_count();
+
+	// spare workers go to decoding channels concurrently instead
+	ctx.channelthreads = (ctx.inputcount < workercount);
+	if (workercount > ctx.inputcount)
+		workercount = ctx.inputcount;
+
+	workers = malloc(sizeof(thread_context) * workercount);
+	if (workers == 0)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		goto clean;
+	}
+
+	mutex_init(&ctx.mutex);
+
+	for(i=0; i<workercount; i++)
+		thread_start(&workers[i], cwav_batch_worker, &ctx);
+	for(i=0; i<workercount; i++)
+		thread_join(&workers[i]);
+
+	mutex_destroy(&ctx.mutex);
+
+	fprintf(stdout, "Converted %d of %d CWAV files\n", ctx.inputcount - ctx.failcount, ctx.inputcount);
+
+clean:
+	free(workers);
+	free(ctx.inputs);
+
+	return (ctx.inputcount != 0 && ctx.failcount == 0);
+}
+
 void cwav_dspadpcm_init(cwav_dspadpcmstate* state)
 {
 	memset(state, 0, sizeof(cwav_dspadpcmstate));
@@ -370,8 +976,9 @@ int cwav_dspadpcm_allocate(cwav_dspadpcmstate* state, cwav_context* ctx)
 	u32 channelcount = ctx->channelcount;
 
 
-	state->samplebuffer = malloc(sizeof(s16) * SAMPLECOUNT * channelcount);
-	state->channelstate = malloc(sizeof(cwav_dspadpcmchannelstate) * channelcount);
+	state->samplebuffer = malloc(2 * SAMPLECOUNT * channelcount);
+	state->channelstate = calloc(channelcount, sizeof(cwav_dspadpcmchannelstate));
+	state->channelcount = channelcount;
 	state->samplecountcapacity = SAMPLECOUNT;
 	state->samplecountavailable = 0;
 	state->samplecountremaining = 0;
@@ -393,6 +1000,7 @@ int cwav_dspadpcm_setup(cwav_dspadpcmstate* state, cwav_context* ctx, int isloop
 	u32 channelcount = ctx->channelcount;
 	u32 i;
 	u32 startoffset = 0;
+	u32 adpcmsize;
 
 
 	if (ctx->channel == 0)
@@ -417,10 +1025,15 @@ int cwav_dspadpcm_setup(cwav_dspadpcmstate* state, cwav_context* ctx, int isloop
 
 	
 
+	// one frame of 8 bytes holds 14 samples, load every frame this pass needs in one read
+	adpcmsize = ((state->samplecountremaining + 13) / 14) * 8;
+
 	for(i=0; i<channelcount; i++)
 	{
 		cwav_channel* adpcmchannel = &ctx->channel[i];
 		cwav_dspadpcminfo* adpcminfo = &adpcmchannel->infodspadpcm;
+		cwav_dspadpcmchannelstate* channelstate = &state->channelstate[i];
+		u32 j;
 
 		if (getle16(adpcmchannel->info.codecref.idtype) != 0x300)
 		{
@@ -428,30 +1041,125 @@ int cwav_dspadpcm_setup(cwav_dspadpcmstate* state, cwav_context* ctx, int isloop
 			return 0;
 		}
 
-		state->channelstate[i].samplebuffer = state->samplebuffer + SAMPLECOUNT * i;
-		state->channelstate[i].sampleoffset = ctx->offset + getle32(adpcmchannel->info.sampleref.offset) + getle32(ctx->header.datablockref.offset) + 8 + startoffset;
+		channelstate->sampleoffset = ctx->offset + getle32(adpcmchannel->info.sampleref.offset) + getle32(ctx->header.datablockref.offset) + 8 + startoffset;
 		if (isloop)
 		{
-			state->channelstate[i].yn1 = getle16(adpcminfo->loopyn1);
-			state->channelstate[i].yn2 = getle16(adpcminfo->loopyn2);
+			channelstate->yn1 = getle16(adpcminfo->loopyn1);
+			channelstate->yn2 = getle16(adpcminfo->loopyn2);
 		}
 		else
 		{
-			state->channelstate[i].yn1 = getle16(adpcminfo->yn1);
-			state->channelstate[i].yn2 = getle16(adpcminfo->yn2);
+			channelstate->yn1 = getle16(adpcminfo->yn1);
+			channelstate->yn2 = getle16(adpcminfo->yn2);
 		}
-		stream_in_allocate(&state->channelstate[i].instreamctx, BUFFERSIZE, ctx->file);
-		stream_in_seek(&state->channelstate[i].instreamctx, state->channelstate[i].sampleoffset);
+
+		for(j=0; j<16; j++)
+			channelstate->coef[j] = getle16(adpcminfo->coef[j]);
+
+		channelstate->adpcmpos = 0;
+		channelstate->adpcmsize = adpcmsize;
+		if (adpcmsize == 0)
+			continue;
+
+		if (adpcmsize > channelstate->adpcmcapacity)
+		{
+			free(channelstate->adpcmbuffer);
+			channelstate->adpcmbuffer = malloc(adpcmsize);
+			channelstate->adpcmcapacity = adpcmsize;
+			if (channelstate->adpcmbuffer == 0)
+			{
+				fprintf(stderr, "Error allocating memory\n");
+				return 0;
+			}
+		}
+
+		fseek(ctx->file, channelstate->sampleoffset, SEEK_SET);
+		if (adpcmsize != fread(channelstate->adpcmbuffer, 1, adpcmsize, ctx->file))
+		{
+			fprintf(stderr, "Error reading input stream\n");
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static s32 cwav_clamp_s16(s32 value)
+{
+	value = value < -0x8000? -0x8000 : value;
+	value = value > 0x7FFF? 0x7FFF : value;
+
+	return value;
+}
+
+// decode up to 14 samples of one 8-byte dsp-adpcm frame into interleaved little-endian pcm
+static void cwav_dspadpcm_decode_frame(const u8* frame, u8* samplebuffer, u32 stride, u32 samplecount, const s16* coef, s32* yn1, s32* yn2)
+{
+	u32 i;
+	s32 coef1 = coef[((frame[0]>>4) & 7)*2+0];
+	s32 coef2 = coef[((frame[0]>>4) & 7)*2+1];
+	u32 shift = 17 - (frame[0] & 0xF);
+	s32 hist1 = *yn1;
+	s32 hist2 = *yn2;
+
+	for(i=0; i<samplecount; i++)
+	{
+		u32 nibble = (frame[1 + i/2] >> ((i & 1)? 0 : 4)) & 0xF;
+		s32 xshifted = ((s32)(nibble << 28)) >> shift;
+		s32 prediction = cwav_clamp_s16((hist1 * coef1 + hist2 * coef2 + xshifted + 0x400)>>11);
+
+		hist2 = hist1;
+		hist1 = prediction;
+
+		samplebuffer[0] = prediction & 0xFF;
+		samplebuffer[1] = (prediction >> 8) & 0xFF;
+		samplebuffer += stride;
 	}
 
+	*yn1 = hist1;
+	*yn2 = hist2;
+}
+
+// decode samplecount samples of one dsp-adpcm channel, writing every stride bytes
+int cwav_dspadpcm_decode_channel(cwav_dspadpcmchannelstate* channelstate, u8* samplebuffer, u32 stride, u32 samplecount)
+{
+	const u8* frame = channelstate->adpcmbuffer + channelstate->adpcmpos;
+	s32 yn1 = channelstate->yn1;
+	s32 yn2 = channelstate->yn2;
+	u32 remaining = samplecount;
+
+	if (channelstate->adpcmpos + ((samplecount + 13) / 14) * 8 > channelstate->adpcmsize)
+	{
+		fprintf(stderr, "Error reading input stream\n");
+		return 0;
+	}
+
+	while(remaining >= 14)
+	{
+		cwav_dspadpcm_decode_frame(frame, samplebuffer, stride, 14, channelstate->coef, &yn1, &yn2);
+		frame += 8;
+		samplebuffer += 14 * stride;
+		remaining -= 14;
+	}
+
+	if (remaining)
+	{
+		cwav_dspadpcm_decode_frame(frame, samplebuffer, stride, remaining, channelstate->coef, &yn1, &yn2);
+		frame += 8;
+	}
+
+	channelstate->adpcmpos = frame - channelstate->adpcmbuffer;
+	channelstate->yn1 = yn1;
+	channelstate->yn2 = yn2;
+
 	return 1;
 }
 
-// decode dsp-adpcm to pcm signed 16-bit
+// decode dsp-adpcm to interleaved little-endian pcm signed 16-bit
 int cwav_dspadpcm_decode(cwav_dspadpcmstate* state, cwav_context* ctx)
 {
-	u32 i, c;
-	u32 maxsamplecount;
+	u32 c;
+	u32 samplecount;
 	u32 channelcount = ctx->channelcount;
 	
 	if (ctx->channel == 0 || state->samplebuffer == 0 || state->channelstate == 0)
@@ -464,92 +1172,89 @@ int cwav_dspadpcm_decode(cwav_dspadpcmstate* state, cwav_context* ctx)
 		return 1;
 	}
 
-	while(state->samplecountremaining > 0)
-	{
-		u32 samplecountavailable = state->samplecountcapacity - state->samplecountavailable;
-
-		if (state->samplecountremaining < 14)
-			maxsamplecount = state->samplecountremaining;
-		else
-			maxsamplecount = 14;
-
-		if (samplecountavailable < maxsamplecount)
-			break;
-
-		for(c=0; c<channelcount; c++)
-		{	
-			cwav_dspadpcmchannelstate* channelstate = &state->channelstate[c];
-
-			s16* samplebuffer = channelstate->samplebuffer + state->samplecountavailable;
-			stream_in_context* instreamctx = &channelstate->instreamctx;
-			s16 yn1 = channelstate->yn1;
-			s16 yn2 = channelstate->yn2;
-			cwav_channel* adpcmchannel = &ctx->channel[c];
-			cwav_dspadpcminfo* adpcminfo = &adpcmchannel->infodspadpcm;
-			
-			u8 data;
-			u8 lonibble;
-			u8 hinibble;
-			s16 coef1;
-			s16 coef2;
-			u32 shift;
-			s16 table[14];
+	// decode as many whole frames as fit in the sample buffer
+	samplecount = (state->samplecountcapacity / 14) * 14;
+	if (state->samplecountremaining < samplecount)
+		samplecount = state->samplecountremaining;
 
-			stream_in_reseek(instreamctx);
+	for(c=0; c<channelcount; c++)
+	{	
+		if (0 == cwav_dspadpcm_decode_channel(&state->channelstate[c], state->samplebuffer + c * 2, channelcount * 2, samplecount))
+			return 0;
+	}
 
+	state->samplecountremaining -= samplecount;
+	state->samplecountavailable = samplecount;
 
-			if (0 == stream_in_byte(instreamctx, &data))
-			{
-				fprintf(stderr, "Error reading input stream\n");
-				return 1;
-			}
+	return 1;
+}
 
-			lonibble = data & 0xF;
-			hinibble = data>>4;
+static void cwav_dspadpcm_channel_worker(void* arg)
+{
+	cwav_dspadpcmchanneljob* job = (cwav_dspadpcmchanneljob*)arg;
 
-			coef1 = getle16(adpcminfo->coef[hinibble*2+0]);
-			coef2 = getle16(adpcminfo->coef[hinibble*2+1]);
-			shift = 17 - lonibble;
+	job->result = cwav_dspadpcm_decode_channel(job->channelstate, job->samplebuffer, job->stride, job->samplecount);
+}
 
-			for(i=0; i<7; i++)
-			{
-				stream_in_byte(instreamctx, &data);
-				table[i*2+0] = data>>4;
-				table[i*2+1] = data & 0xF;
-			}
+// decode the rest of the current pass straight into samplebuffer, one thread per channel
+int cwav_dspadpcm_decode_threaded(cwav_dspadpcmstate* state, cwav_context* ctx, u8* samplebuffer)
+{
+	u32 c;
+	int result = 1;
+	u32 channelcount = ctx->channelcount;
+	cwav_dspadpcmchanneljob* jobs;
+	thread_context* threads;
 
+	if (ctx->channel == 0 || state->channelstate == 0)
+		return 0;
 
-			for(i=0; i<maxsamplecount; i++)
-			{
-				s32 x = table[i] << 28;
-				s32 xshifted = x >> shift;
+	jobs = malloc(sizeof(cwav_dspadpcmchanneljob) * channelcount);
+	threads = malloc(sizeof(thread_context) * channelcount);
+	if (jobs == 0 || threads == 0)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		free(jobs);
+		free(threads);
+		return 0;
+	}
 
-				s32 prediction = (yn1 * coef1 + yn2 * coef2 + xshifted + 0x400)>>11;
-				
-				if (prediction < -0x8000)
-					prediction = -0x8000;
-				if (prediction > 0x7FFF)
-					prediction = 0x7FFF;
+	for(c=0; c<channelcount; c++)
+	{
+		jobs[c].channelstate = &state->channelstate[c];
+		jobs[c].samplebuffer = samplebuffer + c * 2;
+		jobs[c].stride = channelcount * 2;
+		jobs[c].samplecount = state->samplecountremaining;
+		jobs[c].result = 0;
 
-				yn2 = yn1;
-				yn1 = prediction;
+		thread_start(&threads[c], cwav_dspadpcm_channel_worker, &jobs[c]);
+	}
 
-				samplebuffer[i] = prediction;
-			}
+	for(c=0; c<channelcount; c++)
+	{
+		thread_join(&threads[c]);
+		if (jobs[c].result == 0)
+			result = 0;
+	}
 
-			channelstate->yn1 = yn1;
-			channelstate->yn2 = yn2;
-		}
+	state->samplecountavailable = 0;
+	state->samplecountremaining = 0;
 
-		state->samplecountremaining -= maxsamplecount;
-		state->samplecountavailable += maxsamplecount;
-	}
+	free(jobs);
+	free(threads);
 
-	return 1;
+	return result;
 }
 
 void cwav_dspadpcm_destroy(cwav_dspadpcmstate* state)
 {
+	u32 i;
+
+	if (state->channelstate)
+	{
+		for(i=0; i<state->channelcount; i++)
+			free(state->channelstate[i].adpcmbuffer);
+	}
+
 	free(state->channelstate);
 	free(state->samplebuffer);
 
@@ -566,14 +1271,33 @@ void cwav_imaadpcm_init(cwav_imaadpcmstate* state)
 int cwav_imaadpcm_allocate(cwav_imaadpcmstate* state, cwav_context* ctx)
 {
 	u32 channelcount = ctx->channelcount;
+	u32 tableindex, nibble;
 
 
-	state->samplebuffer = malloc(sizeof(s16) * SAMPLECOUNT * channelcount);
-	state->channelstate = malloc(sizeof(cwav_imaadpcmchannelstate) * channelcount);
+	state->samplebuffer = malloc(2 * SAMPLECOUNT * channelcount);
+	state->channelstate = calloc(channelcount, sizeof(cwav_imaadpcmchannelstate));
+	state->channelcount = channelcount;
 	state->samplecountcapacity = SAMPLECOUNT;
 	state->samplecountavailable = 0;
 	state->samplecountremaining = 0;
 
+	// precompute the signed difference and next table index for every step/nibble pair
+	for(tableindex=0; tableindex<89; tableindex++)
+	{
+		for(nibble=0; nibble<16; nibble++)
+		{
+			s32 step = ima_adpcm_step_table[tableindex];
+			s32 diff = step/8;
+
+			if (nibble & 1) diff += step/4;
+			if (nibble & 2) diff += step/2;
+			if (nibble & 4) diff += step;
+
+			state->difftable[tableindex*16+nibble] = (nibble & 8)? -diff : diff;
+			state->indextable[tableindex*16+nibble] = cwav_imaadpcm_clamp_tableindex(tableindex, ima_adpcm_index_table[nibble]);
+		}
+	}
+
 	if (ctx->channel == 0)
 		return 0;
 
@@ -591,6 +1315,7 @@ int cwav_imaadpcm_setup(cwav_imaadpcmstate* state, cwav_context* ctx, int isloop
 	u32 channelcount = ctx->channelcount;
 	u32 i;
 	u32 startoffset = 0;
+	u32 adpcmsize;
 
 
 	if (ctx->channel == 0)
@@ -615,10 +1340,14 @@ int cwav_imaadpcm_setup(cwav_imaadpcmstate* state, cwav_context* ctx, int isloop
 		startoffset = 0;
 	}
 
+	// two samples per byte, load every byte this pass needs in one read
+	adpcmsize = (state->samplecountremaining + 1) / 2;
+
 	for(i=0; i<channelcount; i++)
 	{
 		cwav_channel* adpcmchannel = &ctx->channel[i];
 		cwav_imaadpcminfo* adpcminfo = &adpcmchannel->infoimaadpcm;
+		cwav_imaadpcmchannelstate* channelstate = &state->channelstate[i];
 
 		if (getle16(adpcmchannel->info.codecref.idtype) != 0x301)
 		{
@@ -626,20 +1355,41 @@ int cwav_imaadpcm_setup(cwav_imaadpcmstate* state, cwav_context* ctx, int isloop
 			return 0;
 		}
 
-		state->channelstate[i].samplebuffer = state->samplebuffer + SAMPLECOUNT * i;
-		state->channelstate[i].sampleoffset = ctx->offset + getle32(adpcmchannel->info.sampleref.offset) + getle32(ctx->header.datablockref.offset) + 8 + startoffset;
+		channelstate->sampleoffset = ctx->offset + getle32(adpcmchannel->info.sampleref.offset) + getle32(ctx->header.datablockref.offset) + 8 + startoffset;
 		if (isloop)
 		{
-			state->channelstate[i].data = getle16(adpcminfo->loopdata);
-			state->channelstate[i].tableindex = adpcminfo->looptableindex;
+			channelstate->data = getle16(adpcminfo->loopdata);
+			channelstate->tableindex = cwav_imaadpcm_clamp_tableindex(adpcminfo->looptableindex, 0);
 		}
 		else
 		{
-			state->channelstate[i].data = getle16(adpcminfo->data);
-			state->channelstate[i].tableindex = adpcminfo->tableindex;
+			channelstate->data = getle16(adpcminfo->data);
+			channelstate->tableindex = cwav_imaadpcm_clamp_tableindex(adpcminfo->tableindex, 0);
+		}
+
+		channelstate->adpcmpos = 0;
+		channelstate->adpcmsize = adpcmsize;
+		if (adpcmsize == 0)
+			continue;
+
+		if (adpcmsize > channelstate->adpcmcapacity)
+		{
+			free(channelstate->adpcmbuffer);
+			channelstate->adpcmbuffer = malloc(adpcmsize);
+			channelstate->adpcmcapacity = adpcmsize;
+			if (channelstate->adpcmbuffer == 0)
+			{
+				fprintf(stderr, "Error allocating memory\n");
+				return 0;
+			}
+		}
+
+		fseek(ctx->file, channelstate->sampleoffset, SEEK_SET);
+		if (adpcmsize != fread(channelstate->adpcmbuffer, 1, adpcmsize, ctx->file))
+		{
+			fprintf(stderr, "Error reading input stream\n");
+			return 0;
 		}
-		stream_in_allocate(&state->channelstate[i].instreamctx, BUFFERSIZE, ctx->file);
-		stream_in_seek(&state->channelstate[i].instreamctx, state->channelstate[i].sampleoffset);
 	}
 
 	return 1;
@@ -657,12 +1407,13 @@ u8 cwav_imaadpcm_clamp_tableindex(u8 tableindex, int inc)
 	return unclamped;
 }
 
-// decode ima-adpcm to pcm signed 16-bit
+// decode ima-adpcm to interleaved little-endian pcm signed 16-bit
 int cwav_imaadpcm_decode(cwav_imaadpcmstate* state, cwav_context* ctx)
 {
 	u32 i, c;
-	u32 maxsamplecount;
+	u32 samplecount;
 	u32 channelcount = ctx->channelcount;
+	u32 stride = channelcount * 2;
 	
 	if (ctx->channel == 0 || state->samplebuffer == 0 || state->channelstate == 0)
 		return 0;
@@ -674,84 +1425,60 @@ int cwav_imaadpcm_decode(cwav_imaadpcmstate* state, cwav_context* ctx)
 		return 1;
 	}
 
-	while(state->samplecountremaining > 0)
-	{
-		u32 samplecountavailable = state->samplecountcapacity - state->samplecountavailable;
-
-		if (state->samplecountremaining < 2)
-			maxsamplecount = state->samplecountremaining;
-		else
-			maxsamplecount = 2;
-
-		if (samplecountavailable < maxsamplecount)
-			break;
-
-		for(c=0; c<channelcount; c++)
-		{	
-			cwav_imaadpcmchannelstate* channelstate = &state->channelstate[c];
-
-			s16* samplebuffer = channelstate->samplebuffer + state->samplecountavailable;
-			stream_in_context* instreamctx = &channelstate->instreamctx;
-			s16 prediction = channelstate->data;
-			u8 tableindex = channelstate->tableindex;
-			cwav_channel* adpcmchannel = &ctx->channel[c];
-			cwav_imaadpcminfo* adpcminfo = &adpcmchannel->infoimaadpcm;			
-			u8 data;
-
-
-			stream_in_reseek(instreamctx);
+	samplecount = state->samplecountcapacity & ~1;
+	if (state->samplecountremaining < samplecount)
+		samplecount = state->samplecountremaining;
 
+	for(c=0; c<channelcount; c++)
+	{	
+		cwav_imaadpcmchannelstate* channelstate = &state->channelstate[c];
+		const u8* adpcm = channelstate->adpcmbuffer + channelstate->adpcmpos;
+		u8* samplebuffer = state->samplebuffer + c * 2;
+		s32 prediction = channelstate->data;
+		u32 tableindex = channelstate->tableindex;
 
-			if (0 == stream_in_byte(instreamctx, &data))
-			{
-				fprintf(stderr, "Error reading input stream\n");
-				return 1;
-			}
+		if (channelstate->adpcmpos + (samplecount + 1) / 2 > channelstate->adpcmsize)
+		{
+			fprintf(stderr, "Error reading input stream\n");
+			return 0;
+		}
 
+		for(i=0; i<samplecount; i++)
+		{
+			u32 nibble = (adpcm[i/2] >> ((i & 1)? 4 : 0)) & 0xF;
+			u32 entry = tableindex*16 + nibble;
 
-			for(i=0; i<maxsamplecount; i++)
-			{
-				s32 nibble = data & 0xF;
-				s32 step = 0;
-				s32 diff = 0;
-
-
-				tableindex = cwav_imaadpcm_clamp_tableindex(tableindex, 0);
-				step = ima_adpcm_step_table[tableindex];
-				tableindex = cwav_imaadpcm_clamp_tableindex(tableindex, ima_adpcm_index_table[nibble]); 
-				
-				diff = step/8;
-				if (nibble & 1) diff += step/4;
-				if (nibble & 2) diff += step/2;
-				if (nibble & 4) diff += step;
-
-				if (nibble & 8) 
-					prediction -= diff;
-				else 
-					prediction += diff;
-
-				if (prediction < -0x8000)
-					prediction = -0x8000;
-				if (prediction > 0x7FFF)
-					prediction = 0x7FFF;
-
-				samplebuffer[i] = prediction;
-				data >>= 4;
-			}
+			prediction += state->difftable[entry];
+			prediction = prediction < -0x8000? -0x8000 : prediction;
+			prediction = prediction > 0x7FFF? 0x7FFF : prediction;
+			tableindex = state->indextable[entry];
 
-			channelstate->data = prediction;
-			channelstate->tableindex = tableindex;
+			samplebuffer[0] = prediction & 0xFF;
+			samplebuffer[1] = (prediction >> 8) & 0xFF;
+			samplebuffer += stride;
 		}
 
-		state->samplecountremaining -= maxsamplecount;
-		state->samplecountavailable += maxsamplecount;
+		channelstate->adpcmpos += (samplecount + 1) / 2;
+		channelstate->data = prediction;
+		channelstate->tableindex = tableindex;
 	}
 
+	state->samplecountremaining -= samplecount;
+	state->samplecountavailable = samplecount;
+
 	return 1;
 }
 
 void cwav_imaadpcm_destroy(cwav_imaadpcmstate* state)
 {
+	u32 i;
+
+	if (state->channelstate)
+	{
+		for(i=0; i<state->channelcount; i++)
+			free(state->channelstate[i].adpcmbuffer);
+	}
+
 	free(state->channelstate);
 	free(state->samplebuffer);
 
@@ -770,7 +1497,7 @@ int cwav_pcm_allocate(cwav_pcmstate* state, cwav_context* ctx)
 	u32 channelcount = ctx->channelcount;
 
 
-	state->samplebuffer = malloc(sizeof(s16) * SAMPLECOUNT * channelcount);
+	state->samplebuffer = malloc(2 * SAMPLECOUNT * channelcount);
 	state->channelstate = malloc(sizeof(cwav_pcmchannelstate) * channelcount);
 	state->samplecountcapacity = SAMPLECOUNT;
 	state->samplecountavailable = 0;
@@ -825,7 +1552,7 @@ int cwav_pcm_setup(cwav_pcmstate* state, cwav_context* ctx, int isloop)
 	{
 		cwav_channel* pcmchannel = &ctx->channel[i];
 
-		state->channelstate[i].samplebuffer = state->samplebuffer + SAMPLECOUNT * i;
+		state->channelstate[i].samplebuffer = state->samplebuffer + 2 * i;
 		state->channelstate[i].sampleoffset = ctx->offset + getle32(pcmchannel->info.sampleref.offset) + getle32(ctx->header.datablockref.offset) + 8 + startoffset;
 		stream_in_allocate(&state->channelstate[i].instreamctx, BUFFERSIZE, ctx->file);
 		stream_in_seek(&state->channelstate[i].instreamctx, state->channelstate[i].sampleoffset);
@@ -834,7 +1561,7 @@ int cwav_pcm_setup(cwav_pcmstate* state, cwav_context* ctx, int isloop)
 	return 1;
 }
 
-// decode pcm to pcm signed 16-bit
+// decode pcm to interleaved little-endian pcm signed 16-bit
 int cwav_pcm_decode(cwav_pcmstate* state, cwav_context* ctx)
 {
 	u32 i, c;
@@ -867,7 +1594,7 @@ int cwav_pcm_decode(cwav_pcmstate* state, cwav_context* ctx)
 		{	
 			cwav_pcmchannelstate* channelstate = &state->channelstate[c];
 
-			s16* samplebuffer = channelstate->samplebuffer + state->samplecountavailable;
+			u8* samplebuffer = channelstate->samplebuffer + state->samplecountavailable * channelcount * 2;
 			stream_in_context* instreamctx = &channelstate->instreamctx;
 			cwav_channel* pcmchannel = &ctx->channel[c];
 			
@@ -885,7 +1612,8 @@ int cwav_pcm_decode(cwav_pcmstate* state, cwav_context* ctx)
 						fprintf(stderr, "Error reading input stream\n");
 						return 1;
 					}
-					samplebuffer[i] = (datahi << 8) | datalo;
+					samplebuffer[i * channelcount * 2 + 0] = datalo;
+					samplebuffer[i * channelcount * 2 + 1] = datahi;
 				}
 				else if (ctx->infoheader.encoding == CWAV_ENCODING_PCM8)
 				{
@@ -894,7 +1622,8 @@ int cwav_pcm_decode(cwav_pcmstate* state, cwav_context* ctx)
 						fprintf(stderr, "Error reading input stream\n");
 						return 1;
 					}
-					samplebuffer[i] = (datahi << 8);
+					samplebuffer[i * channelcount * 2 + 0] = 0;
+					samplebuffer[i * channelcount * 2 + 1] = datahi;
 				}
 			}
 		}
@@ -5,6 +5,7 @@
 #include "types.h"
 #include "settings.h"
 #include "stream.h"
+#include "thread.h"
 
 #define CWAV_ENCODING_PCM8			0
 #define CWAV_ENCODING_PCM16			1
@@ -87,15 +88,28 @@ typedef struct
 {
 	s16 yn1;
 	s16 yn2;
+	s16 coef[16];
 	u32 sampleoffset;
-	s16* samplebuffer;
-	stream_in_context instreamctx;
+	u8* adpcmbuffer;
+	u32 adpcmcapacity;
+	u32 adpcmsize;
+	u32 adpcmpos;
 } cwav_dspadpcmchannelstate;
 
 typedef struct
 {
 	cwav_dspadpcmchannelstate* channelstate;
-	s16* samplebuffer;
+	u8* samplebuffer;
+	u32 stride;
+	u32 samplecount;
+	int result;
+} cwav_dspadpcmchanneljob;
+
+typedef struct
+{
+	cwav_dspadpcmchannelstate* channelstate;
+	u32 channelcount;
+	u8* samplebuffer;
 	u32 samplecountavailable;
 	u32 samplecountcapacity;
 	u32 samplecountremaining;
@@ -106,36 +120,48 @@ typedef struct
 	s16 data;
 	u8 tableindex;
 	u32 sampleoffset;
-	s16* samplebuffer;
-	stream_in_context instreamctx;
+	u8* adpcmbuffer;
+	u32 adpcmcapacity;
+	u32 adpcmsize;
+	u32 adpcmpos;
 } cwav_imaadpcmchannelstate;
 
 typedef struct
 {
 	cwav_imaadpcmchannelstate* channelstate;
-	s16* samplebuffer;
+	u32 channelcount;
+	u8* samplebuffer;
 	u32 samplecountavailable;
 	u32 samplecountcapacity;
 	u32 samplecountremaining;
+	s32 difftable[89*16];
+	u8 indextable[89*16];
 } cwav_imaadpcmstate;
 
 typedef struct
 {
 	u32 sampleoffset;
-	s16* samplebuffer;
+	u8* samplebuffer;
 	stream_in_context instreamctx;
 } cwav_pcmchannelstate;
 
 typedef struct
 {
 	cwav_pcmchannelstate* channelstate;
-	s16* samplebuffer;
+	u8* samplebuffer;
 	u32 samplecountavailable;
 	u32 samplecountcapacity;
 	u32 samplecountremaining;
 } cwav_pcmstate;
 
 
+typedef struct
+{
+	u8* buffer;
+	u32 size;
+	u32 capacity;
+} cwav_loopcache;
+
 typedef struct
 {
 	cwav_reference inforef;
@@ -173,16 +199,35 @@ typedef struct
 	cwav_channel* channel;
 } cwav_context;
 
+typedef struct
+{
+	settings* usersettings;
+	const char* outdir;
+	filepath* inputs;
+	u32 inputcount;
+	u32 inputcapacity;
+	u32 nextinput;
+	u32 failcount;
+	int channelthreads;
+	mutex_context mutex;
+} cwav_batch_context;
+
 void cwav_init(cwav_context* ctx);
 void cwav_set_file(cwav_context* ctx, FILE* file);
 void cwav_set_offset(cwav_context* ctx, u32 offset);
 void cwav_set_size(cwav_context* ctx, u32 size);
 void cwav_set_usersettings(cwav_context* ctx, settings* usersettings);
+void cwav_read_info(cwav_context* ctx);
 void cwav_process(cwav_context* ctx, u32 actions);
+void cwav_loopcache_init(cwav_loopcache* cache);
+int  cwav_loopcache_append(cwav_loopcache* cache, const u8* data, u32 size);
+void cwav_loopcache_destroy(cwav_loopcache* cache);
 void cwav_dspadpcm_init(cwav_dspadpcmstate* state);
 int cwav_dspadpcm_allocate(cwav_dspadpcmstate* state, cwav_context* ctx);
 int  cwav_dspadpcm_setup(cwav_dspadpcmstate* state, cwav_context* ctx, int isloop);
+int  cwav_dspadpcm_decode_channel(cwav_dspadpcmchannelstate* channelstate, u8* samplebuffer, u32 stride, u32 samplecount);
 int  cwav_dspadpcm_decode(cwav_dspadpcmstate* state, cwav_context* ctx);
+int  cwav_dspadpcm_decode_threaded(cwav_dspadpcmstate* state, cwav_context* ctx, u8* samplebuffer);
 int	 cwav_dspadpcm_decode_to_wav(cwav_context* ctx, stream_out_context* outstreamctx);
 void cwav_dspadpcm_destroy(cwav_dspadpcmstate* state);
 void cwav_imaadpcm_init(cwav_imaadpcmstate* state);
@@ -198,8 +243,12 @@ int  cwav_pcm_setup(cwav_pcmstate* state, cwav_context* ctx, int isloop);
 int  cwav_pcm_decode(cwav_pcmstate* state, cwav_context* ctx);
 int	 cwav_pcm_decode_to_wav(cwav_context* ctx, stream_out_context* outstreamctx);
 void cwav_pcm_destroy(cwav_pcmstate* state);
+void cwav_build_wav_header(cwav_context* ctx, wav_pcm_header* header, u32 size);
 void cwav_write_wav_header(cwav_context* ctx, stream_out_context* outstreamctx, u32 size);
 int  cwav_save_to_wav(cwav_context* ctx, const char* filepath);
+int  cwav_decode_pass(cwav_context* ctx, int isloop, int channelthreads, u8** buffer, u32* size);
+int  cwav_save_to_wav_vectored(cwav_context* ctx, const char* filepath, int channelthreads);
+int  cwav_batch_process(settings* usersettings, char** inputs, u32 inputcount);
 void cwav_print(cwav_context* ctx);
 
 #endif // _CWAV_H_
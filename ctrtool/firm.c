@@ -5,6 +5,7 @@
 #include "types.h"
 #include "firm.h"
 #include "utils.h"
+#include "thread.h"
 
 void firm_init(firm_context* ctx)
 {
@@ -31,18 +32,49 @@ void firm_set_usersettings(firm_context* ctx, settings* usersettings)
 	ctx->usersettings = usersettings;
 }
 
+// read the whole FIRM image in one go, sections are hashed and saved from this buffer
+int firm_load_image(firm_context* ctx)
+{
+	if (ctx->image)
+		return 1;
+
+	if (ctx->size <= sizeof(firm_header))
+		return 0;
+
+	ctx->image = malloc(ctx->size);
+	if (ctx->image == 0)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		return 0;
+	}
+
+	fseek(ctx->file, ctx->offset, SEEK_SET);
+	ctx->imagesize = fread(ctx->image, 1, ctx->size, ctx->file);
+
+	return 1;
+}
+
+static const u8* firm_section_data(firm_context* ctx, firm_sectionheader* section)
+{
+	u32 offset = getle32(section->offset);
+	u32 size = getle32(section->size);
+
+	if (ctx->image == 0 || offset > ctx->imagesize || size > ctx->imagesize - offset)
+		return 0;
+
+	return ctx->image + offset;
+}
+
 void firm_save(firm_context* ctx, u32 index, u32 flags)
 {
 	firm_sectionheader* section = (firm_sectionheader*)(ctx->header.section + index);
-	u32 offset;
 	u32 size;
 	u32 address;
 	FILE* fout;
 	filepath outpath;
-	u8 buffer[16 * 1024];
+	const u8* data;
 	
 	
-	offset = getle32(section->offset);
 	size = getle32(section->size);
 	address = getle32(section->address);
 	filepath_copy(&outpath, settings_get_firm_dir_path(ctx->usersettings));
@@ -57,42 +89,26 @@ void firm_save(firm_context* ctx, u32 index, u32 flags)
 		return;
 	}
 
+	data = firm_section_data(ctx, section);
+	if (data == 0)
+	{
+		fprintf(stdout, "Error reading input file\n");
+		return;
+	}
+
 	fout = fopen(outpath.pathname, "wb");
 	if (fout == 0)
 	{
 		fprintf(stderr, "Error, failed to create file %s\n", outpath.pathname);
-		goto clean;
+		return;
 	}
-	
-	
 
-	fseek(ctx->file, ctx->offset + offset, SEEK_SET);
 	fprintf(stdout, "Saving section %d to %s...\n", index, outpath.pathname);
 
-	while(size)
-	{
-		u32 max = sizeof(buffer);
-		if (max > size)
-			max = size;
-
-		if (max != fread(buffer, 1, max, ctx->file))
-		{
-			fprintf(stdout, "Error reading input file\n");
-			goto clean;
-		}
-
-		if (max != fwrite(buffer, 1, max, fout))
-		{
-			fprintf(stdout, "Error writing output file\n");
-			goto clean;
-		}
-
-		size -= max;
-	}
+	if (size != fwrite(data, 1, size, fout))
+		fprintf(stdout, "Error writing output file\n");
 
-
-clean:
-	return;
+	fclose(fout);
 }
 
 
@@ -109,6 +125,9 @@ void firm_process(firm_context* ctx, u32 actions)
 		return;
 	}
 
+	if (actions & (VerifyFlag | ExtractFlag))
+		firm_load_image(ctx);
+
 
 	if (actions & VerifyFlag)
 	{
@@ -132,60 +151,71 @@ void firm_process(firm_context* ctx, u32 actions)
 				firm_save(ctx, i, actions);
 		}
 	}
+
+	free(ctx->image);
+	ctx->image = 0;
+	ctx->imagesize = 0;
 }
 
-int firm_verify(firm_context* ctx, u32 flags)
+static void firm_hash_worker(void* arg)
 {
-	unsigned int i;
-	u32 offset;
-	u32 size;
-	u8 buffer[16 * 1024];
-	u8 hash[0x20];
+	firm_hashjob* job = (firm_hashjob*)arg;
 
+	ctr_sha_256(job->data, job->size, job->hash);
+}
 
-	for(i=0; i<4; i++)
-	{
-		firm_sectionheader* section = (firm_sectionheader*)(ctx->header.section + i);
-	
+int firm_verify(firm_context* ctx, u32 flags)
+{
+	unsigned int i;
+	unsigned int count;
+	unsigned int jobcount = 0;
+	firm_hashjob jobs[4];
+	thread_context threads[4];
+	unsigned int jobsection[4];
 
-		offset = getle32(section->offset);
-		size = getle32(section->size);
 
-		if (size == 0)
-			return 0;
+	if (0 == firm_load_image(ctx))
+		return 0;
 
-		fseek(ctx->file, ctx->offset + offset, SEEK_SET);
+	// sections are checked up to the first empty one, a section outside the image is marked bad and the rest are still checked
+	for(count=0; count<4; count++)
+	{
+		firm_sectionheader* section = (firm_sectionheader*)(ctx->header.section + count);
 
-		ctr_sha_256_init(&ctx->sha);
+		if (getle32(section->size) == 0)
+			break;
 
-		while(size)
+		jobs[jobcount].data = firm_section_data(ctx, section);
+		jobs[jobcount].size = getle32(section->size);
+		if (jobs[jobcount].data == 0)
 		{
-			u32 max = sizeof(buffer);
-			if (max > size)
-				max = size;
-
-			if (max != fread(buffer, 1, max, ctx->file))
-			{
-				fprintf(stdout, "Error reading input file\n");
-				goto clean;
-			}
+			fprintf(stdout, "Error reading input file\n");
+			ctx->hashcheck[count] = Fail;
+			continue;
+		}
+		jobsection[jobcount++] = count;
+	}
 
-			ctr_sha_256_update(&ctx->sha, buffer, max);
+	// the four section hashes are independent, compute them concurrently
+	for(i=1; i<jobcount; i++)
+		thread_start(&threads[i], firm_hash_worker, &jobs[i]);
 
-			size -= max;
-		}	
+	if (jobcount)
+		firm_hash_worker(&jobs[0]);
 
-		ctr_sha_256_finish(&ctx->sha, hash);
+	for(i=1; i<jobcount; i++)
+		thread_join(&threads[i]);
 
+	for(i=0; i<jobcount; i++)
+	{
+		firm_sectionheader* section = (firm_sectionheader*)(ctx->header.section + jobsection[i]);
 
-		if (memcmp(hash, section->hash, 0x20) == 0)
-			ctx->hashcheck[i] = Good;
+		if (memcmp(jobs[i].hash, section->hash, 0x20) == 0)
+			ctx->hashcheck[jobsection[i]] = Good;
 		else
-			ctx->hashcheck[i] = Fail;
+			ctx->hashcheck[jobsection[i]] = Fail;
 	}
 
-
-clean:
 	return 0;
 }
 
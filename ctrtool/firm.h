@@ -31,6 +31,13 @@ typedef struct
 	u8 signature[0x100];
 } firm_header;
 
+typedef struct
+{
+	const u8* data;
+	u32 size;
+	u8 hash[0x20];
+} firm_hashjob;
+
 typedef struct
 {
 	FILE* file;
@@ -38,7 +45,8 @@ typedef struct
 	u32 offset;
 	u32 size;
 	firm_header header;
-	ctr_sha256_context sha;
+	u8* image;
+	u32 imagesize;
 	int hashcheck[4];
 	int headersigcheck;
 } firm_context;
@@ -48,6 +56,7 @@ void firm_set_file(firm_context* ctx, FILE* file);
 void firm_set_offset(firm_context* ctx, u32 offset);
 void firm_set_size(firm_context* ctx, u32 size);
 void firm_set_usersettings(firm_context* ctx, settings* usersettings);
+int  firm_load_image(firm_context* ctx);
 void firm_process(firm_context* ctx, u32 actions);
 void firm_print(firm_context* ctx);
 void firm_save(firm_context* ctx, u32 index, u32 flags);
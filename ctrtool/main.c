@@ -78,6 +78,9 @@ static void usage(const char *argv0)
 		   "CWAV options:\n"
 		   "  --wav=file         Specify wav output file.\n"
 		   "  --wavloops=count   Specify wav loop count, default 0.\n"
+		   "  --wavdir=dir       Convert every CWAV input file or directory to wav files\n"
+		   "                        in this directory.\n"
+		   "  --jobs=count       Specify worker thread count for --wavdir, default all cpus.\n"
 		   "ROMFS options:\n"
 		   "  --romfsdir=dir     Specify RomFS directory path.\n"
 		   "  --listromfs        List files in RomFS.\n"
@@ -142,6 +145,8 @@ int main(int argc, char* argv[])
 			{"listromfs", 0, NULL, 18},
 			{"wavloops", 1, NULL, 19},
 			{"logo", 1, NULL, 20},
+			{"wavdir", 1, NULL, 21},
+			{"jobs", 1, NULL, 22},
 			{NULL},
 		};
 
@@ -226,12 +231,23 @@ int main(int argc, char* argv[])
 			case 18: settings_set_list_romfs_files(&ctx.usersettings, 1); break;
 			case 19: settings_set_cwav_loopcount(&ctx.usersettings, strtoul(optarg, 0, 0)); break;
 			case 20: settings_set_logo_path(&ctx.usersettings, optarg); break;
+			case 21: settings_set_wav_dir_path(&ctx.usersettings, optarg); break;
+			case 22: settings_set_job_count(&ctx.usersettings, strtoul(optarg, 0, 0)); break;
 
 			default:
 				usage(argv[0]);
 		}
 	}
 
+	if (settings_get_wav_dir_path(&ctx.usersettings)->valid)
+	{
+		// Batch CWAV conversion, every extra argument is an input file or directory
+		if (optind >= argc)
+			usage(argv[0]);
+
+		return cwav_batch_process(&ctx.usersettings, argv + optind, argc - optind)? 0 : -1;
+	}
+
 	if (optind == argc - 1) 
 	{
 		// Exactly one extra argument - an input file
@@ -15,6 +15,14 @@ filepath* settings_get_wav_path(settings* usersettings)
 		return 0;
 }
 
+filepath* settings_get_wav_dir_path(settings* usersettings)
+{
+	if (usersettings)
+		return &usersettings->wavdirpath;
+	else
+		return 0;
+}
+
 filepath* settings_get_lzss_path(settings* usersettings)
 {
 	if (usersettings)
@@ -177,11 +185,24 @@ int settings_get_cwav_loopcount(settings* usersettings)
 		return 0;
 }
 
+unsigned int settings_get_job_count(settings* usersettings)
+{
+	if (usersettings)
+		return usersettings->jobcount;
+	else
+		return 0;
+}
+
 void settings_set_wav_path(settings* usersettings, const char* path)
 {
 	filepath_set(&usersettings->wavpath, path);
 }
 
+void settings_set_wav_dir_path(settings* usersettings, const char* path)
+{
+	filepath_set(&usersettings->wavdirpath, path);
+}
+
 void settings_set_lzss_path(settings* usersettings, const char* path)
 {
 	filepath_set(&usersettings->lzsspath, path);
@@ -267,3 +288,8 @@ void settings_set_cwav_loopcount(settings* usersettings, u32 loopcount)
 {
 	usersettings->cwavloopcount = loopcount;
 }
+
+void settings_set_job_count(settings* usersettings, u32 jobcount)
+{
+	usersettings->jobcount = jobcount;
+}
@@ -22,10 +22,12 @@ typedef struct
 	filepath metapath;	
 	filepath lzsspath;
 	filepath wavpath;
+	filepath wavdirpath;
 	unsigned int mediaunitsize;
 	int ignoreprogramid;
 	int listromfs;
 	u32 cwavloopcount;
+	u32 jobcount;
 } settings;
 
 void settings_init(settings* usersettings);
@@ -43,6 +45,7 @@ filepath* settings_get_exefs_dir_path(settings* usersettings);
 filepath* settings_get_romfs_dir_path(settings* usersettings);
 filepath* settings_get_firm_dir_path(settings* usersettings);
 filepath* settings_get_wav_path(settings* usersettings);
+filepath* settings_get_wav_dir_path(settings* usersettings);
 unsigned int settings_get_mediaunit_size(settings* usersettings);
 unsigned char* settings_get_ncch_key(settings* usersettings);
 unsigned char* settings_get_ncch_fixedsystemkey(settings* usersettings);
@@ -50,6 +53,7 @@ unsigned char* settings_get_common_key(settings* usersettings);
 int settings_get_ignore_programid(settings* usersettings);
 int settings_get_list_romfs_files(settings* usersettings);
 int settings_get_cwav_loopcount(settings* usersettings);
+unsigned int settings_get_job_count(settings* usersettings);
 
 void settings_set_lzss_path(settings* usersettings, const char* path);
 void settings_set_exefs_path(settings* usersettings, const char* path);
@@ -65,9 +69,11 @@ void settings_set_exefs_dir_path(settings* usersettings, const char* path);
 void settings_set_romfs_dir_path(settings* usersettings, const char* path);
 void settings_set_firm_dir_path(settings* usersettings, const char* path);
 void settings_set_wav_path(settings* usersettings, const char* path);
+void settings_set_wav_dir_path(settings* usersettings, const char* path);
 void settings_set_mediaunit_size(settings* usersettings, unsigned int size);
 void settings_set_ignore_programid(settings* usersettings, int enable);
 void settings_set_list_romfs_files(settings* usersettings, int enable);
 void settings_set_cwav_loopcount(settings* usersettings, u32 loopcount);
+void settings_set_job_count(settings* usersettings, u32 jobcount);
 
 #endif // _SETTINGS_H_
@@ -2,6 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
 
 #include "types.h"
 #include "stream.h"
@@ -103,12 +108,34 @@ int stream_out_byte(stream_out_context* ctx, u8 byte)
 
 int stream_out_buffer(stream_out_context* ctx, const void* buffer, u32 size)
 {
-	u32 i;
+	const u8* bytes = (const u8*)buffer;
 
-	for(i=0; i<size; i++)
+	while(size > 0)
 	{
-		if (!stream_out_byte(ctx, ((u8*)buffer)[i]))
-			return 0;
+		u32 count;
+
+		if (ctx->outbufferpos >= ctx->outbuffersize)
+		{
+			if (stream_out_flush(ctx) == 0)
+				return 0;
+		}
+
+		// large writes bypass the buffer once it is empty
+		if (ctx->outbufferpos == 0 && size >= ctx->outbuffersize)
+		{
+			if (fwrite(bytes, 1, size, ctx->outfile) != size)
+				return 0;
+			return 1;
+		}
+
+		count = ctx->outbuffersize - ctx->outbufferpos;
+		if (count > size)
+			count = size;
+
+		memcpy(ctx->outbuffer + ctx->outbufferpos, bytes, count);
+		ctx->outbufferpos += count;
+		bytes += count;
+		size -= count;
 	}
 
 	return 1;
@@ -135,4 +162,79 @@ void stream_out_position(stream_out_context* ctx, u32* position)
 	*position = ftell(ctx->outfile);
 }
 
+int stream_write_vectored(FILE* file, const stream_vector* vectors, u32 count)
+{
+#ifdef _WIN32
+	u32 i;
 
+	for(i=0; i<count; i++)
+	{
+		if (vectors[i].size && fwrite(vectors[i].buffer, 1, vectors[i].size, file) != vectors[i].size)
+			return 0;
+	}
+
+	return 1;
+#else
+#ifdef IOV_MAX
+	struct iovec iov[IOV_MAX < 1024? IOV_MAX : 1024];
+#else
+	struct iovec iov[16];
+#endif
+	u32 maxcount = sizeof(iov) / sizeof(iov[0]);
+	int fd = fileno(file);
+
+
+	if (fflush(file) != 0)
+		return 0;
+
+	while(count > 0)
+	{
+		u32 iovcount = count < maxcount? count : maxcount;
+		u32 i;
+		ssize_t written;
+
+		for(i=0; i<iovcount; i++)
+		{
+			iov[i].iov_base = (void*)vectors[i].buffer;
+			iov[i].iov_len = vectors[i].size;
+		}
+
+		written = writev(fd, iov, iovcount);
+		if (written < 0)
+			return 0;
+
+		// skip fully written vectors, and finish a partially written one with plain writes
+		for(i=0; i<iovcount; i++)
+		{
+			const u8* buffer = vectors[i].buffer;
+			u32 size = vectors[i].size;
+
+			if ((size_t)written >= size)
+			{
+				written -= size;
+				continue;
+			}
+
+			buffer += written;
+			size -= written;
+			written = 0;
+
+			while(size > 0)
+			{
+				ssize_t partial = write(fd, buffer, size);
+
+				if (partial <= 0)
+					return 0;
+
+				buffer += partial;
+				size -= partial;
+			}
+		}
+
+		vectors += iovcount;
+		count -= iovcount;
+	}
+
+	return 1;
+#endif
+}
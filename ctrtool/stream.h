@@ -22,6 +22,12 @@ typedef struct
 	u32 outbufferpos;
 } stream_out_context;
 
+typedef struct
+{
+	const void* buffer;
+	u32 size;
+} stream_vector;
+
 // create/destroy
 void stream_in_init(stream_in_context* ctx);
 void stream_in_allocate(stream_in_context* ctx, u32 buffersize, FILE* file);
@@ -42,4 +48,6 @@ void stream_out_seek(stream_out_context* ctx, u32 position);
 void stream_out_skip(stream_out_context* ctx, u32 size);
 void stream_out_position(stream_out_context* ctx, u32* position);
 
+int  stream_write_vectored(FILE* file, const stream_vector* vectors, u32 count);
+
 #endif // __STREAM_H__
@@ -32,6 +32,15 @@
 #define BLZ_N         0x1002     // max offset ((1 << 12) + 2)
 #define BLZ_F         0x12       // max coded ((1 << 4) + BLZ_THRESHOLD)
 
+#define BLZ_HASH_BITS 15         // match finder hash of the next bytes
+#define BLZ_HASH_SIZE (1 << BLZ_HASH_BITS)
+#define BLZ_LEVELS    3          // hash chains, see blz_key
+#define BLZ_WINDOW    0x2000     // chained positions kept, power of 2 > BLZ_N
+#define BLZ_CHAIN     0x20       // max candidates checked per position, BLZ_FAST
+
+#define BLZ_RAW_COST  9          // bits to code a byte, flag included
+#define BLZ_LZ_COST   17         // bits to code a match, flag included
+
 #define RAW_MINIM     0x00000000 // empty file, 0 bytes
 #define RAW_MAXIM     0x00FFFFFF // 3-bytes length, 16MB - 1
 
@@ -49,9 +58,29 @@
 /*----------------------------------------------------------------------------*/
 u8 *Memory(int length, int size);
 
-u8 *BLZ_Code(u8 *raw_buffer, int raw_len, u32 *new_len, int best);
+u8 *BLZ_Code(u8 *raw_buffer, int raw_len, u32 *new_len, int mode);
 void  BLZ_Invert(u8 *buffer, int length);
 
+/*----------------------------------------------------------------------------*/
+// Hash chains over every position of the (inverted) raw buffer, newest first,
+// so candidates are visited in the same order as a plain window scan.
+// Each chain hashes a different number of bytes, the longer ones are
+// searched first so short common strings rarely need walking.
+const int blz_key[BLZ_LEVELS] = { 6, 4, 3 };
+
+typedef struct {
+  u8 *buffer, *end;
+  int *head[BLZ_LEVELS];         // newest position for each hash
+  int *prev[BLZ_LEVELS];         // previous position with the same hash
+  int  ins;                      // next position to chain
+  int  chain;                    // max candidates per chain search, 0 = all
+} blz_finder;
+
+void BLZ_InitFinder(blz_finder *mf, u8 *buffer, int length, int chain);
+void BLZ_FreeFinder(blz_finder *mf);
+u32  BLZ_Search(blz_finder *mf, u8 *raw, u32 *pos_best);
+void BLZ_Parse(blz_finder *mf, int length, u8 *len_opt, u16 *pos_opt);
+
 /*----------------------------------------------------------------------------*/
 u8 *Memory(int length, int size) {
   u8 *fb;
@@ -181,30 +210,147 @@ u8* BLZ_Encode(char *filename, u32* pak_len, int mode) {
 }
 
 /*----------------------------------------------------------------------------*/
-u8 *BLZ_Code(u8 *raw_buffer, int raw_len, u32 *new_len, int best) {
+void BLZ_InitFinder(blz_finder *mf, u8 *buffer, int length, int chain) {
+  int lv;
+
+  mf->buffer = buffer;
+  mf->end = buffer + length;
+  for (lv = 0; lv < BLZ_LEVELS; lv++) {
+    mf->head[lv] = (int *) Memory(BLZ_HASH_SIZE, sizeof(int));
+    mf->prev[lv] = (int *) Memory(BLZ_WINDOW, sizeof(int));
+    memset(mf->head[lv], 0xFF, BLZ_HASH_SIZE * sizeof(int));
+  }
+  mf->ins = 0;
+  mf->chain = chain;
+}
+
+void BLZ_FreeFinder(blz_finder *mf) {
+  int lv;
+
+  for (lv = 0; lv < BLZ_LEVELS; lv++) {
+    free(mf->head[lv]);
+    free(mf->prev[lv]);
+  }
+}
+
+/*----------------------------------------------------------------------------*/
+u32 BLZ_Hash(u8 *p, int bytes) {
+  u32 h = 0;
+
+  while (bytes--) h = (h << 8) ^ (h >> 24) ^ *p++;
+
+  return((h * 0x9E3779B1) >> (32 - BLZ_HASH_BITS));
+}
+
+/*----------------------------------------------------------------------------*/
+// Longest match for raw at offsets 3..BLZ_N, the nearest one on ties.
+// Returns BLZ_THRESHOLD (and leaves pos_best alone) if there is none.
+u32 BLZ_Search(blz_finder *mf, u8 *raw, u32 *pos_best) {
+  int cur, max, pos, cand, left, lv, bytes;
+  u32 len, lim, cap, top, l;
+
+  l = BLZ_THRESHOLD;
+  cur = raw - mf->buffer;
+
+  // Chain every position a match may start from, they are never unchained
+  // since searches only move back by the LZ-CUE lookahead (< BLZ_WINDOW)
+  for (; mf->ins <= cur - 3; mf->ins++) {
+    for (lv = 0; lv < BLZ_LEVELS; lv++) {
+      bytes = blz_key[lv];
+      if (mf->ins + bytes > mf->end - mf->buffer) continue;
+      u32 h = BLZ_Hash(mf->buffer + mf->ins, bytes);
+      mf->prev[lv][mf->ins & (BLZ_WINDOW - 1)] = mf->head[lv][h];
+      mf->head[lv][h] = mf->ins;
+    }
+  }
+
+  max = cur >= BLZ_N ? BLZ_N : cur;
+  lim = mf->end - raw < BLZ_F ? mf->end - raw : BLZ_F;
+
+  // A match of at least blz_key[lv] bytes is in chain lv, and in the walk
+  // of it that match is as near as it can be. If that chain has none, the
+  // longest can only be shorter than blz_key[lv].
+  for (lv = 0; lv < BLZ_LEVELS; lv++) {
+    bytes = blz_key[lv];
+    if (lim < bytes) continue;
+
+    l = BLZ_THRESHOLD;
+    top = lv ? blz_key[lv - 1] - 1 : BLZ_F;
+    left = mf->chain;
+    for (cand = mf->head[lv][BLZ_Hash(raw, bytes)]; cand >= 0; cand = mf->prev[lv][cand & (BLZ_WINDOW - 1)]) {
+      pos = cur - cand;
+      if (pos < 3) continue;     // chained ahead of raw by a lookahead search
+      if (pos > max) break;
+
+      if (left && !--left) left = -1;
+
+      // Only a candidate that also matches the byte after the best so far can beat it
+      cap = lim > pos ? pos : lim;
+      if (cap > top) cap = top;
+      if (cap > l && *(raw + l) == *(raw + l - pos)) {
+        for (len = 0; len < cap; len++)
+          if (*(raw + len) != *(raw + len - pos)) break;
+
+        if (len > l) {
+          *pos_best = pos;
+          if ((l = len) == top) break;
+        }
+      }
+
+      if (left < 0) break;
+    }
+
+    if (l >= bytes) break;
+  }
+
+  return(l);
+}
+
+/*----------------------------------------------------------------------------*/
+// Optimal parse: the longest match at every position, then the cheapest way
+// to code each suffix. A match can be cut to any length >= 3 at the same
+// offset and costs the same whatever the offset, so that is all it needs.
+// Leaves the length to code at each position in len_opt (1 = raw byte).
+void BLZ_Parse(blz_finder *mf, int length, u8 *len_opt, u16 *pos_opt) {
+  u32 *cost, len, pos, cur;
+  int   i;
+
+  for (i = 0; i < length; i++) {
+    len_opt[i] = BLZ_Search(mf, mf->buffer + i, &pos);
+    pos_opt[i] = pos;
+  }
+
+  cost = (u32 *) Memory((length + 1) * sizeof(u32), sizeof(char));
+
+  for (i = length - 1; i >= 0; i--) {
+    cost[i] = cost[i + 1] + BLZ_RAW_COST;
+    cur = 1;
+    for (len = len_opt[i]; len > BLZ_THRESHOLD; len--) {
+      if (cost[i + len] + BLZ_LZ_COST < cost[i]) {
+        cost[i] = cost[i + len] + BLZ_LZ_COST;
+        cur = len;
+      }
+    }
+    len_opt[i] = cur;
+  }
+
+  free(cost);
+}
+
+/*----------------------------------------------------------------------------*/
+u8 *BLZ_Code(u8 *raw_buffer, int raw_len, u32 *new_len, int mode) {
   u8 *pak_buffer, *pak, *raw, *raw_end, *flg, *tmp;
-  u32   pak_len, inc_len, hdr_len, enc_len, len, pos, max;
+  u32   pak_len, inc_len, hdr_len, enc_len, len;
   u32   len_best, pos_best, len_next, pos_next, len_post, pos_post;
   u32   pak_tmp, raw_tmp;
-  u8  mask;
-
-#define SEARCH(l,p) { \
-  l = BLZ_THRESHOLD;                                          \
-                                                              \
-  max = raw - raw_buffer >= BLZ_N ? BLZ_N : raw - raw_buffer; \
-  for (pos = 3; pos <= max; pos++) {                          \
-    for (len = 0; len < BLZ_F; len++) {                       \
-      if (raw + len == raw_end) break;                        \
-      if (len >= pos) break;                                  \
-      if (*(raw + len) != *(raw + len - pos)) break;          \
-    }                                                         \
-                                                              \
-    if (len > l) {                                            \
-      p = pos;                                                \
-      if ((l = len) == BLZ_F) break;                          \
-    }                                                         \
-  }                                                           \
-}
+  u8  mask, *len_opt;
+  u16  *pos_opt;
+  int   best;
+  blz_finder mf;
+
+#define SEARCH(l,p) { l = BLZ_Search(&mf, raw, &p); }
+
+  best = mode == BLZ_BEST;
 
   pak_tmp = 0;
   raw_tmp = raw_len;
@@ -213,6 +359,15 @@ u8 *BLZ_Code(u8 *raw_buffer, int raw_len, u32 *new_len, int best) {
   pak_buffer = (u8 *) Memory(pak_len, sizeof(char));
 
   BLZ_Invert(raw_buffer, raw_len);
+  BLZ_InitFinder(&mf, raw_buffer, raw_len, mode == BLZ_FAST ? BLZ_CHAIN : 0);
+
+  len_opt = NULL;
+  pos_opt = NULL;
+  if (mode == BLZ_OPTIMAL) {
+    len_opt = (u8 *) Memory(raw_len + 1, sizeof(char));
+    pos_opt = (u16 *) Memory((raw_len + 1) * sizeof(u16), sizeof(char));
+    BLZ_Parse(&mf, raw_len, len_opt, pos_opt);
+  }
 
   pak = pak_buffer;
   raw = raw_buffer;
@@ -226,7 +381,11 @@ u8 *BLZ_Code(u8 *raw_buffer, int raw_len, u32 *new_len, int best) {
       mask = BLZ_MASK;
     }
 
-    SEARCH(len_best, pos_best);
+    if (len_opt) {
+      len_best = len_opt[raw - raw_buffer];
+      pos_best = pos_opt[raw - raw_buffer];
+    } else
+      SEARCH(len_best, pos_best);
 
     // LZ-CUE optimization start
     if (best) {
@@ -270,6 +429,9 @@ u8 *BLZ_Code(u8 *raw_buffer, int raw_len, u32 *new_len, int best) {
 
   pak_len = pak - pak_buffer;
 
+  BLZ_FreeFinder(&mf);
+  free(len_opt);
+  free(pos_opt);
   BLZ_Invert(raw_buffer, raw_len);
   BLZ_Invert(pak_buffer, pak_len);
 
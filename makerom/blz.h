@@ -2,5 +2,7 @@
 
 #define BLZ_NORMAL    0          // normal mode
 #define BLZ_BEST      1          // best mode
+#define BLZ_FAST      2          // normal mode, bounded match search (may differ)
+#define BLZ_OPTIMAL   3          // optimal parse
 
-u8 *BLZ_Code(u8 *raw_buffer, int raw_len, u32 *new_len, int best);
\ No newline at end of file
+u8 *BLZ_Code(u8 *raw_buffer, int raw_len, u32 *new_len, int mode);
\ No newline at end of file
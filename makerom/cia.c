@@ -27,8 +27,11 @@ int GetSettingsFromCci(cia_settings *ciaset);
 
 u16 SetupVersion(u16 Major, u16 Minor, u16 Micro);
 
-void GetContentHashes(cia_settings *ciaset);
-void EncryptContent(cia_settings *ciaset);
+int ProcessContent(cia_settings *ciaset);
+void ProcessContentQueue(void *arg);
+u8* GetContentChunk(cia_settings *ciaset, int i, u64 pos, u32 len, u8 *buffer);
+void WriteContentChunk(cia_settings *ciaset, mutex_context *lock, int i, u64 pos, u8 *data, u32 len);
+void EncryptContentChunk(void *arg);
 
 int BuildCIA_CertChain(cia_settings *ciaset);
 int BuildCIA_Header(cia_settings *ciaset);
@@ -36,6 +39,32 @@ int BuildCIA_Header(cia_settings *ciaset);
 int WriteCIAtoFile(cia_settings *ciaset);
 
 int CryptContent(u8 *EncBuffer,u8 *DecBuffer,u64 size,u8 *title_key, u16 index, u8 mode);
+void GetContentIv(u8 iv[16], u16 index);
+
+const u32 CIA_CONTENT_CHUNK_SIZE = 0x400000; // Contents are read, hashed, encrypted and written at this granularity
+const u32 CIA_BATCH_CHUNK_SIZE = 0x100000; // Per content, when contents are batched
+
+// Contents are handed out to worker threads one at a time
+typedef struct
+{
+	cia_settings *ciaset;
+	mutex_context lock;
+	mutex_context outLock;
+	int next;
+	int batchSize;
+	bool pipeline;
+	int result;
+} cia_contentqueue;
+
+typedef struct
+{
+	ctr_aes_context *aes;
+	u8 *data;
+	u32 size;
+} cia_cryptjob;
+
+int HashAndEncryptContent(cia_contentqueue *queue, int i);
+int HashAndEncryptContents(cia_contentqueue *queue, int first, int num);
 
 
 int build_CIA(user_settings *usrset)
@@ -72,13 +101,18 @@ int build_CIA(user_settings *usrset)
 	result = BuildTicket(ciaset);
 	if(result) goto finish;
 
-	/* Title Metadata */
-	result = BuildTMD(ciaset);
-	if(result) goto finish;
-
 	/* CIA Header */
+	ciaset->ciaSections.tmd.size = PredictTMDSize(ciaset->content.count);
 	result = BuildCIA_Header(ciaset);
 	if(result) goto finish;
+
+	/* Content, streamed to the outfile as it is hashed */
+	result = ProcessContent(ciaset);
+	if(result) goto finish;
+
+	/* Title Metadata */
+	result = BuildTMD(ciaset);
+	if(result) goto finish;
 	
 	/* Write To File */
 	result = WriteCIAtoFile(ciaset);
@@ -101,11 +135,12 @@ void init_CIASettings(cia_settings *set)
 void free_CIASettings(cia_settings *set)
 {
 	if(set->content.filePtrs){
-		for(u32 i = 1; i < set->content.count; i++){
-			fclose(set->content.filePtrs[i]);
+		for(u32 i = 0; i < CIA_MAX_CONTENT; i++){
+			if(set->content.filePtrs[i]) fclose(set->content.filePtrs[i]);
 		}
 		free(set->content.filePtrs);
 	}
+	free(set->content.retarget);
 	free(set->ciaSections.certChain.buffer);
 	free(set->ciaSections.tik.buffer);
 	free(set->ciaSections.tmd.buffer);
@@ -148,11 +183,6 @@ int get_CIASettings(cia_settings *ciaset, user_settings *usrset)
 			return result;
 	}
 	
-	GetContentHashes(ciaset);
-
-	if(ciaset->content.encryptCia)
-		EncryptContent(ciaset);
-
 	return 0;
 }
 
@@ -379,6 +409,17 @@ int GetContentFilePtrs(cia_settings *ciaset, user_settings *usrset)
 		return MEM_ERROR; 
 	}
 	memset(ciaset->content.filePtrs,0,sizeof(FILE*)*CIA_MAX_CONTENT);
+
+	// Prebuilt content 0 is streamed from its file, only the data before its RomFs was imported
+	if(!usrset->ncch.buildNcch0){
+		ciaset->content.fileSize[0] = GetFileSize_u64(usrset->common.contentPath[0]);
+		ciaset->content.filePtrs[0] = fopen(usrset->common.contentPath[0],"rb");
+		if(!ciaset->content.filePtrs[0]){
+			fprintf(stderr,"[CIA ERROR] Failed to open \"%s\"\n",usrset->common.contentPath[0]); 
+			return FAILED_TO_OPEN_FILE; 
+		}
+	}
+
 	int j = 1;
 	ncch_hdr *hdr = malloc(sizeof(ncch_hdr));
 	for(int i = 1; i < CIA_MAX_CONTENT; i++){
@@ -434,19 +475,23 @@ int GetContentFilePtrs(cia_settings *ciaset, user_settings *usrset)
 
 int ImportNcchContent(cia_settings *ciaset)
 {
-	ciaset->ciaSections.content.buffer = realloc(ciaset->ciaSections.content.buffer,ciaset->content.totalSize);
-	if(!ciaset->ciaSections.content.buffer){
+	// Contents are streamed from their files when the CIA is written, so only their retargeted headers are prepared here
+	ciaset->content.retarget = calloc(ciaset->content.count,sizeof(ncch_retarget_ctx));
+	if(!ciaset->content.retarget){
 		fprintf(stderr,"[CIA ERROR] Not enough memory\n");
 		return MEM_ERROR;
 	}
 
+	// Content 0 is copied unchanged
+	if(ciaset->content.filePtrs[0])
+		memcpy(ciaset->content.retarget[0].header,ciaset->ciaSections.content.buffer,0x200);
+
 	ncch_hdr *ncch0hdr = (ncch_hdr*)(ciaset->ciaSections.content.buffer+0x100);
+	u8 ncchHdr[0x200];
 	for(int i = 1; i < ciaset->content.count; i++){
 		// Import
-		u8 *ncchpos = (u8*)(ciaset->ciaSections.content.buffer+ciaset->content.offset[i]);
-
-		ReadFile_64(ncchpos, ciaset->content.fileSize[i], 0, ciaset->content.filePtrs[i]);
-		if(ModifyNcchIds(ncchpos, NULL, ncch0hdr->programId, ciaset->keys) != 0)
+		ReadFile_64(ncchHdr, 0x200, 0, ciaset->content.filePtrs[i]);
+		if(BeginNcchRetarget(&ciaset->content.retarget[i], ncchHdr, NULL, ncch0hdr->programId, ciaset->keys) != 0)
 			return -1;
 		
 		// Set Additional Flags
@@ -457,7 +502,14 @@ int ImportNcchContent(cia_settings *ciaset)
 		//	ciaset->content.flags[i] |= content_Shared;
 	}
 
-	ciaset->ciaSections.content.size = ciaset->content.totalSize;
+	// DLC can have hundreds of contents to resign
+	if(ciaset->content.count > 1 && SignNcchRetargets(&ciaset->content.retarget[1], ciaset->content.count - 1, ciaset->keys) != 0)
+		return -1;
+	for(int i = 1; i < ciaset->content.count; i++){
+		if(FinishNcchRetarget(&ciaset->content.retarget[i], ciaset->keys) != 0)
+			return -1;
+	}
+
 	return 0;
 }
 
@@ -567,19 +619,252 @@ u16 SetupVersion(u16 Major, u16 Minor, u16 Micro)
 	return (((Major << 10) & 0xFC00) | ((Minor << 4) & 0x3F0) | (Micro & 0xf));
 }
 
-void GetContentHashes(cia_settings *ciaset)
+int ProcessContent(cia_settings *ciaset)
 {
-	for(int i = 0; i < ciaset->content.count; i++)
-		ctr_sha(ciaset->ciaSections.content.buffer+ciaset->content.offset[i],ciaset->content.size[i],ciaset->content.hash[i],CTR_SHA_256);
+	if(!ciaset->content.count)
+		return 0;
+
+	// Contents have their own IVs, so each is hashed and encrypted independently
+	u32 cpuNum = thread_cpu_count();
+	u32 threadNum = cpuNum;
+	if(threadNum > ciaset->content.count)
+		threadNum = ciaset->content.count;
+
+	cia_contentqueue queue;
+	queue.ciaset = ciaset;
+	queue.next = 0;
+	queue.result = 0;
+	// Spare CPUs are used to encrypt a chunk while the next one is hashed
+	queue.pipeline = ciaset->content.encryptCia && cpuNum >= threadNum * 2;
+	// Surplus contents are encrypted several at a time as interleaved CBC streams
+	queue.batchSize = 1;
+	if(ciaset->content.encryptCia){
+		queue.batchSize = ciaset->content.count / threadNum;
+		if(queue.batchSize > CTR_AES_MAX_STREAMS)
+			queue.batchSize = CTR_AES_MAX_STREAMS;
+	}
+	mutex_init(&queue.lock);
+	mutex_init(&queue.outLock);
+
+	thread_context *threads = NULL;
+	if(threadNum > 1)
+		threads = calloc(threadNum,sizeof(thread_context));
+	if(threads){
+		// The calling thread also works the queue
+		for(u32 i = 1; i < threadNum; i++)
+			thread_start(&threads[i],ProcessContentQueue,&queue);
+		ProcessContentQueue(&queue);
+		for(u32 i = 1; i < threadNum; i++)
+			thread_join(&threads[i]);
+		free(threads);
+	}
+	else
+		ProcessContentQueue(&queue);
+
+	mutex_destroy(&queue.lock);
+	mutex_destroy(&queue.outLock);
+
+	if(queue.result == MEM_ERROR)
+		fprintf(stderr,"[CIA ERROR] Not enough memory\n");
+	return queue.result;
 }
 
-void EncryptContent(cia_settings *ciaset)
+int HashAndEncryptContent(cia_contentqueue *queue, int i)
 {
-	for(int i = 0; i < ciaset->content.count; i++){
+	cia_settings *ciaset = queue->ciaset;
+	u64 size = ciaset->content.size[i];
+	bool pipeline = queue->pipeline;
+
+	// Contents imported from files need chunk buffers, two when reading overlaps encryption
+	u8 *buffer[2] = {NULL,NULL};
+	if(ciaset->content.filePtrs && ciaset->content.filePtrs[i]){
+		buffer[0] = malloc(CIA_CONTENT_CHUNK_SIZE);
+		buffer[1] = pipeline ? malloc(CIA_CONTENT_CHUNK_SIZE) : buffer[0];
+		if(!buffer[0] || !buffer[1]){
+			free(buffer[0]);
+			if(pipeline) free(buffer[1]);
+			return MEM_ERROR;
+		}
+	}
+
+	ctr_aes_context aes;
+	if(ciaset->content.encryptCia){
+		ciaset->content.flags[i] |= content_Encrypted;
+
+		u8 iv[16];
+		GetContentIv(iv,i);
+		memset(&aes,0x0,sizeof(ctr_aes_context));
+		ctr_init_aes_cbc(&aes,ciaset->common.titleKey,iv,ENC);
+	}
+
+	ctr_sha256_context sha;
+	ctr_sha_256_init(&sha);
+
+	// When pipelined, each chunk is hashed before it is encrypted, while the previous chunk is still being encrypted
+	thread_context cryptThread;
+	cia_cryptjob job;
+	u64 jobPos = 0;
+	bool crypting = false;
+	for(u64 pos = 0, k = 0; pos < size; pos += CIA_CONTENT_CHUNK_SIZE, k++){
+		u32 len = min_u64(size-pos,CIA_CONTENT_CHUNK_SIZE);
+		u8 *data = GetContentChunk(ciaset,i,pos,len,buffer[k & 1]);
+
+		if(!ciaset->content.encryptCia){
+			ctr_sha_256_update(&sha,data,len);
+			WriteContentChunk(ciaset,&queue->outLock,i,pos,data,len);
+			continue;
+		}
+
+		if(!pipeline){
+			// Hash and encrypt in one pass over the chunk
+			ctr_sha_256_aes_cbc_enc(&sha,&aes,data,len);
+			WriteContentChunk(ciaset,&queue->outLock,i,pos,data,len);
+			continue;
+		}
+
+		ctr_sha_256_update(&sha,data,len);
+		if(crypting){
+			thread_join(&cryptThread);
+			WriteContentChunk(ciaset,&queue->outLock,i,jobPos,job.data,job.size);
+		}
+		job.aes = &aes;
+		job.data = data;
+		job.size = len;
+		jobPos = pos;
+		thread_start(&cryptThread,EncryptContentChunk,&job);
+		crypting = true;
+	}
+	if(crypting){
+		thread_join(&cryptThread);
+		WriteContentChunk(ciaset,&queue->outLock,i,jobPos,job.data,job.size);
+	}
+
+	ctr_sha_256_finish(&sha,ciaset->content.hash[i]);
+
+	free(buffer[0]);
+	if(pipeline) free(buffer[1]);
+	return 0;
+}
+
+int HashAndEncryptContents(cia_contentqueue *queue, int first, int num)
+{
+	cia_settings *ciaset = queue->ciaset;
+	ctr_sha256_context sha[CTR_AES_MAX_STREAMS];
+	ctr_aes_context aes[CTR_AES_MAX_STREAMS];
+	u8 *buffer[CTR_AES_MAX_STREAMS];
+	int result = 0;
+
+	for(int j = 0; j < num; j++){
+		int i = first + j;
+		buffer[j] = NULL;
+		if(ciaset->content.filePtrs && ciaset->content.filePtrs[i]){
+			buffer[j] = malloc(CIA_BATCH_CHUNK_SIZE);
+			if(!buffer[j]) result = MEM_ERROR;
+		}
+
 		ciaset->content.flags[i] |= content_Encrypted;
-		u8 *content = ciaset->ciaSections.content.buffer+ciaset->content.offset[i];
-		CryptContent(content, content, ciaset->content.size[i], ciaset->common.titleKey, i, ENC);
+
+		u8 iv[16];
+		GetContentIv(iv,i);
+		memset(&aes[j],0x0,sizeof(ctr_aes_context));
+		ctr_init_aes_cbc(&aes[j],ciaset->common.titleKey,iv,ENC);
+		ctr_sha_256_init(&sha[j]);
+	}
+	if(result) goto finish;
+
+	// Contents advance together a chunk at a time, dropping out as they finish
+	for(u64 pos = 0; ; pos += CIA_BATCH_CHUNK_SIZE){
+		ctr_sha256_context *shaPtr[CTR_AES_MAX_STREAMS];
+		ctr_aes_context *aesPtr[CTR_AES_MAX_STREAMS];
+		u8 *data[CTR_AES_MAX_STREAMS];
+		u64 len[CTR_AES_MAX_STREAMS];
+		int index[CTR_AES_MAX_STREAMS];
+		u32 active = 0;
+		for(int j = 0; j < num; j++){
+			int i = first + j;
+			if(ciaset->content.size[i] <= pos)
+				continue;
+			len[active] = min_u64(ciaset->content.size[i]-pos,CIA_BATCH_CHUNK_SIZE);
+			data[active] = GetContentChunk(ciaset,i,pos,len[active],buffer[j]);
+			shaPtr[active] = &sha[j];
+			aesPtr[active] = &aes[j];
+			index[active] = i;
+			active++;
+		}
+		if(!active)
+			break;
+
+		ctr_sha_256_aes_cbc_enc_multi(shaPtr,aesPtr,data,len,active);
+		for(u32 j = 0; j < active; j++)
+			WriteContentChunk(ciaset,&queue->outLock,index[j],pos,data[j],len[j]);
 	}
+
+	for(int j = 0; j < num; j++)
+		ctr_sha_256_finish(&sha[j],ciaset->content.hash[first+j]);
+
+finish:
+	for(int j = 0; j < num; j++)
+		free(buffer[j]);
+	return result;
+}
+
+void ProcessContentQueue(void *arg)
+{
+	cia_contentqueue *queue = (cia_contentqueue*)arg;
+	while(1){
+		mutex_lock(&queue->lock);
+		int i = queue->next;
+		queue->next += queue->batchSize;
+		bool failed = queue->result != 0;
+		mutex_unlock(&queue->lock);
+
+		if(failed || i >= queue->ciaset->content.count)
+			break;
+
+		int num = queue->ciaset->content.count - i;
+		if(num > queue->batchSize)
+			num = queue->batchSize;
+
+		int result = 0;
+		if(num > 1)
+			result = HashAndEncryptContents(queue,i,num);
+		else
+			result = HashAndEncryptContent(queue,i);
+
+		if(result){
+			mutex_lock(&queue->lock);
+			queue->result = result;
+			mutex_unlock(&queue->lock);
+		}
+	}
+}
+
+u8* GetContentChunk(cia_settings *ciaset, int i, u64 pos, u32 len, u8 *buffer)
+{
+	if(!buffer) // Content is already in memory, it is processed in place
+		return ciaset->ciaSections.content.buffer+ciaset->content.offset[i]+pos;
+
+	// Contents imported from files are read and retargeted a chunk at a time
+	u64 fileLen = 0;
+	if(pos < ciaset->content.fileSize[i])
+		fileLen = min_u64(len,ciaset->content.fileSize[i]-pos);
+	ReadFile_64(buffer,fileLen,pos,ciaset->content.filePtrs[i]);
+	memset(buffer+fileLen,0,len-fileLen);
+	RetargetNcchData(&ciaset->content.retarget[i],buffer,pos,len);
+	return buffer;
+}
+
+void WriteContentChunk(cia_settings *ciaset, mutex_context *lock, int i, u64 pos, u8 *data, u32 len)
+{
+	mutex_lock(lock);
+	WriteBuffer(data,len,ciaset->ciaSections.contentOffset+ciaset->content.offset[i]+pos,ciaset->out);
+	mutex_unlock(lock);
+}
+
+void EncryptContentChunk(void *arg)
+{
+	cia_cryptjob *job = (cia_cryptjob*)arg;
+	ctr_aes_cbc(job->aes,job->data,job->data,job->size,ENC);
 }
 
 int BuildCIA_CertChain(cia_settings *ciaset)
@@ -655,7 +940,6 @@ int WriteCIAtoFile(cia_settings *ciaset)
 	WriteBuffer(ciaset->ciaSections.certChain.buffer,ciaset->ciaSections.certChain.size,ciaset->ciaSections.certChainOffset,ciaset->out);
 	WriteBuffer(ciaset->ciaSections.tik.buffer,ciaset->ciaSections.tik.size,ciaset->ciaSections.tikOffset,ciaset->out);
 	WriteBuffer(ciaset->ciaSections.tmd.buffer,ciaset->ciaSections.tmd.size,ciaset->ciaSections.tmdOffset,ciaset->out);
-	WriteBuffer(ciaset->ciaSections.content.buffer,ciaset->ciaSections.content.size,ciaset->ciaSections.contentOffset,ciaset->out);
 	WriteBuffer(ciaset->ciaSections.meta.buffer,ciaset->ciaSections.meta.size,ciaset->ciaSections.metaOffset,ciaset->out);
 	return 0;
 }
@@ -665,9 +949,7 @@ int CryptContent(u8 *EncBuffer,u8 *DecBuffer,u64 size,u8 *title_key, u16 index,
 {
 	//generating IV
 	u8 iv[16];
-	memset(&iv,0x0,16);
-	iv[0] = (index >> 8) & 0xff;
-	iv[1] = index & 0xff;
+	GetContentIv(iv,index);
 	//Crypting content
 	ctr_aes_context ctx;
 	memset(&ctx,0x0,sizeof(ctr_aes_context));
@@ -675,4 +957,11 @@ int CryptContent(u8 *EncBuffer,u8 *DecBuffer,u64 size,u8 *title_key, u16 index,
 	if(mode == ENC) ctr_aes_cbc(&ctx,DecBuffer,EncBuffer,size,ENC);
 	else ctr_aes_cbc(&ctx,EncBuffer,DecBuffer,size,DEC);
 	return 0;
-}
\ No newline at end of file
+}
+
+void GetContentIv(u8 iv[16], u16 index)
+{
+	memset(iv,0x0,16);
+	iv[0] = (index >> 8) & 0xff;
+	iv[1] = index & 0xff;
+}
@@ -89,6 +89,7 @@ typedef struct
 
 		FILE **filePtrs;
 		u64 fileSize[CIA_MAX_CONTENT];
+		ncch_retarget_ctx *retarget; // Applied to each chunk read from filePtrs
 
 		/* Misc Records */
 		u16 count;
@@ -1,4 +1,5 @@
 #include "lib.h"
+#include "ncch.h"
 #include "cia.h"
 
 u64 GetCiaCertOffset(cia_hdr *hdr)
@@ -1,6 +1,13 @@
 #include "lib.h"
 #include "crypto.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define CTR_HAVE_AESNI
+	#include <wmmintrin.h>
+#endif
+
+const u32 CTR_FUSED_SLICE_SIZE = 0x8000; // Small enough to stay in L1/L2 between hashing and encryption
+
 void ctr_sha(void *data, u64 size, u8 *hash, int mode)
 {
 	switch(mode){
@@ -9,6 +16,60 @@ void ctr_sha(void *data, u64 size, u8 *hash, int mode)
 	}
 }
 
+void ctr_sha_256_init(ctr_sha256_context* ctx)
+{
+	sha2_starts(&ctx->sha, 0);
+}
+
+void ctr_sha_256_update(ctr_sha256_context* ctx, const u8* data, u32 size)
+{
+	sha2_update(&ctx->sha, data, size);
+}
+
+void ctr_sha_256_finish(ctr_sha256_context* ctx, u8 hash[0x20])
+{
+	sha2_finish(&ctx->sha, hash);
+}
+
+void ctr_sha_256_aes_cbc_enc(ctr_sha256_context* sha, ctr_aes_context* aes, u8* data, u64 size)
+{
+	// Each slice is encrypted in place straight after being hashed, while it is still in cache
+	for(u64 pos = 0; pos < size; pos += CTR_FUSED_SLICE_SIZE){
+		u32 len = min_u64(size-pos,CTR_FUSED_SLICE_SIZE);
+		u8 *slice = data+pos;
+		sha2_update(&sha->sha, slice, len);
+		ctr_aes_cbc_enc_multi(&aes, &slice, &slice, len, 1);
+	}
+}
+
+void ctr_sha_256_aes_cbc_enc_multi(ctr_sha256_context** sha, ctr_aes_context** aes, u8** data, u64* size, u32 count)
+{
+	// Streams advance together a slice at a time, dropping out as they finish
+	ctr_aes_context *activeAes[CTR_AES_MAX_STREAMS];
+	u8 *activeData[CTR_AES_MAX_STREAMS];
+	for(u64 pos = 0; ; ){
+		u32 active = 0;
+		u64 len = CTR_FUSED_SLICE_SIZE;
+		for(u32 i = 0; i < count; i++){
+			if(size[i] <= pos)
+				continue;
+			len = min_u64(len,size[i]-pos);
+			activeAes[active] = aes[i];
+			activeData[active] = data[i]+pos;
+			active++;
+		}
+		if(!active)
+			break;
+
+		for(u32 i = 0, j = 0; i < count; i++){
+			if(size[i] > pos)
+				sha2_update(&sha[i]->sha, activeData[j++], len);
+		}
+		ctr_aes_cbc_enc_multi(activeAes, activeData, activeData, len, active);
+		pos += len;
+	}
+}
+
 u8* AesKeyScrambler(u8 *Key, u8 *KeyX, u8 *KeyY)
 {
 	// Process KeyX/KeyY to get raw normal key
@@ -133,14 +194,68 @@ void ctr_init_aes_cbc(ctr_aes_context* ctx,u8 key[16],u8 iv[16], u8 mode)
 void ctr_aes_cbc(ctr_aes_context* ctx,u8* input,u8* output,u32 size,u8 mode)
 {
 	switch(mode){
-		case(ENC): aes_crypt_cbc(&ctx->aes, AES_ENCRYPT, size, ctx->iv, input, output); break;
+		case(ENC): ctr_aes_cbc_enc_multi(&ctx, &input, &output, size, 1); break;
 		case(DEC): aes_crypt_cbc(&ctx->aes, AES_DECRYPT, size, ctx->iv, input, output); break;
 	}
 }
 
+#ifdef CTR_HAVE_AESNI
+__attribute__((target("aes,sse2")))
+void ctr_aesni_cbc_enc_multi(ctr_aes_context** ctx, u8** input, u8** output, u32 size, u32 count)
+{
+	__m128i rk[CTR_AES_MAX_STREAMS][11];
+	__m128i block[CTR_AES_MAX_STREAMS];
+	for(u32 i = 0; i < count; i++){
+		for(int r = 0; r < 11; r++)
+			rk[i][r] = _mm_loadu_si128((__m128i*)ctx[i]->aes.rk + r);
+		block[i] = _mm_loadu_si128((__m128i*)ctx[i]->iv);
+	}
+
+	// One block from every stream per round, so their AES rounds overlap in the pipeline
+	for(u32 pos = 0; pos < size; pos += 16){
+		for(u32 i = 0; i < count; i++)
+			block[i] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((__m128i*)(input[i]+pos)), block[i]), rk[i][0]);
+		for(int r = 1; r < 10; r++){
+			for(u32 i = 0; i < count; i++)
+				block[i] = _mm_aesenc_si128(block[i], rk[i][r]);
+		}
+		for(u32 i = 0; i < count; i++){
+			block[i] = _mm_aesenclast_si128(block[i], rk[i][10]);
+			_mm_storeu_si128((__m128i*)(output[i]+pos), block[i]);
+		}
+	}
+
+	for(u32 i = 0; i < count; i++)
+		_mm_storeu_si128((__m128i*)ctx[i]->iv, block[i]);
+}
+#endif
+
+void ctr_aes_cbc_enc_multi(ctr_aes_context** ctx, u8** input, u8** output, u32 size, u32 count)
+{
+	// CBC can't be split within a stream, but independent streams can be interleaved
+	if(size % 16) // Matches aes_crypt_cbc(), which rejects partial blocks
+		return;
+
+#ifdef CTR_HAVE_AESNI
+	bool useAesNi = count <= CTR_AES_MAX_STREAMS && __builtin_cpu_supports("aes");
+	for(u32 i = 0; i < count && useAesNi; i++)
+		useAesNi = ctx[i]->aes.nr == 10;
+	if(useAesNi){
+		ctr_aesni_cbc_enc_multi(ctx, input, output, size, count);
+		return;
+	}
+#endif
+
+	for(u32 i = 0; i < count; i++)
+		aes_crypt_cbc(&ctx[i]->aes, AES_ENCRYPT, size, ctx[i]->iv, input[i], output[i]);
+}
+
 void ctr_rsa_free(ctr_rsa_context* ctx)
 {
 	rsa_free(&ctx->rsa);
+	if(ctx->shared)
+		mutex_destroy(&ctx->lock);
+	ctx->shared = false;
 }
 
 int ctr_rsa_init(ctr_rsa_context* ctx, u8 *modulus, u8 *private_exp, u8 *exponent, u8 rsa_type, u8 mode)
@@ -148,6 +263,7 @@ int ctr_rsa_init(ctr_rsa_context* ctx, u8 *modulus, u8 *private_exp, u8 *exponen
 	// Sanity Check
 	if(ctx == NULL || modulus == NULL ||(private_exp == NULL && mode == RSAKEY_PRIV) || (exponent == NULL && mode == RSAKEY_PUB))
 		return Fail;
+	memset(ctx,0,sizeof(ctr_rsa_context));
 	rsa_init(&ctx->rsa, RSA_PKCS_V15, 0);
 	u16 n_size = 0;
 	u16 d_size = 0;
@@ -190,6 +306,269 @@ clean:
 	return Fail;
 }
 
+int ctr_rsa_precompute_rr(mpi *RR, const mpi *N)
+{
+	// mpi_exp_mod() keeps R^2 mod N in RR the first time it is given an empty one
+	int ret;
+	mpi T, One;
+	mpi_init(&T); mpi_init(&One);
+	MPI_CHK(mpi_lset(&One,1));
+	MPI_CHK(mpi_exp_mod(&T,&One,&One,N,RR));
+cleanup:
+	mpi_free(&T); mpi_free(&One);
+	return ret;
+}
+
+int ctr_rsa_recover_primes(rsa_context *rsa)
+{
+	/*
+	 * Only N and D are stored, but D*E - 1 is a multiple of lambda(N), so
+	 * N can be factored by looking for a non-trivial square root of 1
+	 */
+	const int bases[] = {2,3,5,7,11,13,17,19,23,29,31,37,41,43,47,53};
+	int ret;
+	bool found = false;
+	mpi K, Y, X, Nm1, G;
+	mpi_init(&K); mpi_init(&Y); mpi_init(&X); mpi_init(&Nm1); mpi_init(&G);
+
+	MPI_CHK(mpi_lset(&rsa->E,0x10001));
+	MPI_CHK(mpi_mul_mpi(&K,&rsa->D,&rsa->E));
+	MPI_CHK(mpi_sub_int(&K,&K,1));
+	MPI_CHK(mpi_sub_int(&Nm1,&rsa->N,1));
+	size_t t = mpi_lsb(&K);
+	MPI_CHK(mpi_shift_r(&K,t));
+
+	for(u32 i = 0; i < sizeof(bases)/sizeof(int) && !found && t; i++){
+		MPI_CHK(mpi_lset(&G,bases[i]));
+		MPI_CHK(mpi_exp_mod(&Y,&G,&K,&rsa->N,&rsa->RN));
+		if(mpi_cmp_int(&Y,1) == 0 || mpi_cmp_mpi(&Y,&Nm1) == 0)
+			continue;
+		for(size_t j = 0; j < t; j++){
+			MPI_CHK(mpi_mul_mpi(&X,&Y,&Y));
+			MPI_CHK(mpi_mod_mpi(&X,&X,&rsa->N));
+			if(mpi_cmp_int(&X,1) == 0){
+				MPI_CHK(mpi_sub_int(&Y,&Y,1));
+				MPI_CHK(mpi_gcd(&rsa->P,&Y,&rsa->N));
+				found = true;
+				break;
+			}
+			if(mpi_cmp_mpi(&X,&Nm1) == 0)
+				break;
+			MPI_CHK(mpi_copy(&Y,&X));
+		}
+	}
+
+	ret = POLARSSL_ERR_RSA_KEY_CHECK_FAILED;
+	if(!found || mpi_cmp_int(&rsa->P,1) == 0)
+		goto cleanup;
+	MPI_CHK(mpi_div_mpi(&rsa->Q,&X,&rsa->N,&rsa->P));
+	if(mpi_cmp_int(&X,0) != 0){
+		ret = POLARSSL_ERR_RSA_KEY_CHECK_FAILED;
+		goto cleanup;
+	}
+
+	MPI_CHK(mpi_sub_int(&X,&rsa->P,1));
+	MPI_CHK(mpi_mod_mpi(&rsa->DP,&rsa->D,&X));
+	MPI_CHK(mpi_sub_int(&X,&rsa->Q,1));
+	MPI_CHK(mpi_mod_mpi(&rsa->DQ,&rsa->D,&X));
+	MPI_CHK(mpi_inv_mod(&rsa->QP,&rsa->Q,&rsa->P));
+	MPI_CHK(ctr_rsa_precompute_rr(&rsa->RP,&rsa->P));
+	MPI_CHK(ctr_rsa_precompute_rr(&rsa->RQ,&rsa->Q));
+
+cleanup:
+	mpi_free(&K); mpi_free(&Y); mpi_free(&X); mpi_free(&Nm1); mpi_free(&G);
+	return ret;
+}
+
+int ctr_rsa_private(rsa_context *rsa, mpi *T, bool crt)
+{
+	int ret;
+	if(!crt)
+		return mpi_exp_mod(T,T,&rsa->D,&rsa->N,&rsa->RN);
+
+	mpi T1, T2;
+	mpi_init(&T1); mpi_init(&T2);
+	MPI_CHK(mpi_exp_mod(&T1,T,&rsa->DP,&rsa->P,&rsa->RP));
+	MPI_CHK(mpi_exp_mod(&T2,T,&rsa->DQ,&rsa->Q,&rsa->RQ));
+	MPI_CHK(mpi_sub_mpi(T,&T1,&T2));
+	MPI_CHK(mpi_mul_mpi(&T1,T,&rsa->QP));
+	MPI_CHK(mpi_mod_mpi(T,&T1,&rsa->P));
+	MPI_CHK(mpi_mul_mpi(&T1,T,&rsa->Q));
+	MPI_CHK(mpi_add_mpi(T,&T2,&T1));
+cleanup:
+	mpi_free(&T1); mpi_free(&T2);
+	return ret;
+}
+
+bool ctr_rsa_setup_crt(rsa_context *rsa)
+{
+	if(ctr_rsa_recover_primes(rsa) == 0){
+		// A test signature must round trip through E, otherwise the key is not a genuine pair and signing stays on D
+		u8 in[RSA_4096_KEY_SIZE], out[RSA_4096_KEY_SIZE];
+		memset(in,0,rsa->len);
+		in[rsa->len-1] = 2;
+		mpi T;
+		mpi_init(&T);
+		bool good = mpi_read_binary(&T,in,rsa->len) == 0 && 
+			ctr_rsa_private(rsa,&T,true) == 0 && 
+			mpi_exp_mod(&T,&T,&rsa->E,&rsa->N,&rsa->RN) == 0 && 
+			mpi_write_binary(&T,out,rsa->len) == 0 && 
+			memcmp(in,out,rsa->len) == 0;
+		mpi_free(&T);
+		if(good)
+			return true;
+	}
+
+	mpi_free(&rsa->P); mpi_free(&rsa->Q);
+	mpi_free(&rsa->DP); mpi_free(&rsa->DQ); mpi_free(&rsa->QP);
+	mpi_free(&rsa->RP); mpi_free(&rsa->RQ);
+	return false;
+}
+
+int ctr_rsa_precompute(ctr_rsa_context* ctx)
+{
+	if(ctr_rsa_precompute_rr(&ctx->rsa.RN,&ctx->rsa.N))
+		return Fail;
+	mutex_init(&ctx->lock);
+	ctx->shared = true;
+	return Good;
+}
+
+bool ctr_rsa_use_crt(ctr_rsa_context* ctx, u32 signNum)
+{
+	if(!ctx->shared)
+		return false;
+
+	// Recovering the primes costs about as much as a signature, so it waits until a key signs more than once
+	mutex_lock(&ctx->lock);
+	if(ctx->signCount < 2 && ctx->signCount + signNum >= 2)
+		ctx->crt = ctr_rsa_setup_crt(&ctx->rsa);
+	ctx->signCount += signNum;
+	bool crt = ctx->crt;
+	mutex_unlock(&ctx->lock);
+
+	return crt;
+}
+
+int ctr_rsa_get_hash_type(u32 type, int *hashtype, int *hashlen)
+{
+	switch(type){
+		case RSA_4096_SHA1:
+		case RSA_2048_SHA1:
+			*hashtype = SIG_RSA_SHA1;
+			*hashlen = 0x14;
+			return Good;
+		case RSA_4096_SHA256:
+		case RSA_2048_SHA256:
+			*hashtype = SIG_RSA_SHA256;
+			*hashlen = 0x20;
+			return Good;
+		default: return Fail;
+	}
+}
+
+int ctr_rsa_sign_hash_ex(ctr_rsa_context* ctx, u8 *hash, u8 *signature, u32 type, bool crt)
+{
+	int hashtype, hashlen;
+	if(hash == NULL || signature == NULL || ctr_rsa_get_hash_type(type,&hashtype,&hashlen))
+		return Fail;
+	return ctr_rsa_rsassa_pkcs1_v15_sign(&ctx->rsa,crt,hashtype,hashlen,hash,signature);
+}
+
+int ctr_rsa_sign_hash(ctr_rsa_context* ctx, u8 *hash, u8 *signature, u32 type)
+{
+	if(ctx == NULL)
+		return Fail;
+	return ctr_rsa_sign_hash_ex(ctx,hash,signature,type,ctr_rsa_use_crt(ctx,1));
+}
+
+typedef struct
+{
+	ctr_rsa_context *ctx;
+	u8 **hash;
+	u8 **signature;
+	u32 type;
+	bool crt;
+	u32 start;
+	u32 step;
+	u32 count;
+	int result;
+} ctr_rsa_batch_job;
+
+void ctr_rsa_sign_batch_job(void *arg)
+{
+	ctr_rsa_batch_job *job = (ctr_rsa_batch_job*)arg;
+	for(u32 i = job->start; i < job->count; i += job->step){
+		if(ctr_rsa_sign_hash_ex(job->ctx,job->hash[i],job->signature[i],job->type,job->crt))
+			job->result = Fail;
+	}
+}
+
+int ctr_rsa_sign_batch(ctr_rsa_context* ctx, u8 **hash, u8 **signature, u32 count, u32 type, u32 threadNum)
+{
+	if(ctx == NULL)
+		return Fail;
+	bool crt = ctr_rsa_use_crt(ctx,count);
+
+	// A shared context is only read while signing, so the digests can be split between threads
+	if(!ctx->shared)
+		threadNum = 1;
+	if(threadNum > count)
+		threadNum = count;
+	if(threadNum < 1)
+		threadNum = 1;
+
+	ctr_rsa_batch_job *jobs = calloc(threadNum,sizeof(ctr_rsa_batch_job));
+	thread_context *threads = calloc(threadNum,sizeof(thread_context));
+	if(!jobs || !threads){
+		free(jobs);
+		free(threads);
+		threadNum = 1;
+		ctr_rsa_batch_job job = {ctx,hash,signature,type,crt,0,1,count,Good};
+		ctr_rsa_sign_batch_job(&job);
+		return job.result;
+	}
+
+	for(u32 i = 0; i < threadNum; i++){
+		jobs[i] = (ctr_rsa_batch_job){ctx,hash,signature,type,crt,i,threadNum,count,Good};
+		if(i > 0)
+			thread_start(&threads[i],ctr_rsa_sign_batch_job,&jobs[i]);
+	}
+	// The calling thread takes the first share
+	ctr_rsa_sign_batch_job(&jobs[0]);
+
+	int result = jobs[0].result;
+	for(u32 i = 1; i < threadNum; i++){
+		thread_join(&threads[i]);
+		if(jobs[i].result)
+			result = jobs[i].result;
+	}
+	free(jobs);
+	free(threads);
+
+	return result;
+}
+
+int ctr_sig_sign(ctr_rsa_context* ctx, void *data, u64 size, u8 *signature, u32 type)
+{
+	if(data == NULL)
+		return Fail;
+
+	u8 hash[0x20];
+	switch(type){
+		case RSA_4096_SHA1:
+		case RSA_2048_SHA1:
+			ctr_sha(data,size,hash,CTR_SHA_1);
+			break;
+		case RSA_4096_SHA256:
+		case RSA_2048_SHA256:
+			ctr_sha(data,size,hash,CTR_SHA_256);
+			break;
+		default: return Fail;
+	}
+	return ctr_rsa_sign_hash(ctx,hash,signature,type);
+}
+
 int ctr_sig(void *data, u64 size, u8 *signature, u8 *modulus, u8 *private_exp, u32 type, u8 mode)
 {
 	int result = 0;
@@ -295,7 +674,7 @@ int ctr_rsa(u8 *hash, u8 *signature, u8 *modulus, u8 *private_exp, u32 type, u8
 		case CTR_RSA_VERIFY: 
 			return rsa_pkcs1_verify(&ctx.rsa,RSA_PUBLIC,hashtype,hashlen,hash,signature);
 		case CTR_RSA_SIGN: 
-			return ctr_rsa_rsassa_pkcs1_v15_sign(&ctx.rsa,RSA_PRIVATE,hashtype,hashlen,hash,signature);
+			return ctr_rsa_rsassa_pkcs1_v15_sign(&ctx.rsa,false,hashtype,hashlen,hash,signature);
 	}
 	return Fail;
 } 
@@ -305,7 +684,7 @@ int ctr_rsa(u8 *hash, u8 *signature, u8 *modulus, u8 *private_exp, u32 type, u8
 *  Hacked from rsa.c, polarssl doesn't like generating signatures when only D and N are present
 **/
 int ctr_rsa_rsassa_pkcs1_v15_sign( rsa_context *ctx,
-                               int mode,
+                               bool crt,
                                int hash_id,
                                unsigned int hashlen,
                                const unsigned char *hash,
@@ -427,7 +806,7 @@ int ctr_rsa_rsassa_pkcs1_v15_sign( rsa_context *ctx,
         return( POLARSSL_ERR_RSA_BAD_INPUT_DATA );
     }	
 	
-	MPI_CHK( mpi_exp_mod( &T, &T, &ctx->D, &ctx->N, &ctx->RN ) );
+	MPI_CHK( ctr_rsa_private( ctx, &T, crt ) );
 	
     MPI_CHK( mpi_write_binary( &T, sig, olen ) );
 
@@ -55,6 +55,11 @@ typedef enum
 	RSAKEY_PUB
 } rsakeytype;
 
+enum
+{
+	CTR_AES_MAX_STREAMS = 8, // Most CBC streams advanced together by ctr_aes_cbc_enc_multi()
+};
+
 typedef struct
 {
 	u8 ctr[16];
@@ -65,13 +70,29 @@ typedef struct
 typedef struct
 {
 	rsa_context rsa;
+
+	// Set by ctr_rsa_precompute(), for private keys that are kept and shared between threads
+	bool shared;
+	bool crt;
+	u32 signCount;
+	mutex_context lock;
 } ctr_rsa_context;
 
+typedef struct
+{
+	sha2_context sha;
+} ctr_sha256_context;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 // SHA
 void ctr_sha(void *data, u64 size, u8 *hash, int mode);
+void ctr_sha_256_init(ctr_sha256_context* ctx);
+void ctr_sha_256_update(ctr_sha256_context* ctx, const u8* data, u32 size);
+void ctr_sha_256_finish(ctr_sha256_context* ctx, u8 hash[0x20]);
+void ctr_sha_256_aes_cbc_enc(ctr_sha256_context* sha, ctr_aes_context* aes, u8* data, u64 size);
+void ctr_sha_256_aes_cbc_enc_multi(ctr_sha256_context** sha, ctr_aes_context** aes, u8** data, u64* size, u32 count);
 // AES
 u8* AesKeyScrambler(u8 *Key, u8 *KeyX, u8 *KeyY);
 void ctr_add_counter(ctr_aes_context* ctx, u32 carry);
@@ -80,12 +101,16 @@ void ctr_crypt_counter_block(ctr_aes_context* ctx, u8 input[16], u8 output[16]);
 void ctr_crypt_counter(ctr_aes_context* ctx, u8* input,  u8* output, u32 size);
 void ctr_init_aes_cbc(ctr_aes_context* ctx,u8 key[16],u8 iv[16], u8 mode);
 void ctr_aes_cbc(ctr_aes_context* ctx,u8* input,u8* output,u32 size,u8 mode);
+void ctr_aes_cbc_enc_multi(ctr_aes_context** ctx, u8** input, u8** output, u32 size, u32 count);
 // RSA
 void ctr_rsa_free(ctr_rsa_context* ctx);
 int ctr_rsa_init(ctr_rsa_context* ctx, u8 *modulus, u8 *private_exp, u8 *exponent, u8 rsa_type, u8 mode);
 int ctr_rsa(u8 *hash, u8 *signature, u8 *modulus, u8 *private_exp, u32 type, u8 mode);
+int ctr_rsa_precompute(ctr_rsa_context* ctx); // Caches the Montgomery constants, the key can then be kept and shared for signing
+int ctr_rsa_sign_hash(ctr_rsa_context* ctx, u8 *hash, u8 *signature, u32 type);
+int ctr_rsa_sign_batch(ctr_rsa_context* ctx, u8 **hash, u8 **signature, u32 count, u32 type, u32 threadNum);
 int ctr_rsa_rsassa_pkcs1_v15_sign( rsa_context *ctx,
-                               int mode,
+                               bool crt,
                                int hash_id,
                                unsigned int hashlen,
                                const unsigned char *hash,
@@ -93,6 +118,7 @@ int ctr_rsa_rsassa_pkcs1_v15_sign( rsa_context *ctx,
 
 // Signature Functions
 int ctr_sig(void *data, u64 size, u8 *signature, u8 *modulus, u8 *private_exp, u32 type, u8 mode);
+int ctr_sig_sign(ctr_rsa_context* ctx, void *data, u64 size, u8 *signature, u32 type);
 					
 #ifdef __cplusplus
 }
@@ -1,6 +1,10 @@
+#ifdef __linux__
+	#define _GNU_SOURCE // st_mtim
+#endif
 #include "lib.h"
 #include "dir.h"
 #include "utf.h"
+#include <errno.h>
 
 /* This is mainly a FS interface for ROMFS generation */
 
@@ -12,8 +16,11 @@ void fs_chdirUp(void);
 fs_entry* fs_GetEntry(fs_DIR *dp);
 void fs_FreeEntry(fs_entry *entry);
 bool fs_EntryIsDirNav(fs_entry *entry);
-int fs_AddDir(fs_entry *entry, fs_dir *dir);
-int fs_AddFile(fs_entry *entry, fs_dir *dir);
+fs_char* fs_GetCwd(void);
+fs_char* fs_JoinPath(fs_char *dir_path, fs_char *name);
+int fs_ScanDir(fs_char *fs_path, fs_char *dir_path, fs_romfs_char *path, u32 pathlen, fs_dir *dir);
+int fs_AddDir(fs_entry *entry, fs_dir *dir, fs_char *dir_path);
+int fs_AddFile(fs_entry *entry, fs_dir *dir, fs_char *dir_path);
 
 int fs_InitDir(u16 *path, u32 pathlen, fs_dir *dir)
 {
@@ -112,17 +119,14 @@ fs_entry* fs_GetEntry(fs_DIR *dp)
 		fs_closedir(tmp_dptr);
 		entry->IsDir = true;
 		entry->size = 0;
-		entry->fp = NULL;
 	}
-	else // Open file if it is a file
+	else // Only record the size if it is a file, it is opened when its data is needed
 	{
 		entry->IsDir = false;
 #ifdef _WIN32
 		entry->size = wGetFileSize_u64(entry->fs_name);
-		entry->fp = _wfopen(entry->fs_name,L"rb");
 #else
 		entry->size = GetFileSize_u64(entry->fs_name);
-		entry->fp = fopen(entry->fs_name,"rb");
 #endif
 	}
 	//printf("fs_GetEntry() return\n");
@@ -149,16 +153,59 @@ bool fs_EntryIsDirNav(fs_entry *entry)
 	
 }
 
-int fs_AddDir(fs_entry *entry, fs_dir *dir)
+fs_char* fs_GetCwd(void)
+{
+	// Grown until the path fits, deep trees can outgrow FS_MAX_PATH_LEN
+	for(size_t len = FS_MAX_PATH_LEN; ; len *= 2){
+		fs_char *cwd = calloc(len,sizeof(fs_char));
+		if(!cwd)
+			return NULL;
+		if(fs_getcwd(cwd,len))
+			return cwd;
+		free(cwd);
+		if(errno != ERANGE)
+			return NULL;
+	}
+}
+
+fs_char* fs_JoinPath(fs_char *dir_path, fs_char *name)
+{
+	u32 dir_path_len = fs_strlen(dir_path);
+	u32 name_len = fs_strlen(name);
+	fs_char *path = calloc(dir_path_len+1+name_len+1,sizeof(fs_char));
+	if(!path)
+		return NULL;
+	memcpy(path,dir_path,sizeof(fs_char)*dir_path_len);
+	path[dir_path_len] = FS_PATH_SEPARATOR;
+	memcpy(path+dir_path_len+1,name,sizeof(fs_char)*name_len);
+	return path;
+}
+
+int fs_AddDir(fs_entry *entry, fs_dir *dir, fs_char *dir_path)
 {
 	fs_ManageDirSlot(dir);
-	u32 current_slot = dir->u_dir;
-	dir->u_dir++;
 	fs_dir *tmp = (fs_dir*)dir->dir;
-	return fs_OpenDir(entry->fs_name,entry->name,entry->name_len,&tmp[current_slot]);
+	fs_dir *sub_dir = &tmp[dir->u_dir];
+
+	fs_char *sub_path = fs_JoinPath(dir_path,entry->fs_name);
+	if(!sub_path)
+		return MEM_ERROR;
+	int ret = fs_ScanDir(entry->fs_name,sub_path,entry->name,entry->name_len,sub_dir);
+	free(sub_path);
+
+	// The slot is only counted once its scan has completed, a failed one is freed again
+	if(ret){
+		fs_FreeFiles(sub_dir);
+		fs_FreeDir(sub_dir);
+		free(sub_dir->name);
+		memset(sub_dir,0,sizeof(fs_dir));
+		return ret;
+	}
+	dir->u_dir++;
+	return 0;
 }
 
-int fs_AddFile(fs_entry *entry, fs_dir *dir)
+int fs_AddFile(fs_entry *entry, fs_dir *dir, fs_char *dir_path)
 {
 	fs_ManageFileSlot(dir);
 	dir->file[dir->u_file].name_len = entry->name_len;
@@ -167,7 +214,12 @@ int fs_AddFile(fs_entry *entry, fs_dir *dir)
 	memcpy(dir->file[dir->u_file].name,entry->name,entry->name_len);
 	
 	dir->file[dir->u_file].size = entry->size;
-	dir->file[dir->u_file].fp = entry->fp;
+
+	// Full path, as the scan has moved on to another working dir by the time the file is opened
+	fs_char *path = fs_JoinPath(dir_path,entry->fs_name);
+	if(!path)
+		return MEM_ERROR;
+	dir->file[dir->u_file].path = path;
 	
 	dir->u_file++;
 	return 0;
@@ -175,6 +227,12 @@ int fs_AddFile(fs_entry *entry, fs_dir *dir)
 
 int fs_OpenDir(fs_char *fs_path, fs_romfs_char *path, u32 pathlen, fs_dir *dir)
 {
+	return fs_ScanDir(fs_path,NULL,path,pathlen,dir);
+}
+
+int fs_ScanDir(fs_char *fs_path, fs_char *dir_path, fs_romfs_char *path, u32 pathlen, fs_dir *dir)
+{
+	// dir_path is the full path of fs_path, only the root has it looked up, sub dirs extend their parent's
 	//printf("init open dir\n");
 	int ret = 0;
 	fs_DIR *dp;
@@ -193,7 +251,18 @@ int fs_OpenDir(fs_char *fs_path, fs_romfs_char *path, u32 pathlen, fs_dir *dir)
 	//wprintf(L" rec: \"%s\" (%d)\n",dir->name,dir->name_len);
 	
 	//printf("chdir\n");
-	fs_chdir(fs_path);
+	if(fs_chdir(fs_path) != 0)
+	{
+		fs_closedir(dp);
+		return -1;
+	}
+	fs_char *cwd = dir_path ? dir_path : fs_GetCwd();
+	if(!cwd)
+	{
+		fs_closedir(dp);
+		fs_chdirUp();
+		return -1;
+	}
 	
 	//printf("read entries\n");
 	while((entry = fs_GetEntry(dp)))
@@ -214,7 +283,7 @@ int fs_OpenDir(fs_char *fs_path, fs_romfs_char *path, u32 pathlen, fs_dir *dir)
 #else
 			//printf("is a dir: \"%s\" (%d)\n",entry->fs_name,entry->name_len);
 #endif
-				ret = fs_AddDir(entry,dir);
+				ret = fs_AddDir(entry,dir,cwd);
 			}
 			else
 			{
@@ -229,7 +298,7 @@ int fs_OpenDir(fs_char *fs_path, fs_romfs_char *path, u32 pathlen, fs_dir *dir)
 #else
 			//printf("is a file: \"%s\" (%d)\n",entry->fs_name,entry->name_len);
 #endif
-			ret = fs_AddFile(entry,dir);
+			ret = fs_AddFile(entry,dir,cwd);
 		}
 		
 		//printf("free entry\n");		
@@ -243,6 +312,8 @@ int fs_OpenDir(fs_char *fs_path, fs_romfs_char *path, u32 pathlen, fs_dir *dir)
 	}
 	//printf("close dir ptr\n");
 	fs_closedir(dp);
+	if(cwd != dir_path)
+		free(cwd);
 	//printf("return up dir\n");
 	fs_chdirUp();
 	//printf("return from fs_OpenDir();\n");
@@ -317,11 +388,35 @@ void fs_FreeFiles(fs_dir *dir)
 {
 	for(u32 i = 0; i < dir->u_file; i++)
 	{
-		if(dir->file[i].fp)
-			fclose(dir->file[i].fp);
+		free(dir->file[i].path);
+		dir->file[i].path = NULL;
 	}
 	
 	fs_dir *tmp = (fs_dir*)dir->dir;
 	for(u32 i = 0; i < dir->u_dir; i++)
 		fs_FreeFiles(&tmp[i]);
-}
\ No newline at end of file
+}
+
+FILE* fs_OpenFile(fs_file *file)
+{
+	return fs_fopen(file->path);
+}
+u64 fs_GetFileModTime(fs_file *file)
+{
+	// Nanoseconds where the host keeps them, 0 if it can't be read
+#ifdef _WIN32
+	struct _stat64 st;
+	if(_wstat64(file->path,&st) != 0)
+		return 0;
+	return (u64)st.st_mtime * 1000000000;
+#else
+	struct stat st;
+	if(stat(file->path,&st) != 0)
+		return 0;
+#ifdef __linux__
+	return (u64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+	return (u64)st.st_mtime * 1000000000;
+#endif
+#endif
+}
@@ -9,6 +9,10 @@
 	#define fs_chdir _wchdir
 	#define fs_opendir _wopendir
 	#define fs_closedir _wclosedir
+	#define fs_getcwd _wgetcwd
+	#define fs_strlen wcslen
+	#define fs_fopen(path) _wfopen(path,L"rb")
+	#define FS_PATH_SEPARATOR L'\\'
 #else
 	#define fs_romfs_char u16
 	#define fs_char char
@@ -18,7 +22,13 @@
 	#define fs_chdir chdir
 	#define fs_opendir opendir
 	#define fs_closedir closedir
+	#define fs_getcwd getcwd
+	#define fs_strlen strlen
+	#define fs_fopen(path) fopen(path,"rb")
+	#define FS_PATH_SEPARATOR '/'
 #endif
+
+#define FS_MAX_PATH_LEN 1024
 	
 
 typedef struct
@@ -28,7 +38,6 @@ typedef struct
 	fs_romfs_char *name;
 	u32 name_len;
 	u64 size;
-	FILE *fp;
 } fs_entry;
 
 typedef struct
@@ -36,7 +45,7 @@ typedef struct
 	u16 *name;
 	u32 name_len;
 	u64 size;
-	FILE *fp;
+	fs_char *path; // Opened with fs_OpenFile() only while its data is being read
 } fs_file;
 
 typedef struct
@@ -61,4 +70,6 @@ int fs_u32String_to_u16String(u16 **dst, u32 *dst_len, u32 *src, u32 src_len);
 int fs_OpenDir(fs_char *fs_path, fs_romfs_char *path, u32 pathlen, fs_dir *dir);
 void fs_PrintDir(fs_dir *dir, u32 depth);
 void fs_FreeDir(fs_dir *dir);
-void fs_FreeFiles(fs_dir *dir);
\ No newline at end of file
+void fs_FreeFiles(fs_dir *dir);
+FILE* fs_OpenFile(fs_file *file);
+u64 fs_GetFileModTime(fs_file *file);
\ No newline at end of file
@@ -78,12 +78,12 @@ int BuildExeFsCode(ncch_settings *ncchset)
 	printf("[DEBUG] Import ELF\n");
 #endif
 	/* Import ELF */
-	u8 *ElfFile = malloc(ncchset->componentFilePtrs.elfSize);
-	if(!ElfFile) {
+	mapped_file ElfMap;
+	if(MapFile(&ElfMap,ncchset->componentFilePtrs.elf,ncchset->componentFilePtrs.elfSize,false)) {
 		fprintf(stderr,"[ELF ERROR] Not enough memory\n"); 
 		return MEM_ERROR;
 	}
-	ReadFile_64(ElfFile,ncchset->componentFilePtrs.elfSize,0,ncchset->componentFilePtrs.elf);
+	u8 *ElfFile = ElfMap.buffer;
 
 #ifdef DEBUG
 	printf("[DEBUG] Create ELF Context\n");
@@ -92,7 +92,7 @@ int BuildExeFsCode(ncch_settings *ncchset)
 	ElfContext *elf = calloc(1,sizeof(ElfContext));
 	if(!elf) {
 		fprintf(stderr,"[ELF ERROR] Not enough memory\n"); 
-		free(ElfFile); 
+		UnmapFile(&ElfMap); 
 		return MEM_ERROR;
 	}
 	
@@ -143,7 +143,7 @@ finish:
 #ifdef DEBUG
 	printf("[DEBUG] Free others\n");
 #endif
-	free(ElfFile);
+	UnmapFile(&ElfMap);
 	free(elf->sections);
 	free(elf->programHeaders);
 	free(elf->segments);
@@ -153,34 +153,22 @@ finish:
 
 int ImportPlainRegionFromFile(ncch_settings *ncchset)
 {
-	ncchset->sections.plainRegion.size = align(ncchset->componentFilePtrs.plainregionSize,ncchset->options.mediaSize);
-	ncchset->sections.plainRegion.buffer = malloc(ncchset->sections.plainRegion.size);
-	if(!ncchset->sections.plainRegion.buffer) {fprintf(stderr,"[ELF ERROR] Not enough memory\n"); return MEM_ERROR;}
-	ReadFile_64(ncchset->sections.plainRegion.buffer,ncchset->componentFilePtrs.plainregionSize,0,ncchset->componentFilePtrs.plainregion);
-	return 0;
+	return MapComponentSection(&ncchset->sections.plainRegion,&ncchset->componentMaps.plainregion,ncchset->componentFilePtrs.plainregion,ncchset->componentFilePtrs.plainregionSize,ncchset->options.mediaSize);
 }
 
 int ImportExeFsCodeBinaryFromFile(ncch_settings *ncchset)
 {
 	u32 size = ncchset->componentFilePtrs.codeSize;
-	u8 *buffer = malloc(size);
-	if(!buffer) {fprintf(stderr,"[ELF ERROR] Not enough memory\n"); return MEM_ERROR;}
-	ReadFile_64(buffer,size,0,ncchset->componentFilePtrs.code);
-
-	ncchset->exefsSections.code.size = ncchset->componentFilePtrs.codeSize;
-	ncchset->exefsSections.code.buffer = malloc(ncchset->exefsSections.code.size);
-	if(!ncchset->exefsSections.code.buffer) {fprintf(stderr,"[ELF ERROR] Not enough memory\n"); return MEM_ERROR;}
-	ReadFile_64(ncchset->exefsSections.code.buffer,ncchset->exefsSections.code.size,0,ncchset->componentFilePtrs.code);
-	if(ncchset->options.CompressCode){
-		u32 new_len;
-		ncchset->exefsSections.code.buffer = BLZ_Code(buffer,size,&new_len,BLZ_NORMAL);
-		ncchset->exefsSections.code.size = new_len;
-		free(buffer);
-	}
-	else{
-		ncchset->exefsSections.code.size = size;
-		ncchset->exefsSections.code.buffer = buffer;
-	}
+	if(!ncchset->options.CompressCode)
+		return MapComponentSection(&ncchset->exefsSections.code,&ncchset->componentMaps.code,ncchset->componentFilePtrs.code,size,1);
+
+	// BLZ_Code() inverts the code in place while compressing, so it gets a private writable mapping
+	mapped_file code;
+	if(MapFile(&code,ncchset->componentFilePtrs.code,size,true)) {fprintf(stderr,"[ELF ERROR] Not enough memory\n"); return MEM_ERROR;}
+	u32 new_len;
+	ncchset->exefsSections.code.buffer = BLZ_Code(code.buffer,size,&new_len,ncchset->options.CompressMode);
+	ncchset->exefsSections.code.size = new_len;
+	UnmapFile(&code);
 	return 0;
 }
 
@@ -279,7 +267,7 @@ int CreateExeFsCode(ElfContext *elf, u8 *ElfFile, ncch_settings *ncchset)
 	/* Compressing If needed */
 	if(ncchset->options.CompressCode){
 		u32 new_len;
-		ncchset->exefsSections.code.buffer = BLZ_Code(code,size,&new_len,BLZ_NORMAL);
+		ncchset->exefsSections.code.buffer = BLZ_Code(code,size,&new_len,ncchset->options.CompressMode);
 		ncchset->exefsSections.code.size = new_len;
 		free(code);
 	}
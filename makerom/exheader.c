@@ -56,7 +56,7 @@ int SignAccessDesc(extended_hdr *exHdr, keys_struct *keys)
 {
 	u8 *AccessDesc = (u8*) &exHdr->accessDescriptor.ncchRsaPubKey;
 	u8 *Signature = (u8*) &exHdr->accessDescriptor.signature;
-	return ctr_sig(AccessDesc,0x300,Signature,keys->rsa.acexPub,keys->rsa.acexPvt,RSA_2048_SHA256,CTR_RSA_SIGN);
+	return ctr_sig_sign(keys->rsa.acexCtx,AccessDesc,0x300,Signature,RSA_2048_SHA256);
 }
 
 int CheckaccessDescSignature(extended_hdr *exHdr, keys_struct *keys)
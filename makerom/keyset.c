@@ -8,7 +8,8 @@
 #endif
 
 // Private Prototypes
-int SetRsaKeySet(u8 **PrivDest, u8 *PrivSource, u8 **PubDest, u8 *PubSource);
+int SetRsaKeySet(u8 **PrivDest, u8 *PrivSource, u8 **PubDest, u8 *PubSource, ctr_rsa_context **CtxDest);
+void FreeRsaCtx(ctr_rsa_context **ctx);
 int SetunFixedKey(keys_struct *keys, u8 *unFixedKey);
 void InitcommonKeySlots(keys_struct *keys);
 
@@ -278,6 +279,10 @@ void FreeKeys(keys_struct *keys)
 	free(keys->rsa.acexPub);
 	free(keys->rsa.cxiHdrPub);
 	free(keys->rsa.cxiHdrPvt);
+	FreeRsaCtx(&keys->rsa.cpCtx);
+	FreeRsaCtx(&keys->rsa.xsCtx);
+	FreeRsaCtx(&keys->rsa.cciCfaCtx);
+	FreeRsaCtx(&keys->rsa.acexCtx);
 	
 	// Certs
 	free(keys->certs.caCert);
@@ -286,7 +291,7 @@ void FreeKeys(keys_struct *keys)
 	memset(keys,0,sizeof(keys_struct));
 }
 
-int SetRsaKeySet(u8 **PrivDest, u8 *PrivSource, u8 **PubDest, u8 *PubSource)
+int SetRsaKeySet(u8 **PrivDest, u8 *PrivSource, u8 **PubDest, u8 *PubSource, ctr_rsa_context **CtxDest)
 {
 	int result = 0;
 	if(PrivSource){
@@ -297,9 +302,32 @@ int SetRsaKeySet(u8 **PrivDest, u8 *PrivSource, u8 **PubDest, u8 *PubSource)
 		result = CopyData(PubDest,PubSource,0x100);
 		if(result) return result;
 	}
+
+	FreeRsaCtx(CtxDest);
+	if(*PrivDest && *PubDest){
+		*CtxDest = malloc(sizeof(ctr_rsa_context));
+		if(!*CtxDest) return MEM_ERROR;
+		if(ctr_rsa_init(*CtxDest,*PubDest,*PrivDest,NULL,RSA_2048,RSAKEY_PRIV)){
+			free(*CtxDest);
+			*CtxDest = NULL;
+			return KEYSET_ERROR;
+		}
+		if(ctr_rsa_precompute(*CtxDest)){
+			FreeRsaCtx(CtxDest);
+			return KEYSET_ERROR;
+		}
+	}
 	return 0;
 }
 
+void FreeRsaCtx(ctr_rsa_context **ctx)
+{
+	if(*ctx)
+		ctr_rsa_free(*ctx);
+	free(*ctx);
+	*ctx = NULL;
+}
+
 int SetCommonKey(keys_struct *keys, u8 *commonKey, u8 Index)
 {
 	if(!keys) return -1;
@@ -352,25 +380,25 @@ int SetNcchUnfixedKeys(keys_struct *keys, u8 *ncchSig)
 int SetTIK_RsaKey(keys_struct *keys, u8 *PrivateExp, u8 *PublicMod)
 {
 	if(!keys) return -1;
-	return SetRsaKeySet(&keys->rsa.xsPvt,PrivateExp,&keys->rsa.xsPub,PublicMod);
+	return SetRsaKeySet(&keys->rsa.xsPvt,PrivateExp,&keys->rsa.xsPub,PublicMod,&keys->rsa.xsCtx);
 }
 
 int SetTMD_RsaKey(keys_struct *keys, u8 *PrivateExp, u8 *PublicMod)
 {
 	if(!keys) return -1;
-	return SetRsaKeySet(&keys->rsa.cpPvt,PrivateExp,&keys->rsa.cpPub,PublicMod);
+	return SetRsaKeySet(&keys->rsa.cpPvt,PrivateExp,&keys->rsa.cpPub,PublicMod,&keys->rsa.cpCtx);
 }
 
 int Set_CCI_CFA_RsaKey(keys_struct *keys, u8 *PrivateExp, u8 *PublicMod)
 {
 	if(!keys) return -1;
-	return SetRsaKeySet(&keys->rsa.cciCfaPvt,PrivateExp,&keys->rsa.cciCfaPub,PublicMod);
+	return SetRsaKeySet(&keys->rsa.cciCfaPvt,PrivateExp,&keys->rsa.cciCfaPub,PublicMod,&keys->rsa.cciCfaCtx);
 }
 
 int SetAccessDesc_RsaKey(keys_struct *keys, u8 *PrivateExp, u8 *PublicMod)
 {
 	if(!keys) return -1;
-	return SetRsaKeySet(&keys->rsa.acexPvt,PrivateExp,&keys->rsa.acexPub,PublicMod);
+	return SetRsaKeySet(&keys->rsa.acexPvt,PrivateExp,&keys->rsa.acexPub,PublicMod,&keys->rsa.acexCtx);
 }
 
 int SetCaCert(keys_struct *keys, u8 *Cert)
@@ -80,6 +80,12 @@ typedef struct
 		u8 *acexPub;
 		u8 *cxiHdrPub;
 		u8 *cxiHdrPvt;
+
+		// Parsed private keys, so each signature doesn't set up its key again
+		ctr_rsa_context *cpCtx;
+		ctr_rsa_context *xsCtx;
+		ctr_rsa_context *cciCfaCtx;
+		ctr_rsa_context *acexCtx;
 	} rsa;
 	
 	struct
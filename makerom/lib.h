@@ -26,6 +26,7 @@
 
 #include "types.h"
 #include "utils.h"
+#include "thread.h"
 #include "crypto.h"
 
 #include "keyset.h"
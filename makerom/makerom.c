@@ -3,6 +3,17 @@
 #include "ncsd.h"
 #include "cia.h"
 
+typedef struct
+{
+	user_settings usrset;
+	int result;
+} container_job;
+
+int BuildContainer(user_settings *usrset);
+void BuildContainerJob(void *arg);
+int BuildExtraOutputs(user_settings *usrset);
+int ImportNcch0(user_settings *usrset);
+
 int main(int argc, char *argv[])
 {
 	// Setting up user settings
@@ -35,28 +46,8 @@ int main(int argc, char *argv[])
 	// Setup Content 0
 	if(!usrset->ncch.buildNcch0){ // Import Content
 		if(usrset->common.workingFileType == infile_ncch){
-			if(!AssertFile(usrset->common.contentPath[0])){
-				fprintf(stderr,"[MAKEROM ERROR] Failed to open Content 0: %s\n",usrset->common.contentPath[0]); 
-				goto finish;
-			}
-			u64 fileSize = GetFileSize_u64(usrset->common.contentPath[0]);
-			u64 calcSize = 0;
-
-			FILE *ncch0 = fopen(usrset->common.contentPath[0],"rb");
-			
-			ncch_hdr hdr;
-			GetNCCH_CommonHDR(&hdr,ncch0,NULL);
-			calcSize = GetNCCH_MediaSize(&hdr) * GetNCCH_MediaUnitSize(&hdr);
-			if(calcSize != fileSize){
-				fprintf(stderr,"[MAKEROM ERROR] Content 0 is corrupt\n"); 
-				fclose(ncch0);
-				goto finish;
-			}
-
-			usrset->common.workingFile.size = fileSize;
-			usrset->common.workingFile.buffer = malloc(fileSize);
-			ReadFile_64(usrset->common.workingFile.buffer, usrset->common.workingFile.size,0,ncch0);
-			fclose(ncch0);
+			result = ImportNcch0(usrset);
+			if(result < 0) goto finish;
 		}
 		else if(usrset->common.workingFileType == infile_srl || usrset->common.workingFileType == infile_ncsd){
 			if(!AssertFile(usrset->common.workingFilePath)) {
@@ -75,6 +66,17 @@ int main(int argc, char *argv[])
 #ifdef DEBUG
 	printf("[DEBUG] Build NCCH0\n");
 #endif
+		// Several containers copy content 0 from a file, so without a CXI/CFA output it is streamed to a temporary one
+		if(usrset->common.outFormatNum > 1 && usrset->common.outFormat != CXI && usrset->common.outFormat != CFA){
+			const char *ext = ".ncch0.tmp";
+			usrset->common.tmpNcch0Path = calloc(strlen(usrset->common.outFileName)+strlen(ext)+1,1);
+			if(!usrset->common.tmpNcch0Path){
+				fprintf(stderr,"[MAKEROM ERROR] Not enough memory\n");
+				result = MEM_ERROR;
+				goto finish;
+			}
+			sprintf(usrset->common.tmpNcch0Path,"%s%s",usrset->common.outFileName,ext);
+		}
 		result = build_NCCH(usrset);
 		if(result < 0) { 
 			//fprintf(stderr,"[ERROR] %s generation failed\n",usrset->build_ncch_type == CXI? "CXI" : "CFA"); 
@@ -82,16 +84,44 @@ int main(int argc, char *argv[])
 			goto finish; 
 		}	
 	}
+	// Make the other outputs from the same content 0
+	if(usrset->common.outFormatNum > 1){
+		result = BuildExtraOutputs(usrset);
+		if(result < 0) goto finish;
+	}
+	// Make CCI/CIA
+	else if(usrset->common.outFormat == CCI || usrset->common.outFormat == CIA){
+		result = BuildContainer(usrset);
+		if(result < 0) goto finish;
+	}
+	// No Container Raw CXI/CFA, these are streamed to the outfile by build_NCCH()
+	
+finish:
+	if(usrset->common.tmpNcch0Path){
+		remove(usrset->common.tmpNcch0Path);
+		free(usrset->common.tmpNcch0Path);
+	}
+#ifdef DEBUG
+	printf("[DEBUG] Free Context\n");
+#endif
+	free_UserSettings(usrset);
+#ifdef DEBUG
+	printf("[DEBUG] Finished returning (result=%d)\n",result);
+#endif
+	return result;
+}
+
+int BuildContainer(user_settings *usrset)
+{
+	int result = 0;
 	// Make CCI
 	if(usrset->common.outFormat == CCI){
 #ifdef DEBUG
 	printf("[DEBUG] Building CCI\n");
 #endif
 		result = build_CCI(usrset);
-		if(result < 0) { 
+		if(result < 0)
 			fprintf(stderr,"[RESULT] Failed to build CCI\n");
-			goto finish; 
-		}
 	}
 	// Make CIA
 	else if(usrset->common.outFormat == CIA){
@@ -99,34 +129,132 @@ int main(int argc, char *argv[])
 	printf("[DEBUG] Building CIA\n");
 #endif
 		result = build_CIA(usrset);
-		if(result < 0) { 
+		if(result < 0)
 			fprintf(stderr,"[RESULT] Failed to build CIA\n"); 
-			goto finish; 
-		}
 	}
-	// No Container Raw CXI/CFA
-	else if(usrset->common.outFormat == CXI || usrset->common.outFormat == CFA){
-#ifdef DEBUG
-	printf("[DEBUG] Outputting NCCH, because No Container\n");
-#endif
-		FILE *ncch_out = fopen(usrset->common.outFileName,"wb");
-		if(!ncch_out) {
-			fprintf(stderr,"[MAKEROM ERROR] Failed to create '%s'\n",usrset->common.outFileName); 
-			fprintf(stderr,"[RESULT] Failed to build '%s'\n",usrset->common.outFormat == CXI? "CXI" : "CFA"); 
-			result = FAILED_TO_CREATE_OUTFILE; 
+	return result;
+}
+
+void BuildContainerJob(void *arg)
+{
+	container_job *job = (container_job*)arg;
+	job->result = BuildContainer(&job->usrset);
+}
+
+int BuildExtraOutputs(user_settings *usrset)
+{
+	int result = 0;
+	u32 outputNum = usrset->common.outFormatNum;
+
+	// Content 0 was streamed to the CXI/CFA output, which always comes first, or else to a temporary file.
+	// The containers copy it from there, so like a prebuilt content 0 only the data before its RomFs is read
+	bool streamed = usrset->common.outFormat == CXI || usrset->common.outFormat == CFA;
+	char *ncch0Path = streamed ? usrset->common.outFileName : usrset->common.tmpNcch0Path;
+	usrset->common.contentPath[0] = calloc(strlen(ncch0Path)+1,1);
+	if(!usrset->common.contentPath[0]){
+		fprintf(stderr,"[MAKEROM ERROR] Not enough memory\n");
+		return MEM_ERROR;
+	}
+	strcpy(usrset->common.contentPath[0],ncch0Path);
+	usrset->ncch.buildNcch0 = false;
+	result = ImportNcch0(usrset);
+	if(result < 0)
+		return result;
+
+	// Each container gets its own settings, as the writers consume content 0 and derive keys into them
+	u32 jobNum = streamed ? outputNum-1 : outputNum;
+	container_job *jobs = calloc(jobNum,sizeof(container_job));
+	thread_context *threads = calloc(jobNum,sizeof(thread_context));
+	if(!jobs || !threads){
+		fprintf(stderr,"[MAKEROM ERROR] Not enough memory\n");
+		result = MEM_ERROR;
+		goto finish;
+	}
+	for(u32 i = 0; i < jobNum; i++){
+		user_settings *set = &jobs[i].usrset;
+		memcpy(set,usrset,sizeof(user_settings));
+		if(streamed || i){
+			u32 output = streamed ? i : i-1;
+			set->common.outFormat = usrset->common.extraOutFormat[output];
+			set->common.outFileName = usrset->common.extraOutFileName[output];
+		}
+
+		set->common.keys.aes.unFixedKey0 = malloc(16);
+		set->common.keys.aes.unFixedKey1 = malloc(16);
+		if(i < jobNum-1){
+			set->common.workingFile.buffer = malloc(usrset->common.workingFile.size);
+			if(set->common.workingFile.buffer)
+				memcpy(set->common.workingFile.buffer,usrset->common.workingFile.buffer,usrset->common.workingFile.size);
+		}
+		else // The last container takes the original
+			usrset->common.workingFile.buffer = NULL;
+		if(!set->common.keys.aes.unFixedKey0 || !set->common.keys.aes.unFixedKey1 || !set->common.workingFile.buffer){
+			fprintf(stderr,"[MAKEROM ERROR] Not enough memory\n");
+			result = MEM_ERROR;
 			goto finish;
 		}
-		WriteBuffer(usrset->common.workingFile.buffer,usrset->common.workingFile.size,0,ncch_out);
-		fclose(ncch_out);
 	}
-	
+
+	// The containers are written concurrently, the calling thread takes the first
+	for(u32 i = 1; i < jobNum; i++)
+		thread_start(&threads[i],BuildContainerJob,&jobs[i]);
+	BuildContainerJob(&jobs[0]);
+	for(u32 i = 1; i < jobNum; i++)
+		thread_join(&threads[i]);
+	for(u32 i = 0; i < jobNum; i++){
+		if(jobs[i].result < 0)
+			result = jobs[i].result;
+	}
+
 finish:
-#ifdef DEBUG
-	printf("[DEBUG] Free Context\n");
-#endif
-	free_UserSettings(usrset);
-#ifdef DEBUG
-	printf("[DEBUG] Finished returning (result=%d)\n",result);
-#endif
+	if(jobs){
+		for(u32 i = 0; i < jobNum; i++){
+			free(jobs[i].usrset.common.keys.aes.unFixedKey0);
+			free(jobs[i].usrset.common.keys.aes.unFixedKey1);
+			free(jobs[i].usrset.common.workingFile.buffer);
+		}
+	}
+	free(jobs);
+	free(threads);
 	return result;
-}
\ No newline at end of file
+}
+
+int ImportNcch0(user_settings *usrset)
+{
+	char *path = usrset->common.contentPath[0];
+	if(!AssertFile(path)){
+		fprintf(stderr,"[MAKEROM ERROR] Failed to open Content 0: %s\n",path); 
+		return FAILED_TO_OPEN_FILE;
+	}
+	u64 fileSize = GetFileSize_u64(path);
+	u64 calcSize = 0;
+
+	FILE *ncch0 = fopen(path,"rb");
+	
+	ncch_hdr hdr;
+	GetNCCH_CommonHDR(&hdr,ncch0,NULL);
+	calcSize = (u64)GetNCCH_MediaSize(&hdr) * (u64)GetNCCH_MediaUnitSize(&hdr);
+	if(calcSize != fileSize){
+		fprintf(stderr,"[MAKEROM ERROR] Content 0 is corrupt\n"); 
+		fclose(ncch0);
+		return FAILED_TO_IMPORT_FILE;
+	}
+
+	// Containers copy content 0 straight from its file, its RomFs isn't needed to set them up
+	ncch_struct ncch_ctx;
+	GetNCCHStruct(&ncch_ctx,&hdr);
+	u64 size = fileSize;
+	if(ncch_ctx.romfsSize && ncch_ctx.romfsOffset >= 0x200 && ncch_ctx.romfsOffset < fileSize)
+		size = ncch_ctx.romfsOffset;
+
+	usrset->common.workingFile.size = size;
+	usrset->common.workingFile.buffer = malloc(size);
+	if(!usrset->common.workingFile.buffer){
+		fprintf(stderr,"[MAKEROM ERROR] Not enough memory\n");
+		fclose(ncch0);
+		return MEM_ERROR;
+	}
+	ReadFile_64(usrset->common.workingFile.buffer,size,0,ncch0);
+	fclose(ncch0);
+	return 0;
+}
@@ -5,7 +5,9 @@
 #include "elf.h"
 #include "exefs.h"
 #include "romfs.h"
+#include "ncch_cache.h"
 #include "titleid.h"
+#include "blz.h"
 
 #include "logo_data.h" // Contains Logos
 
@@ -20,6 +22,7 @@ void free_NCCHSettings(ncch_settings *set);
 int get_NCCHSettings(ncch_settings *ncchset, user_settings *usrset);
 int SetBasicOptions(ncch_settings *ncchset, user_settings *usrset);
 int CreateInputFilePtrs(ncch_settings *ncchset, user_settings *usrset);
+int CreateOutputFilePtr(ncch_settings *ncchset, user_settings *usrset);
 int ImportNonCodeExeFsSections(ncch_settings *ncchset);	
 int ImportLogo(ncch_settings *ncchset);
 
@@ -31,12 +34,40 @@ bool IsValidProductCode(char *ProductCode, bool FreeProductCode);
 int BuildCommonHeader(ncch_settings *ncchset);
 int EncryptNCCHSections(ncch_settings *ncchset);
 int WriteNCCHSectionsToBuffer(ncch_settings *ncchset);
+int WriteNCCHSectionsToFile(ncch_settings *ncchset);
+int HashNCCHSectionInFile(FILE *fp, u64 offset, u64 srcSize, u64 size, ncch_struct *ctx, u8 key[16], u8 hash[32]);
+int CryptNCCHSectionToFile(FILE *src, u64 srcOffset, u64 srcSize, FILE *fp, u64 offset, u64 size, ncch_struct *ctx, u8 key[16], u8 type);
+void CryptNCCHJob(void *arg);
+void CryptNCCHExeFsJob(void *arg);
+void CryptNCCHRomFsRange(u8 *data, u64 offset, u64 size, ncch_struct *ctx, u8 key[16]);
+
+const u32 NCCH_STREAM_BUFFER_SIZE = 0x400000;
+const u32 NCCH_CRYPT_THREAD_MIN_SIZE = 0x40000; // Smallest slice worth handing to an AES thread
+
+typedef struct
+{
+	u8 *buffer;
+	u64 size;
+	u64 src_pos;
+	ncch_struct *ctx;
+	u8 *key;
+	u8 type;
+} ncch_cryptjob;
+
+typedef struct
+{
+	ncch_settings *ncchset;
+	u8 *exhdr;
+	u8 *exefs;
+	u8 *key0;
+	u8 *key1;
+} ncch_exefs_cryptjob;
 
 // Code
 
 int SignCFA(u8 *Signature, u8 *CFA_HDR, keys_struct *keys)
 {
-	return ctr_sig(CFA_HDR,sizeof(ncch_hdr),Signature,keys->rsa.cciCfaPub,keys->rsa.cciCfaPvt,RSA_2048_SHA256,CTR_RSA_SIGN);
+	return ctr_sig_sign(keys->rsa.cciCfaCtx,CFA_HDR,sizeof(ncch_hdr),Signature,RSA_2048_SHA256);
 }
 
 int CheckCFASignature(u8 *Signature, u8 *CFA_HDR, keys_struct *keys)
@@ -60,6 +91,7 @@ int CheckCXISignature(u8 *Signature, u8 *CXI_HDR, u8 *PubK)
 int build_NCCH(user_settings *usrset)
 {
 	int result;
+	char *cachePath = NULL;
 
 	// Init Settings\n");
 	ncch_settings *ncchset = malloc(sizeof(ncch_settings));
@@ -73,7 +105,21 @@ int build_NCCH(user_settings *usrset)
 	result = get_NCCHSettings(ncchset,usrset);
 	if(result) goto finish;
 
-	
+	// Prepare for RomFs, before anything is built as its file list is part of the cache key\n");
+	romfs_buildctx romfs_ctx;
+	memset(&romfs_ctx,0,sizeof(romfs_buildctx));
+	result = SetupRomFs(ncchset,&romfs_ctx);
+	if(result) goto finish;
+
+	// Reuse a cached NCCH if it was built from the same inputs\n");
+	if(usrset->ncch.cacheDir){
+		result = GetNcchCachePath(&cachePath,usrset,&romfs_ctx);
+		if(result) goto finish;
+		if(LoadCachedNcch(ncchset,cachePath) == 0){
+			FreeRomFsCtx(&romfs_ctx);
+			goto finish;
+		}
+	}
 
 	if(!ncchset->options.IsCfa){ // CXI Specfic Sections
 		// Build ExeFs Code Section\n");
@@ -91,13 +137,6 @@ int build_NCCH(user_settings *usrset)
 	if(result) goto finish;
 
 	
-	// Prepare for RomFs\n");
-	romfs_buildctx romfs_ctx;
-	memset(&romfs_ctx,0,sizeof(romfs_buildctx));
-	result = SetupRomFs(ncchset,&romfs_ctx);
-	if(result) goto finish;
-
-	
 	// Setup NCCH including final memory allocation\n");
 	result = SetupNcch(ncchset,&romfs_ctx);
 	if(result) goto finish;
@@ -105,15 +144,25 @@ int build_NCCH(user_settings *usrset)
 	// Build RomFs\n");
 	result = BuildRomFs(&romfs_ctx);
 	if(result) goto finish;
+	ncchset->outFile.romfsPatched = romfs_ctx.patched;
 	
 	// Finalise NCCH (Hashes/Signatures and crypto)\n");
 	result = FinaliseNcch(ncchset);
 	if(result) goto finish;
 
+	if(cachePath)
+		SaveCachedNcch(ncchset,cachePath);
+
 finish:
 	if(result) 
 		fprintf(stderr,"[NCCH ERROR] NCCH Build Process Failed\n");
+	if(result && ncchset->outFile.fp){ // Don't leave a partially written NCCH behind
+		fclose(ncchset->outFile.fp);
+		ncchset->outFile.fp = NULL;
+		remove(ncchset->outFile.path);
+	}
 	free_NCCHSettings(ncchset);
+	free(cachePath);
 	return result;
 }
 
@@ -133,13 +182,17 @@ void free_NCCHSettings(ncch_settings *set)
 	if(set->componentFilePtrs.romfs) fclose(set->componentFilePtrs.romfs);
 	if(set->componentFilePtrs.plainregion) fclose(set->componentFilePtrs.plainregion);
 
-	if(set->exefsSections.code.size) free(set->exefsSections.code.buffer);
-	if(set->exefsSections.banner.size) free(set->exefsSections.banner.buffer);
-	if(set->exefsSections.icon.size) free(set->exefsSections.icon.buffer);
+	if(set->outFile.fp) fclose(set->outFile.fp);
+	free(set->outFile.header);
+	free(set->outFile.romfsCachePath);
+
+	FreeComponentSection(&set->exefsSections.code,&set->componentMaps.code);
+	FreeComponentSection(&set->exefsSections.banner,&set->componentMaps.banner);
+	FreeComponentSection(&set->exefsSections.icon,&set->componentMaps.icon);
 
 	if(set->sections.exhdr.size) free(set->sections.exhdr.buffer);
-	if(set->sections.logo.size) free(set->sections.logo.buffer);
-	if(set->sections.plainRegion.size) free(set->sections.plainRegion.buffer);
+	FreeComponentSection(&set->sections.logo,&set->componentMaps.logo);
+	FreeComponentSection(&set->sections.plainRegion,&set->componentMaps.plainregion);
 	if(set->sections.exeFs.size) free(set->sections.exeFs.buffer);
 
 	memset(set,0,sizeof(ncch_settings));
@@ -159,6 +212,8 @@ int get_NCCHSettings(ncch_settings *ncchset, user_settings *usrset)
 	if(result) return result;
 	result = CreateInputFilePtrs(ncchset,usrset);
 	if(result) return result;
+	result = CreateOutputFilePtr(ncchset,usrset);
+	if(result) return result;
 	result = ImportNonCodeExeFsSections(ncchset);
 	if(result) return result;
 	result = ImportLogo(ncchset);
@@ -180,6 +235,19 @@ int SetBasicOptions(ncch_settings *ncchset, user_settings *usrset)
 	if(usrset->common.rsfSet.Option.EnableCompress != -1) ncchset->options.CompressCode = usrset->common.rsfSet.Option.EnableCompress;
 	else ncchset->options.CompressCode = true;
 
+	ncchset->options.CompressMode = BLZ_NORMAL;
+	if(usrset->common.rsfSet.Option.CompressMode){
+		char *mode = usrset->common.rsfSet.Option.CompressMode;
+		if(strcasecmp(mode,"normal") == 0) ncchset->options.CompressMode = BLZ_NORMAL;
+		else if(strcasecmp(mode,"best") == 0) ncchset->options.CompressMode = BLZ_BEST;
+		else if(strcasecmp(mode,"fast") == 0) ncchset->options.CompressMode = BLZ_FAST;
+		else if(strcasecmp(mode,"optimal") == 0) ncchset->options.CompressMode = BLZ_OPTIMAL;
+		else{
+			fprintf(stderr,"[NCCH ERROR] Invalid compress mode: %s\n",mode);
+			return NCCH_BAD_YAML_SET;
+		}
+	}
+
 	if(usrset->common.rsfSet.Option.UseOnSD != -1) ncchset->options.UseOnSD = usrset->common.rsfSet.Option.UseOnSD;
 	else ncchset->options.UseOnSD = false;
 	usrset->common.rsfSet.Option.UseOnSD = ncchset->options.UseOnSD;
@@ -274,41 +342,110 @@ int CreateInputFilePtrs(ncch_settings *ncchset, user_settings *usrset)
 	return 0;
 }
 
-int ImportNonCodeExeFsSections(ncch_settings *ncchset)
+int CreateOutputFilePtr(ncch_settings *ncchset, user_settings *usrset)
 {
-	if(ncchset->componentFilePtrs.banner){
-		ncchset->exefsSections.banner.size = ncchset->componentFilePtrs.bannerSize;
-		ncchset->exefsSections.banner.buffer = malloc(ncchset->exefsSections.banner.size);
-		if(!ncchset->exefsSections.banner.buffer) {
-			fprintf(stderr,"[NCCH ERROR] Not enough memory\n"); 
-			return MEM_ERROR;
+	// NCCHs going into a single container are built in memory, standalone CXI/CFAs are streamed to the outfile
+	if(usrset->common.tmpNcch0Path){
+		ncchset->outFile.path = usrset->common.tmpNcch0Path;
+		ncchset->outFile.fp = fopen(ncchset->outFile.path,"wb+");
+		if(!ncchset->outFile.fp){
+			fprintf(stderr,"[NCCH ERROR] Failed to create '%s'\n",ncchset->outFile.path);
+			return FAILED_TO_CREATE_OUTFILE;
 		}
-		ReadFile_64(ncchset->exefsSections.banner.buffer,ncchset->exefsSections.banner.size,0,ncchset->componentFilePtrs.banner);
+		return 0;
 	}
-	if(ncchset->componentFilePtrs.icon){
-		ncchset->exefsSections.icon.size = ncchset->componentFilePtrs.iconSize;
-		ncchset->exefsSections.icon.buffer = malloc(ncchset->exefsSections.icon.size);
-		if(!ncchset->exefsSections.icon.buffer) {
+	if(usrset->common.outFormat != CXI && usrset->common.outFormat != CFA)
+		return 0;
+
+	// With a RomFs cache, the previous outfile is kept until SetupNcch() knows if its RomFs can be patched
+	if(usrset->ncch.useRomFsCache){
+		ncchset->outFile.fp = fopen(usrset->common.outFileName,"rb+");
+		ncchset->outFile.reused = ncchset->outFile.fp != NULL;
+	}
+	if(!ncchset->outFile.fp)
+		ncchset->outFile.fp = fopen(usrset->common.outFileName,"wb+");
+	ncchset->outFile.path = usrset->common.outFileName;
+	if(!ncchset->outFile.fp){
+		fprintf(stderr,"[NCCH ERROR] Failed to create '%s'\n",usrset->common.outFileName);
+		return FAILED_TO_CREATE_OUTFILE;
+	}
+
+	if(usrset->ncch.useRomFsCache){
+		const char *ext = ".romfscache";
+		ncchset->outFile.romfsCachePath = calloc(strlen(usrset->common.outFileName)+strlen(ext)+1,1);
+		if(!ncchset->outFile.romfsCachePath){
 			fprintf(stderr,"[NCCH ERROR] Not enough memory\n");
 			return MEM_ERROR;
 		}
-		ReadFile_64(ncchset->exefsSections.icon.buffer,ncchset->exefsSections.icon.size,0,ncchset->componentFilePtrs.icon);
+		sprintf(ncchset->outFile.romfsCachePath,"%s%s",usrset->common.outFileName,ext);
 	}
 	return 0;
 }
 
-int ImportLogo(ncch_settings *ncchset)
+int ResetNcchOutFile(ncch_settings *ncchset)
 {
-	if(ncchset->componentFilePtrs.logo){
-		ncchset->sections.logo.size = align(ncchset->componentFilePtrs.logoSize,ncchset->options.mediaSize);
-		ncchset->sections.logo.buffer = malloc(ncchset->sections.logo.size);
-		if(!ncchset->sections.logo.buffer) {
-			fprintf(stderr,"[NCCH ERROR] Not enough memory\n");
-			return MEM_ERROR;
-		}
-		memset(ncchset->sections.logo.buffer,0,ncchset->sections.logo.size);
-		ReadFile_64(ncchset->sections.logo.buffer,ncchset->componentFilePtrs.logoSize,0,ncchset->componentFilePtrs.logo);
+	// Truncates a reused outfile, so nothing of the previous NCCH is left behind
+	if(!ncchset->outFile.reused)
+		return 0;
+	ncchset->outFile.reused = false;
+	ncchset->outFile.fp = freopen(ncchset->outFile.path,"wb+",ncchset->outFile.fp);
+	if(!ncchset->outFile.fp){
+		fprintf(stderr,"[NCCH ERROR] Failed to create '%s'\n",ncchset->outFile.path);
+		return FAILED_TO_CREATE_OUTFILE;
+	}
+	return 0;
+}
+
+int MapComponentSection(buffer_struct *section, mapped_file *map, FILE *fp, u64 size, u32 alignment)
+{
+	if(MapFile(map,fp,size,false)){
+		fprintf(stderr,"[NCCH ERROR] Not enough memory\n");
+		return MEM_ERROR;
 	}
+
+	section->size = align(size,alignment);
+	if(section->size == size){ // Used in place
+		section->buffer = map->buffer;
+		return 0;
+	}
+
+	// Needs zero padding, so it is copied
+	section->buffer = calloc(1,section->size);
+	if(!section->buffer){
+		fprintf(stderr,"[NCCH ERROR] Not enough memory\n");
+		return MEM_ERROR;
+	}
+	memcpy(section->buffer,map->buffer,size);
+	UnmapFile(map);
+	return 0;
+}
+
+void FreeComponentSection(buffer_struct *section, mapped_file *map)
+{
+	if(section->buffer != map->buffer)
+		free(section->buffer);
+	UnmapFile(map);
+	section->buffer = NULL;
+}
+
+int ImportNonCodeExeFsSections(ncch_settings *ncchset)
+{
+	int result = 0;
+	if(ncchset->componentFilePtrs.banner){
+		result = MapComponentSection(&ncchset->exefsSections.banner,&ncchset->componentMaps.banner,ncchset->componentFilePtrs.banner,ncchset->componentFilePtrs.bannerSize,1);
+		if(result) return result;
+	}
+	if(ncchset->componentFilePtrs.icon){
+		result = MapComponentSection(&ncchset->exefsSections.icon,&ncchset->componentMaps.icon,ncchset->componentFilePtrs.icon,ncchset->componentFilePtrs.iconSize,1);
+		if(result) return result;
+	}
+	return 0;
+}
+
+int ImportLogo(ncch_settings *ncchset)
+{
+	if(ncchset->componentFilePtrs.logo)
+		return MapComponentSection(&ncchset->sections.logo,&ncchset->componentMaps.logo,ncchset->componentFilePtrs.logo,ncchset->componentFilePtrs.logoSize,ncchset->options.mediaSize);
 	else if(ncchset->rsfSet->BasicInfo.Logo){
 		if(strcasecmp(ncchset->rsfSet->BasicInfo.Logo,"nintendo") == 0){
 			ncchset->sections.logo.size = 0x2000;
@@ -420,7 +557,8 @@ int SetupNcch(ncch_settings *ncchset, romfs_buildctx *romfs)
 
 	// Aligning Total NCCH Size
 	ncchSize = align(ncchSize,ncchset->options.mediaSize);
-	u8 *ncch = calloc(1,ncchSize);
+	bool streaming = ncchset->outFile.fp != NULL;
+	u8 *ncch = calloc(1,streaming? 0x200 : ncchSize); // Only Sig+Hdr is kept in memory when streaming
 	if(!ncch){
 		fprintf(stderr,"[NCCH ERROR] Not enough memory\n");
 		return MEM_ERROR;
@@ -435,36 +573,81 @@ int SetupNcch(ncch_settings *ncchset, romfs_buildctx *romfs)
 	}
 	u32_to_u8(hdr->ncchSize,ncchSize/ncchset->options.mediaSize,LE);
 
+	// A built RomFs can be patched in place, unless its key is derived from the signature, which changes with every build
+	bool patchRomfs = streaming && romfsSize && !romfs->ImportRomfsBinary && ncchset->outFile.romfsCachePath;
+	u8 *romfsKey = NULL;
+	if(patchRomfs){
+		ncch_key_type keyType = GetNCCHKeyType(hdr);
+		if(keyType == KeyIsUnFixed || keyType == KeyIsUnFixed2){
+			fprintf(stderr,"[NCCH WARNING] RomFS cache not used, the RomFS key changes with each signature\n");
+			patchRomfs = false;
+		}
+		else if(keyType != NoKey){
+			romfsKey = GetNCCHKey(keyType,ncchset->keys);
+			patchRomfs = romfsKey != NULL;
+		}
+	}
 
-	// Copy already built sections to ncch\n");
+	if(streaming){
+		// Only a previous outfile with the same layout is kept, everything but its RomFs is cleared
+		if(ncchset->outFile.reused && (!patchRomfs || GetFileSize_u64(ncchset->outFile.path) != ncchSize)){
+			ret = ResetNcchOutFile(ncchset);
+			if(ret != 0){
+				free(ncch);
+				return ret;
+			}
+		}
+		if(ncchset->outFile.reused){
+			u8 *zeros = calloc(1,romfsOffset);
+			if(!zeros){
+				fprintf(stderr,"[NCCH ERROR] Not enough memory\n");
+				free(ncch);
+				return MEM_ERROR;
+			}
+			WriteBuffer(zeros,romfsOffset,0,ncchset->outFile.fp);
+			free(zeros);
+		}
+		else{
+			// Size the outfile now, so all padding reads back as zeros
+			u8 zero = 0;
+			WriteBuffer(&zero,1,ncchSize-1,ncchset->outFile.fp);
+		}
+	}
+
+	// Copy already built sections to ncch, when streaming they are written by FinaliseNcch()\n");
 	if(exhdrSize){
-		memcpy((u8*)(ncch+exhdrOffset),ncchset->sections.exhdr.buffer,ncchset->sections.exhdr.size);
-		free(ncchset->sections.exhdr.buffer);
-		ncchset->sections.exhdr.buffer = NULL;
+		if(!streaming){
+			memcpy((u8*)(ncch+exhdrOffset),ncchset->sections.exhdr.buffer,ncchset->sections.exhdr.size);
+			free(ncchset->sections.exhdr.buffer);
+			ncchset->sections.exhdr.buffer = NULL;
+		}
 		u32_to_u8(hdr->exhdrSize,exhdrSize,LE);
 	}
 
 	if(logoSize){
-		memcpy((u8*)(ncch+logoOffset),ncchset->sections.logo.buffer,ncchset->sections.logo.size);
-		free(ncchset->sections.logo.buffer);
-		ncchset->sections.logo.buffer = NULL;
+		if(!streaming){
+			memcpy((u8*)(ncch+logoOffset),ncchset->sections.logo.buffer,ncchset->sections.logo.size);
+			FreeComponentSection(&ncchset->sections.logo,&ncchset->componentMaps.logo);
+		}
 		u32_to_u8(hdr->logoOffset,logoOffset/ncchset->options.mediaSize,LE);
 		u32_to_u8(hdr->logoSize,logoSize/ncchset->options.mediaSize,LE);
 	}
 
-	if(plnRgnSize){		
-		memcpy((u8*)(ncch+plnRgnOffset),ncchset->sections.plainRegion.buffer,ncchset->sections.plainRegion.size);
-		free(ncchset->sections.plainRegion.buffer);
-		ncchset->sections.plainRegion.buffer = NULL;
+	if(plnRgnSize){
+		if(!streaming){
+			memcpy((u8*)(ncch+plnRgnOffset),ncchset->sections.plainRegion.buffer,ncchset->sections.plainRegion.size);
+			FreeComponentSection(&ncchset->sections.plainRegion,&ncchset->componentMaps.plainregion);
+		}
 		u32_to_u8(hdr->plainRegionOffset,plnRgnOffset/ncchset->options.mediaSize,LE);
 		u32_to_u8(hdr->plainRegionSize,plnRgnSize/ncchset->options.mediaSize,LE);
 	}
 
-	if(exefsSize){	
-		memcpy((u8*)(ncch+exefsOffset),ncchset->sections.exeFs.buffer,ncchset->sections.exeFs.size);
-		free(ncchset->sections.exeFs.buffer);
-		
-		ncchset->sections.exeFs.buffer = NULL;
+	if(exefsSize){
+		if(!streaming){
+			memcpy((u8*)(ncch+exefsOffset),ncchset->sections.exeFs.buffer,ncchset->sections.exeFs.size);
+			free(ncchset->sections.exeFs.buffer);
+			ncchset->sections.exeFs.buffer = NULL;
+		}
 		
 		u32_to_u8(hdr->exefsOffset,exefsOffset/ncchset->options.mediaSize,LE);
 		
@@ -474,16 +657,32 @@ int SetupNcch(ncch_settings *ncchset, romfs_buildctx *romfs)
 		
 	}
 
-	// Point Romfs CTX to output buffer, if exists\n");
+	// Point Romfs CTX to output buffer/file, if exists\n");
 	if(romfsSize){
-		romfs->output = ncch + romfsOffset;
+		if(!streaming)
+			romfs->output = ncch + romfsOffset;
+		else if(!romfs->ImportRomfsBinary){ // Imported RomFs binaries are copied into the outfile by FinaliseNcch()
+			romfs->outFile = ncchset->outFile.fp;
+			romfs->outOffset = romfsOffset;
+			if(patchRomfs){
+				romfs->cachePath = ncchset->outFile.romfsCachePath;
+				romfs->ncchCtx = &ncchset->cryptoDetails;
+				romfs->ncchKey = romfsKey;
+			}
+		}
 		u32_to_u8(hdr->romfsOffset,romfsOffset/ncchset->options.mediaSize,LE);
 		u32_to_u8(hdr->romfsSize,romfsSize/ncchset->options.mediaSize,LE);
 		u32_to_u8(hdr->romfsHashSize,romfsHashSize/ncchset->options.mediaSize,LE);
 	}
 	
-	ncchset->out->buffer = ncch;
-	ncchset->out->size = ncchSize;
+	if(streaming){
+		ncchset->outFile.header = ncch;
+		ncchset->outFile.size = ncchSize;
+	}
+	else{
+		ncchset->out->buffer = ncch;
+		ncchset->out->size = ncchSize;
+	}
 
 	GetNCCHStruct(&ncchset->cryptoDetails,hdr);
 
@@ -492,13 +691,25 @@ int SetupNcch(ncch_settings *ncchset, romfs_buildctx *romfs)
 
 int FinaliseNcch(ncch_settings *ncchset)
 {
-	u8 *ncch = ncchset->out->buffer;
+	bool streaming = ncchset->outFile.fp != NULL;
+	u8 *ncch = streaming? ncchset->outFile.header : ncchset->out->buffer;
 
 	ncch_hdr *hdr = (ncch_hdr*)(ncch + 0x100);
-	u8 *exhdr = (u8*)(ncch + ncchset->cryptoDetails.exhdrOffset);
-	u8 *logo = (u8*)(ncch + ncchset->cryptoDetails.logoOffset);
-	u8 *exefs = (u8*)(ncch + ncchset->cryptoDetails.exefsOffset);
-	u8 *romfs = (u8*)(ncch + ncchset->cryptoDetails.romfsOffset);
+	u8 *exhdr,*logo,*exefs,*romfs;
+	FILE *romfsBinary = NULL;
+	if(streaming){ // Sections are still in their own buffers, a built RomFs is already in the outfile
+		exhdr = ncchset->sections.exhdr.buffer;
+		logo = ncchset->sections.logo.buffer;
+		exefs = ncchset->sections.exeFs.buffer;
+		romfs = NULL;
+		romfsBinary = ncchset->componentFilePtrs.romfs; // An imported one is still only in its own file
+	}
+	else{
+		exhdr = (u8*)(ncch + ncchset->cryptoDetails.exhdrOffset);
+		logo = (u8*)(ncch + ncchset->cryptoDetails.logoOffset);
+		exefs = (u8*)(ncch + ncchset->cryptoDetails.exefsOffset);
+		romfs = (u8*)(ncch + ncchset->cryptoDetails.romfsOffset);
+	}
 
 	// Taking Hashes\n");
 	if(ncchset->cryptoDetails.exhdrSize)
@@ -507,8 +718,20 @@ int FinaliseNcch(ncch_settings *ncchset)
 		ctr_sha(logo,ncchset->cryptoDetails.logoSize,hdr->logoHash,CTR_SHA_256);
 	if(ncchset->cryptoDetails.exefsHashDataSize)
 		ctr_sha(exefs,ncchset->cryptoDetails.exefsHashDataSize,hdr->exefsHash,CTR_SHA_256);
-	if(ncchset->cryptoDetails.romfsHashDataSize)
-		ctr_sha(romfs,ncchset->cryptoDetails.romfsHashDataSize,hdr->romfsHash,CTR_SHA_256);
+	if(ncchset->cryptoDetails.romfsHashDataSize){
+		if(streaming){
+			int hash_result;
+			if(romfsBinary)
+				hash_result = HashNCCHSectionInFile(romfsBinary,0,ncchset->componentFilePtrs.romfsSize,ncchset->cryptoDetails.romfsHashDataSize,NULL,NULL,hdr->romfsHash);
+			else if(ncchset->outFile.romfsPatched) // Patched blocks were crypted as they were written, the key is a fixed one
+				hash_result = HashNCCHSectionInFile(ncchset->outFile.fp,ncchset->cryptoDetails.romfsOffset,ncchset->cryptoDetails.romfsHashDataSize,ncchset->cryptoDetails.romfsHashDataSize,&ncchset->cryptoDetails,GetNCCHKey(GetNCCHKeyType(hdr),ncchset->keys),hdr->romfsHash);
+			else
+				hash_result = HashNCCHSectionInFile(ncchset->outFile.fp,ncchset->cryptoDetails.romfsOffset,ncchset->cryptoDetails.romfsHashDataSize,ncchset->cryptoDetails.romfsHashDataSize,NULL,NULL,hdr->romfsHash);
+			if(hash_result) return hash_result;
+		}
+		else
+			ctr_sha(romfs,ncchset->cryptoDetails.romfsHashDataSize,hdr->romfsHash,CTR_SHA_256);
+	}
 
 	// Signing NCCH\n");
 	int sig_result = Good;
@@ -534,7 +757,8 @@ int FinaliseNcch(ncch_settings *ncchset)
 
 		if(key0 == NULL || key1 == NULL){
 			fprintf(stderr,"[NCCH ERROR] Failed to load ncch aes key\n");
-			free(ncch);
+			if(!streaming)
+				free(ncch);
 			return -1;
 		}
 
@@ -543,39 +767,192 @@ int FinaliseNcch(ncch_settings *ncchset)
 		memdump(stdout,"key1: ",key1,16);
 		*/
 
-		// Crypting Exheader
-		if(ncchset->cryptoDetails.exhdrSize)
-			CryptNCCHSection(exhdr,ncchset->cryptoDetails.exhdrSize,0x0,&ncchset->cryptoDetails,key0,ncch_exhdr);
+		// Exheader and ExeFs use their own counters, so they are crypted on a separate thread while the RomFs is crypted here
+		ncch_exefs_cryptjob exefsJob = {ncchset,exhdr,exefs,key0,key1};
+		thread_context exefsThread;
+		bool cryptRomfs = ncchset->cryptoDetails.romfsSize && !ncchset->outFile.romfsPatched;
+		if(cryptRomfs)
+			thread_start(&exefsThread,CryptNCCHExeFsJob,&exefsJob);
+		else
+			CryptNCCHExeFsJob(&exefsJob);
 
-		// Crypting ExeFs Files
-		if(ncchset->cryptoDetails.exefsSize){
-			exefs_hdr *exefsHdr = (exefs_hdr*)exefs;
-			for(int i = 0; i < MAX_EXEFS_SECTIONS; i++){
-				u8 *key = NULL;
-				if(strncmp(exefsHdr->fileHdr[i].name,"icon",8) == 0 || strncmp(exefsHdr->fileHdr[i].name,"banner",8) == 0)
-					key = key0;
-				else
-					key = key1;
+		// Crypting RomFs
+		if(cryptRomfs){
+			int crypt_result = 0;
+			if(romfsBinary) // Crypted on its way from the RomFs binary to the outfile
+				crypt_result = CryptNCCHSectionToFile(romfsBinary,0,ncchset->componentFilePtrs.romfsSize,ncchset->outFile.fp,ncchset->cryptoDetails.romfsOffset,ncchset->cryptoDetails.romfsSize,&ncchset->cryptoDetails,key1,ncch_romfs);
+			else if(streaming)
+				crypt_result = CryptNCCHSectionToFile(ncchset->outFile.fp,ncchset->cryptoDetails.romfsOffset,ncchset->cryptoDetails.romfsSize,ncchset->outFile.fp,ncchset->cryptoDetails.romfsOffset,ncchset->cryptoDetails.romfsSize,&ncchset->cryptoDetails,key1,ncch_romfs);
+			else
+				CryptNCCHSectionParallel(romfs,ncchset->cryptoDetails.romfsSize,0x0,&ncchset->cryptoDetails,key1,ncch_romfs);
+			thread_join(&exefsThread);
+			if(crypt_result) return crypt_result;
+		}
+	}
+	else if(romfsBinary){ // Plaintext RomFs binaries are spliced into the outfile as is
+		int copy_result = CopyFileData(romfsBinary,0,ncchset->outFile.fp,ncchset->cryptoDetails.romfsOffset,ncchset->componentFilePtrs.romfsSize);
+		if(copy_result) return copy_result;
+	}
 
-				u32 offset = u8_to_u32(exefsHdr->fileHdr[i].offset,LE) + 0x200;
-				u32 size = u8_to_u32(exefsHdr->fileHdr[i].size,LE);
+	if(streaming)
+		return WriteNCCHSectionsToFile(ncchset);
 
-				if(size)
-					CryptNCCHSection((exefs+offset),align(size,ncchset->options.mediaSize),offset,&ncchset->cryptoDetails,key,ncch_exefs);
+	return 0;
+}
 
-			}
-			// Crypting ExeFs Header
-			CryptNCCHSection(exefs,0x200,0x0,&ncchset->cryptoDetails,key0,ncch_exefs);
-		}
+int WriteNCCHSectionsToFile(ncch_settings *ncchset)
+{
+	FILE *fp = ncchset->outFile.fp;
 
-		// Crypting RomFs
-		if(ncchset->cryptoDetails.romfsSize)
-			CryptNCCHSection(romfs,ncchset->cryptoDetails.romfsSize,0x0,&ncchset->cryptoDetails,key1,ncch_romfs);
+	if(ncchset->cryptoDetails.exhdrSize)
+		WriteBuffer(ncchset->sections.exhdr.buffer,ncchset->sections.exhdr.size,ncchset->cryptoDetails.exhdrOffset,fp);
+	if(ncchset->cryptoDetails.logoSize)
+		WriteBuffer(ncchset->sections.logo.buffer,ncchset->sections.logo.size,ncchset->cryptoDetails.logoOffset,fp);
+	if(ncchset->cryptoDetails.plainRegionSize)
+		WriteBuffer(ncchset->sections.plainRegion.buffer,ncchset->sections.plainRegion.size,ncchset->cryptoDetails.plainRegionOffset,fp);
+	if(ncchset->cryptoDetails.exefsSize)
+		WriteBuffer(ncchset->sections.exeFs.buffer,ncchset->sections.exeFs.size,ncchset->cryptoDetails.exefsOffset,fp);
+
+	// Sig+Hdr last, so an interrupted build never looks like a valid NCCH
+	WriteBuffer(ncchset->outFile.header,0x200,0,fp);
+
+	if(fflush(fp) != 0 || ferror(fp)){
+		fprintf(stderr,"[NCCH ERROR] Failed to write NCCH to outfile\n");
+		return FAILED_TO_CREATE_OUTFILE;
 	}
 
 	return 0;
 }
 
+int HashNCCHSectionInFile(FILE *fp, u64 offset, u64 srcSize, u64 size, ncch_struct *ctx, u8 key[16], u8 hash[32])
+{
+	// If key is set, the section is already crypted in fp
+	u8 *buffer = calloc(1,size); // The hashed region may run past the end of an imported RomFs binary
+	if(!buffer){
+		fprintf(stderr,"[NCCH ERROR] Not enough memory\n");
+		return MEM_ERROR;
+	}
+	if(ReadFile_64(buffer,min_u64(srcSize,size),offset,fp)){
+		fprintf(stderr,"[NCCH ERROR] Failed to read RomFS data\n");
+		free(buffer);
+		return FAILED_TO_IMPORT_FILE;
+	}
+	if(key)
+		CryptNCCHSection(buffer,size,0,ctx,key,ncch_romfs);
+	ctr_sha(buffer,size,hash,CTR_SHA_256);
+	free(buffer);
+	return 0;
+}
+
+int CryptNCCHSectionToFile(FILE *src, u64 srcOffset, u64 srcSize, FILE *fp, u64 offset, u64 size, ncch_struct *ctx, u8 key[16], u8 type)
+{
+	u8 *buffer = malloc(NCCH_STREAM_BUFFER_SIZE);
+	if(!buffer){
+		fprintf(stderr,"[NCCH ERROR] Not enough memory\n");
+		return MEM_ERROR;
+	}
+
+	for(u64 pos = 0; pos < size; pos += NCCH_STREAM_BUFFER_SIZE){
+		u64 len = min_u64(size-pos,NCCH_STREAM_BUFFER_SIZE);
+		u64 srcLen = pos < srcSize ? min_u64(srcSize-pos,len) : 0;
+		if(ReadFile_64(buffer,srcLen,srcOffset+pos,src)){
+			fprintf(stderr,"[NCCH ERROR] Failed to read RomFS data\n");
+			free(buffer);
+			return FAILED_TO_IMPORT_FILE;
+		}
+		memset(buffer+srcLen,0,len-srcLen); // Media unit padding past the end of src
+		CryptNCCHSectionParallel(buffer,len,pos,ctx,key,type);
+		if(WriteBuffer(buffer,len,offset+pos,fp)){
+			fprintf(stderr,"[NCCH ERROR] Failed to write NCCH to outfile\n");
+			free(buffer);
+			return FAILED_TO_CREATE_OUTFILE;
+		}
+	}
+
+	free(buffer);
+	return 0;
+}
+
+void CryptNCCHJob(void *arg)
+{
+	ncch_cryptjob *job = (ncch_cryptjob*)arg;
+	CryptNCCHSection(job->buffer,job->size,job->src_pos,job->ctx,job->key,job->type);
+}
+
+void CryptNCCHSectionParallel(u8 *buffer, u64 size, u64 src_pos, ncch_struct *ctx, u8 key[16], u8 type)
+{
+	// CTR blocks are independent, so split the section into 0x10 aligned slices, each seeking its own counter
+	u64 threadNum = thread_cpu_count();
+	if(threadNum > size / NCCH_CRYPT_THREAD_MIN_SIZE)
+		threadNum = size / NCCH_CRYPT_THREAD_MIN_SIZE;
+
+	thread_context *threads = NULL;
+	ncch_cryptjob *jobs = NULL;
+	if(threadNum > 1){
+		threads = calloc(threadNum,sizeof(thread_context));
+		jobs = calloc(threadNum,sizeof(ncch_cryptjob));
+	}
+	if(!threads || !jobs){
+		free(threads);
+		free(jobs);
+		CryptNCCHSection(buffer,size,src_pos,ctx,key,type);
+		return;
+	}
+
+	u64 sliceSize = align(size / threadNum,0x10);
+	for(u64 i = 0; i < threadNum; i++){
+		u64 pos = min_u64(sliceSize * i,size);
+		jobs[i].buffer = buffer + pos;
+		jobs[i].size = min_u64(sliceSize,size - pos);
+		jobs[i].src_pos = src_pos + pos;
+		jobs[i].ctx = ctx;
+		jobs[i].key = key;
+		jobs[i].type = type;
+	}
+	jobs[threadNum-1].size = size - min_u64(sliceSize * (threadNum-1),size);
+
+	// The calling thread takes the first slice
+	for(u64 i = 1; i < threadNum; i++)
+		thread_start(&threads[i],CryptNCCHJob,&jobs[i]);
+	CryptNCCHJob(&jobs[0]);
+	for(u64 i = 1; i < threadNum; i++)
+		thread_join(&threads[i]);
+
+	free(threads);
+	free(jobs);
+}
+
+void CryptNCCHExeFsJob(void *arg)
+{
+	ncch_exefs_cryptjob *job = (ncch_exefs_cryptjob*)arg;
+	ncch_settings *ncchset = job->ncchset;
+
+	// Crypting Exheader
+	if(ncchset->cryptoDetails.exhdrSize)
+		CryptNCCHSection(job->exhdr,ncchset->cryptoDetails.exhdrSize,0x0,&ncchset->cryptoDetails,job->key0,ncch_exhdr);
+
+	// Crypting ExeFs Files
+	if(ncchset->cryptoDetails.exefsSize){
+		exefs_hdr *exefsHdr = (exefs_hdr*)job->exefs;
+		for(int i = 0; i < MAX_EXEFS_SECTIONS; i++){
+			u8 *key = NULL;
+			if(strncmp(exefsHdr->fileHdr[i].name,"icon",8) == 0 || strncmp(exefsHdr->fileHdr[i].name,"banner",8) == 0)
+				key = job->key0;
+			else
+				key = job->key1;
+
+			u32 offset = u8_to_u32(exefsHdr->fileHdr[i].offset,LE) + 0x200;
+			u32 size = u8_to_u32(exefsHdr->fileHdr[i].size,LE);
+
+			if(size)
+				CryptNCCHSection((job->exefs+offset),align(size,ncchset->options.mediaSize),offset,&ncchset->cryptoDetails,key,ncch_exefs);
+
+		}
+		// Crypting ExeFs Header
+		CryptNCCHSection(job->exefs,0x200,0x0,&ncchset->cryptoDetails,job->key0,ncch_exefs);
+	}
+}
+
 int SetCommonHeaderBasicData(ncch_settings *ncchset, ncch_hdr *hdr)
 {
 	/* NCCH Magic */
@@ -868,17 +1245,39 @@ u8* RetargetNCCH(FILE *fp, u64 size, u8 *TitleId, u8 *ProgramId, keys_struct *ke
 
 int ModifyNcchIds(u8 *ncch, u8 *titleId, u8 *programId, keys_struct *keys)
 {
-	if(!IsNCCH(NULL,ncch)){
-		//free(ncch);
+	ncch_retarget_ctx ctx;
+	if(PrepareNcchRetarget(&ctx,ncch,titleId,programId,keys) != 0)
 		return -1;
-	}
-		
-	ncch_hdr *hdr = NULL;
-	hdr = GetNCCH_CommonHDR(NULL,NULL,ncch);
+
+	u64 size = 0x200;
+	if(ctx.decrypt || ctx.encrypt)
+		size = max_u64(size,ctx.newCtx.romfsOffset + ctx.newCtx.romfsSize);
+	RetargetNcchData(&ctx,ncch,0,size);
+
+	return 0;
+}
+
+int PrepareNcchRetarget(ncch_retarget_ctx *ctx, u8 *ncch, u8 *titleId, u8 *programId, keys_struct *keys)
+{
+	if(BeginNcchRetarget(ctx,ncch,titleId,programId,keys) != 0)
+		return -1;
+	if(ctx->resign)
+		SignCFA(ctx->header,ctx->header+0x100,keys);
+	return FinishNcchRetarget(ctx,keys);
+}
+
+int BeginNcchRetarget(ncch_retarget_ctx *ctx, u8 *ncch, u8 *titleId, u8 *programId, keys_struct *keys)
+{
+	memset(ctx,0,sizeof(ncch_retarget_ctx));
+	if(!IsNCCH(NULL,ncch))
+		return -1;
+
+	// Only the header is needed, the RomFs is re-crypted later by RetargetNcchData()
+	memcpy(ctx->header,ncch,0x200);
+	ncch_hdr *hdr = GetNCCH_CommonHDR(NULL,NULL,ctx->header);
 	
 	if(/*keys->rsa.requiresPresignedDesc && */!IsCfa(hdr)){
 		fprintf(stderr,"[NCCH ERROR] CXI's ID cannot be modified without the ability to resign the AccessDesc\n"); // Not yet yet, requires AccessDesc Privk, may implement anyway later
-		//free(ncch);
 		return -1;
 	}
 	
@@ -890,56 +1289,114 @@ int ModifyNcchIds(u8 *ncch, u8 *titleId, u8 *programId, keys_struct *keys)
 
 	if(titleIdMatches){ // If TitleID Same, no crypto required, just resign.
 		memcpy(hdr->programId,programId,8);
-		SignCFA(ncch,(u8*)hdr,keys);
+		ctx->resign = true;
 		return 0;
 	}
 
 	ncch_key_type keytype = GetNCCHKeyType(hdr);
-	ncch_struct ncch_struct;
 	u8 *key = NULL;
-	u8 *romfs = NULL;
 	
-	//Decrypting if necessary
+	// Decrypting if necessary
 	if(keytype != NoKey){
-		GetNCCHStruct(&ncch_struct,hdr);
-		romfs = (ncch+ncch_struct.romfsOffset);
-		SetNcchUnfixedKeys(keys, ncch); // For Secure Crypto
+		GetNCCHStruct(&ctx->oldCtx,hdr);
+		SetNcchUnfixedKeys(keys, ctx->header); // For Secure Crypto
 		key = GetNCCHKey(keytype,keys);
 		if(key == NULL){
 			fprintf(stderr,"[NCCH ERROR] Failed to load ncch aes key\n");
-			//free(ncch);
 			return -1;
 		}
-		CryptNCCHSection(romfs,ncch_struct.romfsSize,0,&ncch_struct,key,ncch_romfs);
+		memcpy(ctx->oldKey,key,16);
+		ctx->decrypt = true;
 	}
 	
-	// Editing data and resigning
+	// Editing data, it is resigned before FinishNcchRetarget()
 	if(titleId)
 		memcpy(hdr->titleId,titleId,8);
 	if(programId)
 		memcpy(hdr->programId,programId,8);
-	SignCFA(ncch,(u8*)hdr,keys);
+	ctx->resign = true;
+
+	return 0;
+}
+
+int SignNcchRetargets(ncch_retarget_ctx *ctx, u32 count, keys_struct *keys)
+{
+	// Headers are signed together, so the key is set up once and the signatures are spread over the CPUs
+	u8 **hash = calloc(count,sizeof(u8*));
+	u8 **signature = calloc(count,sizeof(u8*));
+	u8 *hashes = calloc(count,0x20);
+	if(!hash || !signature || !hashes){
+		free(hash);
+		free(signature);
+		free(hashes);
+		fprintf(stderr,"[NCCH ERROR] Not enough memory\n");
+		return MEM_ERROR;
+	}
 
-	//Checking New Key Type
-	keytype = GetNCCHKeyType(hdr);
+	u32 signNum = 0;
+	for(u32 i = 0; i < count; i++){
+		if(!ctx[i].resign)
+			continue;
+		hash[signNum] = hashes + signNum*0x20;
+		signature[signNum] = ctx[i].header;
+		ctr_sha(ctx[i].header+0x100,sizeof(ncch_hdr),hash[signNum],CTR_SHA_256);
+		signNum++;
+	}
+
+	int result = 0;
+	if(signNum)
+		result = ctr_rsa_sign_batch(keys->rsa.cciCfaCtx,hash,signature,signNum,RSA_2048_SHA256,thread_cpu_count());
+
+	free(hash);
+	free(signature);
+	free(hashes);
+	return result;
+}
+
+int FinishNcchRetarget(ncch_retarget_ctx *ctx, keys_struct *keys)
+{
+	// Only re-encrypted if it was decrypted, the signature is part of the secure crypto key
+	if(!ctx->decrypt)
+		return 0;
+
+	ncch_hdr *hdr = GetNCCH_CommonHDR(NULL,NULL,ctx->header);
+	ncch_key_type keytype = GetNCCHKeyType(hdr);
 	
 	// Re-encrypting if necessary
 	if(keytype != NoKey){
-		GetNCCHStruct(&ncch_struct,hdr);
-		romfs = (ncch+ncch_struct.romfsOffset);
-		SetNcchUnfixedKeys(keys, ncch); // For Secure Crypto
-		key = GetNCCHKey(keytype,keys);
+		GetNCCHStruct(&ctx->newCtx,hdr);
+		SetNcchUnfixedKeys(keys, ctx->header); // For Secure Crypto
+		u8 *key = GetNCCHKey(keytype,keys);
 		if(key == NULL){
 			fprintf(stderr,"[NCCH ERROR] Failed to load ncch aes key\n");
-			//free(ncch);
 			return -1;
 		}
-		CryptNCCHSection(romfs,ncch_struct.romfsSize,0,&ncch_struct,key,ncch_romfs);
+		memcpy(ctx->newKey,key,16);
+		ctx->encrypt = true;
 	}
 
 	return 0;
 }
 
+void CryptNCCHRomFsRange(u8 *data, u64 offset, u64 size, ncch_struct *ctx, u8 key[16])
+{
+	u64 start = max_u64(offset,ctx->romfsOffset);
+	u64 end = min_u64(offset+size,ctx->romfsOffset+ctx->romfsSize);
+	if(start < end)
+		CryptNCCHSection(data+(start-offset),end-start,start-ctx->romfsOffset,ctx,key,ncch_romfs);
+}
+
+void RetargetNcchData(ncch_retarget_ctx *ctx, u8 *data, u64 offset, u64 size)
+{
+	// 'data' holds bytes [offset,offset+size) of the original NCCH, offset must be 0x10 aligned
+	if(offset < 0x200)
+		memcpy(data,ctx->header+offset,min_u64(0x200-offset,size));
+	if(ctx->decrypt)
+		CryptNCCHRomFsRange(data,offset,size,&ctx->oldCtx,ctx->oldKey);
+	if(ctx->encrypt)
+		CryptNCCHRomFsRange(data,offset,size,&ctx->newCtx,ctx->newKey);
+}
+
 
 ncch_hdr* GetNCCH_CommonHDR(void *out, FILE *fp, u8 *buf)
 {
@@ -126,6 +126,17 @@ typedef struct
 	buffer_struct *out;
 	keys_struct *keys;
 	rsf_settings *rsfSet;
+
+	struct
+	{
+		FILE *fp; // If set, the NCCH is streamed here instead of being built in 'out'
+		char *path;
+		bool reused; // fp is the previous outfile, kept so its RomFs can be patched in place
+		u8 *header; // Sig+Hdr, written last
+		u64 size;
+		char *romfsCachePath; // Describes the RomFs in the previous outfile, so rebuilds only redo changed data
+		bool romfsPatched; // The RomFs was patched in place, so is already crypted
+	} outFile;
 	
 
 	struct
@@ -133,6 +144,7 @@ typedef struct
 		u32 mediaSize;
 		bool IncludeExeFsLogo;
 		bool CompressCode;
+		int CompressMode;
 		bool UseOnSD;
 		bool Encrypt;
 		bool FreeProductCode;
@@ -168,6 +180,15 @@ typedef struct
 		u64 plainregionSize;
 	} componentFilePtrs;
 
+	struct
+	{
+		mapped_file code;
+		mapped_file banner;
+		mapped_file icon;
+		mapped_file logo;
+		mapped_file plainregion;
+	} componentMaps; // Component files, section buffers may point straight into these
+
 	struct
 	{
 		buffer_struct code;
@@ -202,8 +223,23 @@ typedef struct
 
 } ncch_settings;
 
+typedef struct
+{
+	u8 header[0x200]; // Retargeted Sig+Hdr
+	bool resign; // Hdr was edited and must be signed before FinishNcchRetarget()
+	bool decrypt; // RomFs must be decrypted with the original key/counter
+	bool encrypt; // and then encrypted with the retargeted ones
+	ncch_struct oldCtx;
+	ncch_struct newCtx;
+	u8 oldKey[16];
+	u8 newKey[16];
+} ncch_retarget_ctx;
+
 // NCCH Build Functions
 int build_NCCH(user_settings *usrset);
+int ResetNcchOutFile(ncch_settings *ncchset);
+int MapComponentSection(buffer_struct *section, mapped_file *map, FILE *fp, u64 size, u32 alignment);
+void FreeComponentSection(buffer_struct *section, mapped_file *map);
 
 
 // NCCH Read Functions
@@ -211,6 +247,11 @@ int VerifyNCCH(u8 *ncch, keys_struct *keys, bool CheckHash, bool SuppressOutput)
 
 u8* RetargetNCCH(FILE *fp, u64 size, u8 *TitleId, u8 *ProgramId, keys_struct *keys);
 int ModifyNcchIds(u8 *ncch, u8 *titleId, u8 *programId, keys_struct *keys);
+int PrepareNcchRetarget(ncch_retarget_ctx *ctx, u8 *ncch, u8 *titleId, u8 *programId, keys_struct *keys);
+int BeginNcchRetarget(ncch_retarget_ctx *ctx, u8 *ncch, u8 *titleId, u8 *programId, keys_struct *keys);
+int SignNcchRetargets(ncch_retarget_ctx *ctx, u32 count, keys_struct *keys);
+int FinishNcchRetarget(ncch_retarget_ctx *ctx, keys_struct *keys);
+void RetargetNcchData(ncch_retarget_ctx *ctx, u8 *data, u64 offset, u64 size);
 
 
 ncch_hdr* GetNCCH_CommonHDR(void *out, FILE *fp, u8 *buf);
@@ -225,4 +266,5 @@ u8* GetNCCHKey(ncch_key_type keytype, keys_struct *keys);
 
 int GetNCCHStruct(ncch_struct *ctx, ncch_hdr *header);
 void ncch_get_counter(ncch_struct *ctx, u8 counter[16], u8 type);
-void CryptNCCHSection(u8 *buffer, u64 size, u64 src_pos, ncch_struct *ctx, u8 key[16], u8 type);
\ No newline at end of file
+void CryptNCCHSection(u8 *buffer, u64 size, u64 src_pos, ncch_struct *ctx, u8 key[16], u8 type);
+void CryptNCCHSectionParallel(u8 *buffer, u64 size, u64 src_pos, ncch_struct *ctx, u8 key[16], u8 type);
\ No newline at end of file
@@ -0,0 +1,260 @@
+#include "lib.h"
+#include "dir.h"
+#include "ncch.h"
+#include "romfs.h"
+#include "ncch_cache.h"
+
+/* NCCHs are cached by a hash of everything that goes into them, so a rebuild with the same inputs just reuses the last result */
+
+const u32 NCCH_CACHE_VERSION = 1;
+const u32 NCCH_CACHE_BUFFER_SIZE = 0x400000;
+
+// Prototypes
+void HashCacheData(ctr_sha256_context *ctx, const void *data, u64 size);
+void HashCacheString(ctr_sha256_context *ctx, const char *str);
+int HashCacheFile(ctr_sha256_context *ctx, char *path, u8 *buffer);
+int HashCacheRomFsDir(ctr_sha256_context *ctx, fs_dir *fs, u8 *buffer);
+void HashCacheKeys(ctr_sha256_context *ctx, keys_struct *keys);
+
+// Code
+int GetNcchCachePath(char **path, user_settings *usrset, romfs_buildctx *romfs)
+{
+	int result = 0;
+	u8 *buffer = malloc(NCCH_CACHE_BUFFER_SIZE);
+	if(!buffer){
+		fprintf(stderr,"[NCCH ERROR] Not enough memory\n");
+		return MEM_ERROR;
+	}
+
+	ctr_sha256_context ctx;
+	ctr_sha_256_init(&ctx);
+
+	u8 version[12];
+	u32_to_u8(version,NCCH_CACHE_VERSION,LE);
+	u32_to_u8(version+4,MAKEROM_VER_MAJOR,LE);
+	u32_to_u8(version+8,MAKEROM_VER_MINOR,LE);
+	HashCacheData(&ctx,version,sizeof(version));
+
+	// Flags, the outfile format is left out as it does not change the NCCH itself
+	u8 flags[2] = {usrset->ncch.ncchType, usrset->ncch.includeExefsLogo};
+	HashCacheData(&ctx,flags,sizeof(flags));
+
+	// RSF settings, values substituted into it and the keys
+	result = HashCacheFile(&ctx,usrset->common.rsfPath,buffer);
+	if(result) goto finish;
+	for(u32 i = 0; i < usrset->dname.u_items; i++){
+		HashCacheString(&ctx,usrset->dname.items[i].name);
+		HashCacheString(&ctx,usrset->dname.items[i].value);
+	}
+	HashCacheKeys(&ctx,&usrset->common.keys);
+
+	// Component files
+	char *components[] = {usrset->ncch.elfPath, usrset->ncch.iconPath, usrset->ncch.bannerPath, usrset->ncch.logoPath, usrset->ncch.codePath, usrset->ncch.exheaderPath, usrset->ncch.plainRegionPath, usrset->ncch.romfsPath};
+	for(u32 i = 0; i < sizeof(components)/sizeof(char*); i++){
+		result = HashCacheFile(&ctx,components[i],buffer);
+		if(result) goto finish;
+	}
+
+	// The RomFs tree, in the order it is built
+	if(romfs->fs && !romfs->ImportRomfsBinary){
+		result = HashCacheRomFsDir(&ctx,romfs->fs,buffer);
+		if(result) goto finish;
+	}
+
+	u8 hash[0x20];
+	ctr_sha_256_finish(&ctx,hash);
+
+	char *dir = usrset->ncch.cacheDir;
+	*path = calloc(strlen(dir) + 1 + 0x40 + strlen(".ncch") + 1,1);
+	if(!*path){
+		fprintf(stderr,"[NCCH ERROR] Not enough memory\n");
+		result = MEM_ERROR;
+		goto finish;
+	}
+	sprintf(*path,"%s/",dir);
+	for(int i = 0; i < 0x20; i++)
+		sprintf(*path + strlen(*path),"%02x",hash[i]);
+	strcat(*path,".ncch");
+
+finish:
+	free(buffer);
+	return result;
+}
+
+int LoadCachedNcch(ncch_settings *ncchset, char *path)
+{
+	FILE *fp = fopen(path,"rb");
+	if(!fp)
+		return -1;
+
+	// Only a complete NCCH is accepted
+	u64 size = GetFileSize_u64(path);
+	ncch_hdr hdr;
+	if(size < 0x200 || !GetNCCH_CommonHDR(&hdr,fp,NULL) || memcmp(hdr.magic,"NCCH",4) != 0 || (u64)GetNCCH_MediaSize(&hdr) * GetNCCH_MediaUnitSize(&hdr) != size){
+		fclose(fp);
+		return -1;
+	}
+
+	int result = 0;
+	if(ncchset->outFile.fp){
+		result = ResetNcchOutFile(ncchset);
+		if(!result)
+			result = CopyFileData(fp,0,ncchset->outFile.fp,0,size);
+	}
+	else{
+		ncchset->out->buffer = malloc(size);
+		if(!ncchset->out->buffer)
+			result = MEM_ERROR;
+		else{
+			ReadFile_64(ncchset->out->buffer,size,0,fp);
+			ncchset->out->size = size;
+		}
+	}
+	fclose(fp);
+
+	return result;
+}
+
+void SaveCachedNcch(ncch_settings *ncchset, char *path)
+{
+	// Written under a temporary name, so an interrupted write is never mistaken for a cached NCCH
+	char *tmpPath = calloc(strlen(path) + strlen(".tmp") + 1,1);
+	if(!tmpPath)
+		return;
+	sprintf(tmpPath,"%s.tmp",path);
+
+	FILE *fp = fopen(tmpPath,"wb");
+	if(!fp){
+		fprintf(stderr,"[NCCH WARNING] Failed to create NCCH cache '%s'\n",tmpPath);
+		free(tmpPath);
+		return;
+	}
+
+	int result = 0;
+	if(ncchset->outFile.fp){
+		fflush(ncchset->outFile.fp);
+		result = CopyFileData(ncchset->outFile.fp,0,fp,0,ncchset->outFile.size);
+	}
+	else
+		WriteBuffer(ncchset->out->buffer,ncchset->out->size,0,fp);
+	if(fclose(fp) != 0)
+		result = -1;
+
+	remove(path);
+	if(result || rename(tmpPath,path) != 0){
+		fprintf(stderr,"[NCCH WARNING] Failed to write NCCH cache '%s'\n",path);
+		remove(tmpPath);
+	}
+	free(tmpPath);
+}
+
+void HashCacheData(ctr_sha256_context *ctx, const void *data, u64 size)
+{
+	// Length prefixed, so neighbouring values can't run into each other
+	u8 len[8];
+	u64_to_u8(len,size,LE);
+	ctr_sha_256_update(ctx,len,sizeof(len));
+	if(size)
+		ctr_sha_256_update(ctx,data,size);
+}
+
+void HashCacheString(ctr_sha256_context *ctx, const char *str)
+{
+	HashCacheData(ctx,str,str ? strlen(str) + 1 : 0);
+}
+
+int HashCacheFile(ctr_sha256_context *ctx, char *path, u8 *buffer)
+{
+	if(!path){
+		HashCacheData(ctx,NULL,0);
+		return 0;
+	}
+
+	FILE *fp = fopen(path,"rb");
+	if(!fp){
+		fprintf(stderr,"[NCCH ERROR] Failed to open '%s'\n",path);
+		return FAILED_TO_OPEN_FILE;
+	}
+
+	u64 size = GetFileSize_u64(path);
+	u8 len[8];
+	u64_to_u8(len,size + 1,LE);
+	ctr_sha_256_update(ctx,len,sizeof(len));
+	for(u64 pos = 0; pos < size; ){
+		u32 chunk = min_u64(size - pos,NCCH_CACHE_BUFFER_SIZE);
+		if(fread(buffer,chunk,1,fp) != 1){
+			fprintf(stderr,"[NCCH ERROR] Failed to read '%s'\n",path);
+			fclose(fp);
+			return FAILED_TO_OPEN_FILE;
+		}
+		ctr_sha_256_update(ctx,buffer,chunk);
+		pos += chunk;
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+int HashCacheRomFsDir(ctr_sha256_context *ctx, fs_dir *fs, u8 *buffer)
+{
+	HashCacheData(ctx,fs->name,fs->name_len);
+
+	u8 count[8];
+	u32_to_u8(count,fs->u_file,LE);
+	u32_to_u8(count+4,fs->u_dir,LE);
+	HashCacheData(ctx,count,sizeof(count));
+
+	for(u32 i = 0; i < fs->u_file; i++){
+		fs_file *file = &fs->file[i];
+		HashCacheData(ctx,file->name,file->name_len);
+
+		u8 size[8];
+		u64_to_u8(size,file->size,LE);
+		ctr_sha_256_update(ctx,size,sizeof(size));
+
+		FILE *fp = fs_OpenFile(file);
+		if(!fp){
+			fprintf(stderr,"[NCCH ERROR] Failed to open RomFS file\n");
+			return FAILED_TO_IMPORT_FILE;
+		}
+		for(u64 pos = 0; pos < file->size; ){
+			u32 chunk = min_u64(file->size - pos,NCCH_CACHE_BUFFER_SIZE);
+			if(fread(buffer,chunk,1,fp) != 1){
+				fprintf(stderr,"[NCCH ERROR] Failed to read RomFS file data\n");
+				fclose(fp);
+				return FAILED_TO_IMPORT_FILE;
+			}
+			ctr_sha_256_update(ctx,buffer,chunk);
+			pos += chunk;
+		}
+		fclose(fp);
+	}
+
+	fs_dir *dir = (fs_dir*)fs->dir;
+	for(u32 i = 0; i < fs->u_dir; i++){
+		int result = HashCacheRomFsDir(ctx,&dir[i],buffer);
+		if(result) return result;
+	}
+
+	return 0;
+}
+
+void HashCacheKeys(ctr_sha256_context *ctx, keys_struct *keys)
+{
+	u8 settings[12];
+	u32_to_u8(settings,keys->keyset,LE);
+	u32_to_u8(settings+4,keys->accessDescSign.presetType,LE);
+	u32_to_u8(settings+8,keys->accessDescSign.targetFirmware,LE);
+	HashCacheData(ctx,settings,sizeof(settings));
+
+	// The unfixed AES keys and the CXI header keypair are only derived during the build
+	u8 *aesKeys[] = {keys->aes.normalKey, keys->aes.systemFixedKey, keys->aes.ncchKeyX0, keys->aes.ncchKeyX1};
+	for(u32 i = 0; i < sizeof(aesKeys)/sizeof(u8*); i++)
+		HashCacheData(ctx,aesKeys[i],aesKeys[i] ? 16 : 0);
+
+	u8 rsaFlags[2] = {keys->rsa.isFalseSign, keys->rsa.requiresPresignedDesc};
+	HashCacheData(ctx,rsaFlags,sizeof(rsaFlags));
+	u8 *rsaKeys[] = {keys->rsa.cciCfaPvt, keys->rsa.cciCfaPub, keys->rsa.acexPvt, keys->rsa.acexPub};
+	for(u32 i = 0; i < sizeof(rsaKeys)/sizeof(u8*); i++)
+		HashCacheData(ctx,rsaKeys[i],rsaKeys[i] ? RSA_2048_KEY_SIZE : 0);
+}
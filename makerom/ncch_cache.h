@@ -0,0 +1,5 @@
+#pragma once
+
+int GetNcchCachePath(char **path, user_settings *usrset, romfs_buildctx *romfs);
+int LoadCachedNcch(ncch_settings *ncchset, char *path);
+void SaveCachedNcch(ncch_settings *ncchset, char *path);
@@ -1,3 +1,8 @@
+#ifdef __linux__
+	#define _POSIX_C_SOURCE 200112L // posix_fallocate()
+	#include <fcntl.h>
+	#define HAVE_POSIX_FALLOCATE
+#endif
 #include "lib.h"
 #include "ncch.h"
 #include "exheader.h"
@@ -21,7 +26,9 @@ int BuildCCIHeader(cci_settings *cciset, user_settings *usrset);
 int BuildCardInfoHeader(cci_settings *cciset, user_settings *usrset);
 int WriteHeaderToFile(cci_settings *cciset);
 int WriteContentToFile(cci_settings *cciset,user_settings *usrset);
+int WriteNcchPartition(cci_settings *cciset, int i);
 int WriteDummyBytes(cci_settings *cciset);
+int WritePaddingBytes(FILE *fp, u64 offset, u64 len);
 
 /* Get Data from Content Files */
 int CheckContent0(cci_settings *cciset, user_settings *usrset);
@@ -41,6 +48,7 @@ int CheckMediaSize(cci_settings *cciset);
 
 static InternalCCI_Context ctx;
 const int NCCH0_OFFSET = 0x4000;
+const u32 CCI_PADDING_CHUNK_SIZE = 0x100000;
 
 // Code
 int build_CCI(user_settings *usrset)
@@ -82,9 +90,12 @@ int build_CCI(user_settings *usrset)
 	if(result) 
 		goto finish;
 	
-	// Fill out file if necessary 
-	if(cciset->option.fillOutCci) 
-		WriteDummyBytes(cciset);
+	// Fill out file if necessary, otherwise the padding is only recorded in the header's media size
+	if(cciset->option.fillOutCci){
+		result = WriteDummyBytes(cciset);
+		if(result)
+			goto finish;
+	}
 	
 	// Close output file
 finish:
@@ -96,7 +107,7 @@ finish:
 
 int SignCCI(u8 *Signature, u8 *NCSD_HDR, keys_struct *keys)
 {
-	return ctr_sig(NCSD_HDR,sizeof(cci_hdr),Signature,keys->rsa.cciCfaPub,keys->rsa.cciCfaPvt,RSA_2048_SHA256,CTR_RSA_SIGN);
+	return ctr_sig_sign(keys->rsa.cciCfaCtx,NCSD_HDR,sizeof(cci_hdr),Signature,RSA_2048_SHA256);
 }
 
 int CheckCCISignature(u8 *Signature, u8 *NCSD_HDR, keys_struct *keys)
@@ -153,7 +164,7 @@ int get_CCISettings(cci_settings *cciset, user_settings *usrset)
 void free_CCISettings(cci_settings *set)
 {
 	if(set->content.filePtrs){
-		for(int i = 1; i < 8; i++) {
+		for(int i = 0; i < 8; i++) {
 			if(set->content.filePtrs[i]) fclose(set->content.filePtrs[i]);
 		}
 		free(set->content.filePtrs);
@@ -202,21 +213,22 @@ int BuildCardInfoHeader(cci_settings *cciset, user_settings *usrset)
 
 int ImportNcchPartitions(cci_settings *cciset)
 {
-	cciset->content.data->buffer = realloc(cciset->content.data->buffer,cciset->content.data->size);
-	if(!cciset->content.data->buffer){
-		fprintf(stderr,"[CCI ERROR] Not enough memory\n");
-		return MEM_ERROR;
-	}
-
+	// Partitions are copied from their files when the CCI is written, so only their retargeted headers are prepared here
 	ncch_hdr *ncch0hdr = (ncch_hdr*)(cciset->content.data->buffer+0x100);
+	u8 ncchHdr[0x200];
 	for(int i = 1; i < CCI_MAX_CONTENT; i++){
 		if(!cciset->content.size[i])
 			continue;
 
-		u8 *ncchpos = (u8*)(cciset->content.data->buffer+cciset->content.offset[i]-cciset->content.offset[0]);
+		ReadFile_64(ncchHdr, 0x200, 0, cciset->content.filePtrs[i]);
+		if(BeginNcchRetarget(&cciset->content.retarget[i], ncchHdr, cciset->content.titleId[i], ncch0hdr->programId, cciset->keys) != 0)
+			return -1;
+	}
 
-		ReadFile_64(ncchpos, cciset->content.fileSize[i], 0, cciset->content.filePtrs[i]);
-		if(ModifyNcchIds(ncchpos, cciset->content.titleId[i], ncch0hdr->programId, cciset->keys) != 0)
+	if(SignNcchRetargets(&cciset->content.retarget[1], CCI_MAX_CONTENT - 1, cciset->keys) != 0)
+		return -1;
+	for(int i = 1; i < CCI_MAX_CONTENT; i++){
+		if(cciset->content.size[i] && FinishNcchRetarget(&cciset->content.retarget[i], cciset->keys) != 0)
 			return -1;
 	}
 	return 0;
@@ -227,13 +239,8 @@ int WriteHeaderToFile(cci_settings *cciset)
 	WriteBuffer(ctx.signature,0x100,0,cciset->out);
 	WriteBuffer((u8*)&ctx.cciHdr,sizeof(cci_hdr),0x100,cciset->out);
 	WriteBuffer((u8*)&ctx.cardinfo,sizeof(cardinfo_hdr),0x200,cciset->out);
-	if(!cciset->option.useDevCardInfo){
-		// Creating Buffer of Dummy Bytes
-		u64 len = NCCH0_OFFSET - 0x1200;
-		u8 *dummy_bytes = malloc(len);
-		memset(dummy_bytes,0xff,len);
-		WriteBuffer(dummy_bytes,len,0x1200,cciset->out);
-	}
+	if(!cciset->option.useDevCardInfo)
+		return WritePaddingBytes(cciset->out,0x1200,NCCH0_OFFSET - 0x1200);
 	else
 		WriteBuffer((u8*)&ctx.devcardinfo,sizeof(devcardinfo_hdr),0x1200,cciset->out);
 	return 0;
@@ -241,30 +248,95 @@ int WriteHeaderToFile(cci_settings *cciset)
 
 int WriteContentToFile(cci_settings *cciset,user_settings *usrset)
 {
+	int result = 0;
+
 	// Write Content 0
-	WriteBuffer(cciset->content.data->buffer,cciset->content.data->size,NCCH0_OFFSET,cciset->out);
+	if(cciset->content.filePtrs[0])
+		result = CopyFileData(cciset->content.filePtrs[0],0,cciset->out,NCCH0_OFFSET,cciset->content.size[0]);
+	else
+		WriteBuffer(cciset->content.data->buffer,cciset->content.size[0],NCCH0_OFFSET,cciset->out);
 	free(cciset->content.data->buffer);
 	cciset->content.data->buffer = NULL;
 	cciset->content.data->size = 0;
+
+	// Write other partitions
+	for(int i = 1; i < CCI_MAX_CONTENT && !result; i++){
+		if(cciset->content.size[i])
+			result = WriteNcchPartition(cciset,i);
+	}
+
+	if(result == MEM_ERROR)
+		fprintf(stderr,"[CCI ERROR] Not enough memory\n");
+	else if(result || ferror(cciset->out)){
+		fprintf(stderr,"[CCI ERROR] Failed to write content to outfile\n");
+		result = -1;
+	}
+	return result;
+}
+
+int WriteNcchPartition(cci_settings *cciset, int i)
+{
+	ncch_retarget_ctx *retarget = &cciset->content.retarget[i];
+	FILE *fp = cciset->content.filePtrs[i];
+	u64 offset = cciset->content.offset[i];
+	u64 size = cciset->content.fileSize[i];
+
+	// Only the header changes, so the rest of the partition is copied as is
+	if(!retarget->decrypt && !retarget->encrypt){
+		WriteBuffer(retarget->header,0x200,offset,cciset->out);
+		return CopyFileData(fp,0x200,cciset->out,offset+0x200,size-0x200);
+	}
+
+	// The RomFs is re-crypted, a chunk at a time
+	u8 *buffer = malloc(CCI_PADDING_CHUNK_SIZE);
+	if(!buffer)
+		return MEM_ERROR;
+	for(u64 pos = 0; pos < size; pos += CCI_PADDING_CHUNK_SIZE){
+		u64 len = min_u64(size-pos,CCI_PADDING_CHUNK_SIZE);
+		ReadFile_64(buffer,len,pos,fp);
+		RetargetNcchData(retarget,buffer,pos,len);
+		WriteBuffer(buffer,len,offset+pos,cciset->out);
+	}
+	free(buffer);
 	return 0;
 }
 
 int WriteDummyBytes(cci_settings *cciset)
 {
-	// Seeking end of CCI Data
-	fseek_64(cciset->out,cciset->cardinfo.cciTotalSize);
-
-	// Determining Size of Dummy Bytes
+	// Padding runs from the end of CCI Data to the end of the media
+	u64 offset = cciset->cardinfo.cciTotalSize;
 	u64 len = cciset->header.mediaSize - cciset->cardinfo.cciTotalSize;
-	
+
+#ifdef HAVE_POSIX_FALLOCATE
+	// Reserve the padding in one go so it is allocated contiguously, ignored where the filesystem can't
+	fflush(cciset->out);
+	posix_fallocate(fileno(cciset->out),offset,len);
+#endif
+
+	return WritePaddingBytes(cciset->out,offset,len);
+}
+
+int WritePaddingBytes(FILE *fp, u64 offset, u64 len)
+{
 	// Creating Buffer of Dummy Bytes
-	u8 *dummy_bytes = malloc(cciset->option.mediaUnit);
-	memset(dummy_bytes,0xff,cciset->option.mediaUnit);
-	
+	u64 chunkSize = min_u64(len,CCI_PADDING_CHUNK_SIZE);
+	u8 *dummy_bytes = malloc(chunkSize);
+	if(!dummy_bytes){
+		fprintf(stderr,"[CCI ERROR] Not enough memory\n");
+		return MEM_ERROR;
+	}
+	memset(dummy_bytes,0xff,chunkSize);
+
 	// Writing Dummy Bytes to file
-	for(u64 i = 0; i < len; i += cciset->option.mediaUnit)
-		fwrite(dummy_bytes,cciset->option.mediaUnit,1,cciset->out);
-	
+	fseek_64(fp,offset);
+	for(u64 pos = 0; pos < len; pos += chunkSize)
+		fwrite(dummy_bytes,min_u64(len-pos,chunkSize),1,fp);
+	free(dummy_bytes);
+
+	if(ferror(fp)){
+		fprintf(stderr,"[CCI ERROR] Failed to write padding to outfile\n");
+		return -1;
+	}
 	return 0;
 }
 
@@ -276,6 +348,16 @@ int GetContentFP(cci_settings *cciset, user_settings *usrset)
 		return MEM_ERROR;
 	}
 	
+	// Prebuilt content 0 is copied from its file, only its header was imported
+	if(!usrset->ncch.buildNcch0){
+		cciset->content.fileSize[0] = GetFileSize_u64(usrset->common.contentPath[0]);
+		cciset->content.filePtrs[0] = fopen(usrset->common.contentPath[0],"rb");
+		if(!cciset->content.filePtrs[0]){
+			fprintf(stderr,"[CCI ERROR] Failed to open '%s'\n",usrset->common.contentPath[0]);
+			return FAILED_TO_OPEN_FILE;
+		}
+	}
+	
 	for(int i = 1; i < 8; i++){
 		if(usrset->common.contentPath[i]){
 			if(!AssertFile(usrset->common.contentPath[i])){ // Checking if file could be opened
@@ -133,8 +133,9 @@ typedef struct
 		buffer_struct *data;
 
 		/* Misc Records */
-		FILE **filePtrs;
+		FILE **filePtrs; // Partitions copied from files, including content 0 when it wasn't built
 		u64 fileSize[CCI_MAX_CONTENT];
+		ncch_retarget_ctx retarget[CCI_MAX_CONTENT];
 		u16 count;
 
 		/* Details for NCSD header */
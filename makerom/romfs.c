@@ -5,8 +5,6 @@
 #include "romfs_binary.h"
 #include "romfs_import.h"
 
-void FreeRomFsCtx(romfs_buildctx *ctx);
-
 // RomFs Build Functions
 int SetupRomFs(ncch_settings *ncchset, romfs_buildctx *ctx)
 {
@@ -45,8 +43,6 @@ int BuildRomFs(romfs_buildctx *ctx)
 
 void FreeRomFsCtx(romfs_buildctx *ctx)
 {
-	if(ctx->romfsBinary)
-		fclose(ctx->romfsBinary);
 	if(ctx->fs){
 		fs_FreeFiles(ctx->fs);
 		fs_FreeDir(ctx->fs);	
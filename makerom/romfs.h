@@ -76,6 +76,14 @@ typedef struct
 	u64 romfsSize;
 	u64 romfsHeaderSize;
 
+	/* Set instead of output, when the NCCH is streamed to file */
+	FILE *outFile;
+	u64 outOffset;
+	char *cachePath; // If set, the RomFs already in outFile is patched in place, for files changed since this cache was saved
+	ncch_struct *ncchCtx; // RomFs counter and key, the patched blocks are crypted as they are written
+	u8 *ncchKey; // NULL if the NCCH isn't crypted
+	bool patched; // The RomFs in outFile was patched in place, so is already crypted
+
 	/* For Importing ROMFS Binaries */
 	bool ImportRomfsBinary;
 	FILE *romfsBinary;
@@ -124,4 +132,5 @@ typedef struct
 } romfs_buildctx;
 */
 int SetupRomFs(ncch_settings *ncchset, romfs_buildctx *ctx);
-int BuildRomFs(romfs_buildctx *ctx);
\ No newline at end of file
+int BuildRomFs(romfs_buildctx *ctx);
+void FreeRomFsCtx(romfs_buildctx *ctx);
\ No newline at end of file
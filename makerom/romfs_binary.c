@@ -5,20 +5,102 @@
 
 const int ROMFS_BLOCK_SIZE = 0x1000;
 const unsigned int ROMFS_UNUSED_ENTRY = 0xffffffff;
+const u32 ROMFS_STREAM_BUFFER_SIZE = 0x800000; // Must be a multiple of ROMFS_BLOCK_SIZE
+const u32 ROMFS_THREAD_MIN_BLOCKS = 0x100; // Fewest blocks worth handing to a hashing thread
+const u32 ROMFS_CACHE_VERSION = 2;
+const u64 ROMFS_CACHE_LEVEL_OFFSET = 0x100; // Hash levels 0-2, followed by the entry table
+const u64 ROMFS_CACHE_RACY_TIME = 2000000000; // Files modified this close (ns) to the cache being saved are always read
+
+// Level 3 is written through this, hashing each block into level 2 as it fills
+typedef struct
+{
+	FILE *out;
+	u64 outPos;
+	u8 *buffer;
+	u32 bufferLen;
+	u8 *hashPos;
+} romfs_streamctx;
+
+typedef struct
+{
+	u8 *data;
+	u8 *hashes;
+	u32 blockNum;
+} ivfc_hashjob;
+
+typedef struct
+{
+	u8 magic[4]; // Only set once the cache is consistent
+	u8 version[4];
+	u8 romfsSize[8];
+	u8 fileNum[4];
+	u8 reserved[4];
+	u8 entryTableSize[8];
+	u8 saveTime[8];
+	u8 metadataHash[0x20]; // Level 3 up to the file data, so every name, size and data offset
+} romfs_cachehdr;
+
+// One per file, in the order StreamRomfsFileData() writes them
+typedef struct
+{
+	u64 modTime;
+	u64 dataOffset; // In level 3, the hashes of its blocks are in level 2
+	u64 size;
+	u32 pathLen;
+	fs_char *path;
+} romfs_cacheentry;
+
+typedef struct
+{
+	FILE *fp;
+	romfs_cacheentry *entry;
+	u32 entryNum;
+	u8 *entryTable; // Loaded entry paths point into this
+	u64 saveTime;
+	u8 *dirty[3]; // Per block of levels 1 and 2, set when a block has changed
+	u8 *buffer;
+	u8 *hashes;
+} romfs_cachectx;
 
 // Build
 bool IsFileWanted(fs_file *file, void *filter_criteria);
 bool IsDirWanted(fs_dir *dir, void *filter_criteria);
 void CalcDirSize(romfs_buildctx *ctx, fs_dir *fs);
 int CalcRomfsSize(romfs_buildctx *ctx);
+u32 GetHashTableCount(u32 entryNum);
+u32 CalcPathHash(u32 parent, u16 *name, u32 name_len);
 int AddFileToRomfs(romfs_buildctx *ctx, fs_file *file, u32 parent, u32 sibling);
 int AddDirToRomfs(romfs_buildctx *ctx, fs_dir *fs, u32 parent, u32 sibling);
 int FilterRomFS(fs_dir *fs_raw, fs_dir *fs_filtered, void *filter_criteria);
 int PopulateRomfs(romfs_buildctx *ctx);
 void BuildRomfsHeader(romfs_buildctx *ctx);
 void BuildIvfcHeader(romfs_buildctx *ctx);
+void HashIvfcBlockRange(void *arg);
+void HashIvfcBlocks(u8 *data, u8 *hashes, u32 blockNum);
+void GenIvfcLevelHashes(romfs_buildctx *ctx, int level);
 void GenIvfcHashTree(romfs_buildctx *ctx);
 
+// Streamed Build
+int StreamRomFsBinary(romfs_buildctx *ctx);
+void FlushRomfsStream(romfs_streamctx *stream, bool final);
+void WriteRomfsStream(romfs_streamctx *stream, const u8 *data, u64 size);
+void PadRomfsStream(romfs_streamctx *stream, u64 size);
+int StreamRomfsFileData(romfs_buildctx *ctx, romfs_streamctx *stream, fs_dir *fs);
+
+// Incremental Build
+void GetRomfsCacheEntries(romfs_buildctx *ctx, romfs_cachectx *cache, fs_dir *fs);
+int LoadRomfsCache(romfs_buildctx *ctx, romfs_cachectx *cache, u8 metadataHash[0x20]);
+int UpdateRomfsCache(romfs_buildctx *ctx, romfs_cachectx *cache, u8 metadataHash[0x20]);
+int UpdateRomfsCacheData(romfs_buildctx *ctx, romfs_cachectx *cache, fs_dir *fs);
+int UpdateRomfsCacheFile(romfs_buildctx *ctx, romfs_cachectx *cache, fs_file *file, u64 offset);
+int ReadRomfsOutFile(romfs_buildctx *ctx, u8 *data, u64 offset, u64 size);
+int WriteRomfsOutFile(romfs_buildctx *ctx, u8 *data, u64 offset, u64 size);
+int WriteRomfsOutFileBlocks(romfs_buildctx *ctx, romfs_cachectx *cache, int level);
+void RehashIvfcLevel(romfs_buildctx *ctx, romfs_cachectx *cache, int level);
+void SaveRomfsCache(romfs_buildctx *ctx, romfs_cachectx *cache, u8 metadataHash[0x20]);
+void WriteRomfsCache(romfs_buildctx *ctx, romfs_cachectx *cache, u8 metadataHash[0x20]);
+void FreeRomfsCache(romfs_cachectx *cache);
+
 
 int PrepareBuildRomFsBinary(ncch_settings *ncchset, romfs_buildctx *ctx)
 {
@@ -53,14 +135,25 @@ int PrepareBuildRomFsBinary(ncch_settings *ncchset, romfs_buildctx *ctx)
 
 	// Import FS and process
 	//printf("open fs into fs_raw\n");
-	fs_OpenDir(fs_path,path,path_len,fs_raw);
+	int result = fs_OpenDir(fs_path,path,path_len,fs_raw);
+	if(result){
+		fprintf(stderr,"[ROMFS ERROR] Failed to read all of RomFS directory '%s'\n",dir);
+		fs_FreeFiles(fs_raw);
+		fs_FreeDir(fs_raw);
+		free(fs_raw->name);
+		free(fs_raw);
+		free(path);
+		chdir(cwd);
+		free(cwd);
+		return FAILED_TO_IMPORT_FILE;
+	}
 	//printf("filter fs_raw into ctx->fs\n");
 	FilterRomFS(fs_raw,ctx->fs,filter_criteria);
 	
 	// free unfiltered FS
 	fs_PrintDir(fs_raw,0);
 	//printf("free discarded file ptrs\n");
-	fs_FreeFiles(fs_raw); // All important FPs have been moved with FilterRomFS, so only un-wanted FPs are closed here
+	fs_FreeFiles(fs_raw); // All important file paths have been moved with FilterRomFS, so only un-wanted paths are freed here
 	//printf("free structs in fs_raw\n");
 	fs_FreeDir(fs_raw);
 	//printf("free fs_raw\n");
@@ -101,6 +194,10 @@ int BuildRomFsBinary(romfs_buildctx *ctx)
 			ctx->level[i].logicalOffset = align(ctx->level[i-1].logicalOffset + ctx->level[i-1].size,ROMFS_BLOCK_SIZE);
 	}
 	
+	// Streaming writes level 3 straight to the outfile, only metadata and the hash levels are kept in memory
+	if(ctx->outFile)
+		return StreamRomFsBinary(ctx);
+
 	// Setup IVFC Level Ptrs
 	for(int i = 0; i < 4; i++){
 		ctx->level[i].pos = (ctx->output + ctx->level[i].offset);
@@ -183,14 +280,10 @@ int CalcRomfsSize(romfs_buildctx *ctx)
 	
 	//printf("check U tables\n");
 	ctx->u_dirUTableEntry = 0;
-	ctx->m_dirUTableEntry = 3;
-	if(ctx->dirNum > 3)
-		ctx->m_dirUTableEntry += align(ctx->dirNum-3,2);
+	ctx->m_dirUTableEntry = GetHashTableCount(ctx->dirNum);
 		
 	ctx->u_fileUTableEntry = 0;
-	ctx->m_fileUTableEntry = 3;
-	if(ctx->fileNum > 3)
-		ctx->m_fileUTableEntry += align(ctx->fileNum-3,2);
+	ctx->m_fileUTableEntry = GetHashTableCount(ctx->fileNum);
 	
 	//printf("calc romfs header size\n");
 	u32 romfsHdrSize = align(sizeof(romfs_infoheader) + ctx->m_dirUTableEntry*sizeof(u32) + ctx->m_dirTableLen + ctx->m_fileUTableEntry*sizeof(u32) + ctx->m_fileTableLen,0x10); 
@@ -253,8 +346,8 @@ int FilterRomFS(fs_dir *fs_raw, fs_dir *fs_filtered, void *filter_criteria)
 			
 			fs_filtered->file[fs_filtered->u_file].size = fs_raw->file[i].size;
 			
-			fs_filtered->file[fs_filtered->u_file].fp = fs_raw->file[i].fp;
-			fs_raw->file[i].fp = NULL;
+			fs_filtered->file[fs_filtered->u_file].path = fs_raw->file[i].path;
+			fs_raw->file[i].path = NULL;
 			
 			fs_filtered->u_file++;
 		}
@@ -311,18 +404,43 @@ void BuildRomfsHeader(romfs_buildctx *ctx)
 	return;
 }
 
-u32 GetFileUTableIndex(romfs_buildctx *ctx, fs_file *file)
+u32 GetHashTableCount(u32 entryNum)
+{
+	// Bucket count used by the CTR RomFS driver: odd for small tables, otherwise free of small prime factors
+	u32 count = entryNum;
+	if(count < 3)
+		count = 3;
+	else if(count < 19)
+		count |= 1;
+	else{
+		while(count % 2 == 0 || count % 3 == 0 || count % 5 == 0 || count % 7 == 0 || count % 11 == 0 || count % 13 == 0 || count % 17 == 0)
+			count++;
+	}
+	return count;
+}
+
+u32 CalcPathHash(u32 parent, u16 *name, u32 name_len)
+{
+	u32 hash = parent ^ 123456789;
+	for(u32 i = 0; i < name_len/sizeof(u16); i++){
+		hash = (hash >> 5) | (hash << 27);
+		hash ^= name[i];
+	}
+	return hash;
+}
+
+u32 GetFileUTableIndex(romfs_buildctx *ctx, fs_file *file, u32 parent)
 {
-	u32 ret = ctx->u_fileUTableEntry;
 	ctx->u_fileUTableEntry++;
-	return ret;
+	return CalcPathHash(parent,file->name,file->name_len) % ctx->m_fileUTableEntry;
 }
 
-u32 GetDirUTableIndex(romfs_buildctx *ctx, fs_dir *dir)
+u32 GetDirUTableIndex(romfs_buildctx *ctx, fs_dir *dir, u32 parent)
 {
-	u32 ret = ctx->u_dirUTableEntry;
 	ctx->u_dirUTableEntry++;
-	return ret;
+	if(ctx->u_dirTableLen == 0) // Root dir is hashed with an empty name
+		return CalcPathHash(parent,NULL,0) % ctx->m_dirUTableEntry;
+	return CalcPathHash(parent,dir->name,dir->name_len) % ctx->m_dirUTableEntry;
 }
 
 int AddFileToRomfs(romfs_buildctx *ctx, fs_file *file, u32 parent, u32 sibling)
@@ -332,7 +450,7 @@ int AddFileToRomfs(romfs_buildctx *ctx, fs_file *file, u32 parent, u32 sibling)
 	u32_to_u8(entry->parentdiroffset,parent,LE);
 	u32_to_u8(entry->siblingoffset,sibling,LE);
 	
-	u32 uTableIndex = GetFileUTableIndex(ctx,file);
+	u32 uTableIndex = GetFileUTableIndex(ctx,file,parent);
 	u32_to_u8(entry->weirdoffset,ctx->fileUTable[uTableIndex],LE);
 	ctx->fileUTable[uTableIndex] = ctx->u_fileTableLen;
 	
@@ -342,14 +460,22 @@ int AddFileToRomfs(romfs_buildctx *ctx, fs_file *file, u32 parent, u32 sibling)
 	memset(name_pos,0,align(file->name_len,4));
 	memcpy(name_pos,(u8*)file->name,file->name_len);
 	
-	// Import Data
+	// Import Data, when streaming it is copied later by StreamRomfsFileData()
 	if(file->size)
 	{
 		ctx->u_dataLen = align(ctx->u_dataLen,0x10); // Padding
 		u64_to_u8(entry->dataoffset,ctx->u_dataLen,LE);
 		u64_to_u8(entry->datasize,file->size,LE);
-		u8 *data_pos = (ctx->data + ctx->u_dataLen);
-		ReadFile_64(data_pos,file->size,0,file->fp);
+		if(!ctx->outFile){
+			FILE *fp = fs_OpenFile(file);
+			if(!fp){
+				fprintf(stderr,"[ROMFS ERROR] Failed to open RomFS file\n");
+				return FAILED_TO_IMPORT_FILE;
+			}
+			u8 *data_pos = (ctx->data + ctx->u_dataLen);
+			ReadFile_64(data_pos,file->size,0,fp);
+			fclose(fp);
+		}
 		ctx->u_dataLen += file->size; // adding file size
 	}
 	else
@@ -368,7 +494,7 @@ int AddDirToRomfs(romfs_buildctx *ctx, fs_dir *fs, u32 parent, u32 sibling)
 	u32_to_u8(entry->parentoffset,parent,LE);
 	u32_to_u8(entry->siblingoffset,sibling,LE);
 	
-	u32 uTableIndex = GetDirUTableIndex(ctx,fs);
+	u32 uTableIndex = GetDirUTableIndex(ctx,fs,parent);
 	u32_to_u8(entry->weirdoffset,ctx->dirUTable[uTableIndex],LE);
 	ctx->dirUTable[uTableIndex] = ctx->u_dirTableLen;
 
@@ -399,7 +525,8 @@ int AddDirToRomfs(romfs_buildctx *ctx, fs_dir *fs, u32 parent, u32 sibling)
 			else
 				file_sibling = ctx->u_fileTableLen + sizeof(romfs_fileentry) + (u32)align(fs->file[i].name_len,4);
 			//wprintf(L"adding %s (0x%lx)\n",fs->file[i].name,fs->file[i].size);
-			AddFileToRomfs(ctx,&fs->file[i],Currentdir,file_sibling);
+			int result = AddFileToRomfs(ctx,&fs->file[i],Currentdir,file_sibling);
+			if(result) return result;
 			//wprintf(L"added %s (0x%lx)\n",fs->file[i].name,fs->file[i].size);
 		}
 	}
@@ -422,7 +549,8 @@ int AddDirToRomfs(romfs_buildctx *ctx, fs_dir *fs, u32 parent, u32 sibling)
 				//printf(" dir has sibling\n");
 				dir_sibling = ctx->u_dirTableLen + sizeof(romfs_direntry) + (u32)align(dir[i].name_len,4);
 			}
-			AddDirToRomfs(ctx,&dir[i],Currentdir,dir_sibling);
+			int result = AddDirToRomfs(ctx,&dir[i],Currentdir,dir_sibling);
+			if(result) return result;
 		}
 	}
 	else
@@ -457,18 +585,608 @@ void BuildIvfcHeader(romfs_buildctx *ctx)
 	return;
 }
 
+void HashIvfcBlockRange(void *arg)
+{
+	ivfc_hashjob *job = (ivfc_hashjob*)arg;
+	for(u32 j = 0; j < job->blockNum; j++)
+		ctr_sha(job->data + ROMFS_BLOCK_SIZE * j, ROMFS_BLOCK_SIZE, job->hashes + 0x20 * j, CTR_SHA_256);
+}
+
+void HashIvfcBlocks(u8 *data, u8 *hashes, u32 blockNum)
+{
+	// Blocks are independent, so split them into contiguous ranges, one per thread
+	u32 threadNum = thread_cpu_count();
+	if(threadNum > blockNum / ROMFS_THREAD_MIN_BLOCKS)
+		threadNum = blockNum / ROMFS_THREAD_MIN_BLOCKS;
+
+	thread_context *threads = NULL;
+	ivfc_hashjob *jobs = NULL;
+	if(threadNum > 1){
+		threads = calloc(threadNum,sizeof(thread_context));
+		jobs = calloc(threadNum,sizeof(ivfc_hashjob));
+	}
+	if(!threads || !jobs){
+		free(threads);
+		free(jobs);
+		ivfc_hashjob job = {data,hashes,blockNum};
+		HashIvfcBlockRange(&job);
+		return;
+	}
+
+	u32 pos = 0;
+	for(u32 i = 0; i < threadNum; i++){
+		jobs[i].blockNum = blockNum / threadNum + (i < blockNum % threadNum);
+		jobs[i].data = data + (u64)ROMFS_BLOCK_SIZE * pos;
+		jobs[i].hashes = hashes + 0x20 * (u64)pos;
+		pos += jobs[i].blockNum;
+	}
+
+	// The calling thread takes the first range
+	for(u32 i = 1; i < threadNum; i++)
+		thread_start(&threads[i],HashIvfcBlockRange,&jobs[i]);
+	HashIvfcBlockRange(&jobs[0]);
+	for(u32 i = 1; i < threadNum; i++)
+		thread_join(&threads[i]);
+
+	free(threads);
+	free(jobs);
+}
+
+void GenIvfcLevelHashes(romfs_buildctx *ctx, int level)
+{
+	u32 numHashes = align(ctx->level[level+1].size,ROMFS_BLOCK_SIZE) / ROMFS_BLOCK_SIZE;
+	HashIvfcBlocks(ctx->level[level+1].pos,ctx->level[level].pos,numHashes);
+}
+
 void GenIvfcHashTree(romfs_buildctx *ctx)
 {
+	// Each level hashes the one below it, so a level must be complete before the next starts
+	for(int i = 2; i >= 0; i--)
+		GenIvfcLevelHashes(ctx,i);
+	
+	return;
+}
+
+int StreamRomFsBinary(romfs_buildctx *ctx)
+{
+	int result = 0;
+	u64 metadataSize = ctx->level[3].size - ctx->m_dataLen;
+
+	// Levels 0-2 are padded to whole blocks, so they can be hashed in place
+	u8 *level[3] = {NULL,NULL,NULL};
+	for(int i = 0; i < 3; i++)
+		level[i] = calloc(1,align(ctx->level[i].size,ROMFS_BLOCK_SIZE));
+	u8 *metadata = calloc(1,metadataSize);
+	romfs_streamctx stream;
+	memset(&stream,0,sizeof(romfs_streamctx));
+	romfs_cachectx cache;
+	memset(&cache,0,sizeof(romfs_cachectx));
+	stream.buffer = malloc(ROMFS_STREAM_BUFFER_SIZE);
+	if(!level[0] || !level[1] || !level[2] || !metadata || !stream.buffer){
+		fprintf(stderr,"[ROMFS ERROR] Not enough memory\n");
+		result = MEM_ERROR;
+		goto finish;
+	}
+
+	ctx->level[0].pos = level[0] + align(sizeof(ivfc_hdr),0x10);
+	ctx->level[1].pos = level[1];
+	ctx->level[2].pos = level[2];
+	ctx->level[3].pos = metadata;
+
+	// Build Romfs metadata, file data offsets are assigned but no data is read
+	ctx->romfsHdr = (romfs_infoheader*)(ctx->level[3].pos);
+	BuildRomfsHeader(ctx);
+	if(PopulateRomfs(ctx) != 0){
+		result = -1;
+		goto finish;
+	}
+	ctx->ivfcHdr = (ivfc_hdr*)level[0];
+
+	// With an unchanged layout, only the blocks that changed are rewritten in the previous outfile's RomFs
+	u8 metadataHash[0x20];
+	if(ctx->cachePath){
+		ctr_sha(metadata,metadataSize,metadataHash,CTR_SHA_256);
+		if(LoadRomfsCache(ctx,&cache,metadataHash) == 0){
+			result = UpdateRomfsCache(ctx,&cache,metadataHash);
+			goto finish;
+		}
+		// The outfile is rewritten below, so the old cache no longer describes it
+		remove(ctx->cachePath);
+
+		// Files are stat'd before they are read, so edits made during the build aren't missed next time
+		cache.entry = calloc(ctx->fileNum ? ctx->fileNum : 1,sizeof(romfs_cacheentry));
+		ctx->u_dataLen = 0;
+		if(cache.entry)
+			GetRomfsCacheEntries(ctx,&cache,ctx->fs);
+	}
+
+	// Write level 3, hashing it into level 2 as it goes
+	stream.out = ctx->outFile;
+	stream.outPos = ctx->outOffset + ctx->level[3].offset;
+	stream.hashPos = ctx->level[2].pos;
+	WriteRomfsStream(&stream,metadata,metadataSize);
+	ctx->u_dataLen = 0;
+	result = StreamRomfsFileData(ctx,&stream,ctx->fs);
+	if(result) goto finish;
+	FlushRomfsStream(&stream,true);
+
+	// Finalise by hashing the remaining levels and writing them with the IVFC header
+	GenIvfcLevelHashes(ctx,1);
+	GenIvfcLevelHashes(ctx,0);
+	BuildIvfcHeader(ctx);
+
+	// Whole blocks, a reused outfile still has the previous RomFs in the padding
+	for(int i = 2; i >= 0; i--)
+		WriteBuffer(level[i],align(ctx->level[i].size,ROMFS_BLOCK_SIZE),ctx->outOffset + ctx->level[i].offset,ctx->outFile);
+
+	if(cache.entry)
+		SaveRomfsCache(ctx,&cache,metadataHash);
+
+finish:
+	FreeRomfsCache(&cache);
+	for(int i = 0; i < 4; i++)
+		ctx->level[i].pos = NULL;
+	ctx->ivfcHdr = NULL;
+	ctx->romfsHdr = NULL;
+	for(int i = 0; i < 3; i++)
+		free(level[i]);
+	free(metadata);
+	free(stream.buffer);
+	return result;
+}
+
+void FlushRomfsStream(romfs_streamctx *stream, bool final)
+{
+	if(final){ // Zero pad the last block
+		u32 padded = align(stream->bufferLen,ROMFS_BLOCK_SIZE);
+		memset(stream->buffer + stream->bufferLen,0,padded - stream->bufferLen);
+		stream->bufferLen = padded;
+	}
+
+	u32 blockNum = stream->bufferLen / ROMFS_BLOCK_SIZE;
+	HashIvfcBlocks(stream->buffer,stream->hashPos,blockNum);
+	stream->hashPos += 0x20 * blockNum;
+
+	WriteBuffer(stream->buffer,stream->bufferLen,stream->outPos,stream->out);
+	stream->outPos += stream->bufferLen;
+	stream->bufferLen = 0;
+}
+
+void WriteRomfsStream(romfs_streamctx *stream, const u8 *data, u64 size)
+{
+	while(size){
+		u32 len = min_u64(size,ROMFS_STREAM_BUFFER_SIZE - stream->bufferLen);
+		memcpy(stream->buffer + stream->bufferLen,data,len);
+		stream->bufferLen += len;
+		data += len;
+		size -= len;
+		if(stream->bufferLen == ROMFS_STREAM_BUFFER_SIZE)
+			FlushRomfsStream(stream,false);
+	}
+}
+
+void PadRomfsStream(romfs_streamctx *stream, u64 size)
+{
+	while(size){
+		u32 len = min_u64(size,ROMFS_STREAM_BUFFER_SIZE - stream->bufferLen);
+		memset(stream->buffer + stream->bufferLen,0,len);
+		stream->bufferLen += len;
+		size -= len;
+		if(stream->bufferLen == ROMFS_STREAM_BUFFER_SIZE)
+			FlushRomfsStream(stream,false);
+	}
+}
+
+int StreamRomfsFileData(romfs_buildctx *ctx, romfs_streamctx *stream, fs_dir *fs)
+{
+	// Same order as AddDirToRomfs(), so data lands at the offsets already written to the file table
+	for(u32 i = 0; i < fs->u_file; i++){
+		fs_file *file = &fs->file[i];
+		if(!file->size)
+			continue;
+
+		PadRomfsStream(stream,align(ctx->u_dataLen,0x10) - ctx->u_dataLen);
+		ctx->u_dataLen = align(ctx->u_dataLen,0x10);
+
+		// Read straight into the stream buffer, only this file is open
+		FILE *fp = fs_OpenFile(file);
+		if(!fp){
+			fprintf(stderr,"[ROMFS ERROR] Failed to open RomFS file\n");
+			return FAILED_TO_IMPORT_FILE;
+		}
+		for(u64 pos = 0; pos < file->size; ){
+			u32 len = min_u64(file->size - pos,ROMFS_STREAM_BUFFER_SIZE - stream->bufferLen);
+			if(fread(stream->buffer + stream->bufferLen,len,1,fp) != 1){
+				fprintf(stderr,"[ROMFS ERROR] Failed to read RomFS file data\n");
+				fclose(fp);
+				return FAILED_TO_IMPORT_FILE;
+			}
+			stream->bufferLen += len;
+			pos += len;
+			if(stream->bufferLen == ROMFS_STREAM_BUFFER_SIZE)
+				FlushRomfsStream(stream,false);
+		}
+		fclose(fp);
+		ctx->u_dataLen += file->size;
+	}
+
+	fs_dir *dir = (fs_dir*)fs->dir;
+	for(u32 i = 0; i < fs->u_dir; i++){
+		int result = StreamRomfsFileData(ctx,stream,&dir[i]);
+		if(result) return result;
+	}
+
+	return 0;
+}
+
+void GetRomfsCacheEntries(romfs_buildctx *ctx, romfs_cachectx *cache, fs_dir *fs)
+{
+	u64 dataOffset = ctx->level[3].size - ctx->m_dataLen;
+
+	for(u32 i = 0; i < fs->u_file; i++){
+		romfs_cacheentry *entry = &cache->entry[cache->entryNum++];
+		if(fs->file[i].size)
+			ctx->u_dataLen = align(ctx->u_dataLen,0x10);
+		entry->modTime = fs_GetFileModTime(&fs->file[i]);
+		entry->dataOffset = dataOffset + ctx->u_dataLen;
+		entry->size = fs->file[i].size;
+		entry->pathLen = fs_strlen(fs->file[i].path) * sizeof(fs_char);
+		entry->path = fs->file[i].path;
+		ctx->u_dataLen += fs->file[i].size;
+	}
+
+	fs_dir *dir = (fs_dir*)fs->dir;
+	for(u32 i = 0; i < fs->u_dir; i++)
+		GetRomfsCacheEntries(ctx,cache,&dir[i]);
+}
+
+int LoadRomfsCache(romfs_buildctx *ctx, romfs_cachectx *cache, u8 metadataHash[0x20])
+{
+	cache->fp = fopen(ctx->cachePath,"rb+");
+	if(!cache->fp)
+		return -1;
+
+	// The layout must match exactly, the metadata holds every name, size and data offset
+	romfs_cachehdr hdr;
+	if(fread(&hdr,sizeof(romfs_cachehdr),1,cache->fp) != 1 || memcmp(hdr.magic,"RFSC",4) != 0)
+		goto fail;
+	if(u8_to_u32(hdr.version,LE) != ROMFS_CACHE_VERSION || u8_to_u64(hdr.romfsSize,LE) != ctx->romfsSize || u8_to_u32(hdr.fileNum,LE) != ctx->fileNum)
+		goto fail;
+	if(memcmp(hdr.metadataHash,metadataHash,0x20) != 0)
+		goto fail;
+	cache->saveTime = u8_to_u64(hdr.saveTime,LE);
+
+	// Hash levels are small, so they are kept in memory while the outfile is patched
+	u64 pos = ROMFS_CACHE_LEVEL_OFFSET;
+	for(int i = 0; i < 3; i++){
+		if(ReadFile_64(i == 0 ? (u8*)ctx->ivfcHdr : ctx->level[i].pos,ctx->level[i].size,pos,cache->fp))
+			goto fail;
+		pos += ctx->level[i].size;
+	}
+
+	// The outfile must still hold the RomFs the cache was saved with, crypted with the same key and counter
+	cache->buffer = malloc(ctx->level[0].size);
+	if(!cache->buffer || ReadRomfsOutFile(ctx,cache->buffer,ctx->level[0].offset,ctx->level[0].size))
+		goto fail;
+	bool sameRomfs = memcmp(cache->buffer,ctx->ivfcHdr,ctx->level[0].size) == 0;
+	free(cache->buffer);
+	cache->buffer = NULL;
+	if(!sameRomfs)
+		goto fail;
+
+	u64 tableSize = u8_to_u64(hdr.entryTableSize,LE);
+	cache->entryTable = malloc(tableSize ? tableSize : 1);
+	cache->entry = calloc(ctx->fileNum ? ctx->fileNum : 1,sizeof(romfs_cacheentry));
+	if(!cache->entryTable || !cache->entry)
+		goto fail;
+	if(ReadFile_64(cache->entryTable,tableSize,pos,cache->fp))
+		goto fail;
+
+	for(pos = 0; cache->entryNum < ctx->fileNum; cache->entryNum++){
+		romfs_cacheentry *entry = &cache->entry[cache->entryNum];
+		if(pos + 28 > tableSize)
+			goto fail;
+		entry->modTime = u8_to_u64(cache->entryTable + pos,LE);
+		entry->dataOffset = u8_to_u64(cache->entryTable + pos + 8,LE);
+		entry->size = u8_to_u64(cache->entryTable + pos + 16,LE);
+		entry->pathLen = u8_to_u32(cache->entryTable + pos + 24,LE);
+		entry->path = (fs_char*)(cache->entryTable + pos + 28);
+		pos += 28 + entry->pathLen;
+		if(pos > tableSize)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	// The full build hashes into the same levels
+	memset(ctx->ivfcHdr,0,ctx->level[0].size);
+	for(int i = 1; i < 3; i++)
+		memset(ctx->level[i].pos,0,ctx->level[i].size);
+	FreeRomfsCache(cache);
+	memset(cache,0,sizeof(romfs_cachectx));
+	return -1;
+}
+
+int UpdateRomfsCache(romfs_buildctx *ctx, romfs_cachectx *cache, u8 metadataHash[0x20])
+{
+	// Invalidate the cache until it is consistent again
+	u8 magic[4] = {0};
+	WriteBuffer(magic,4,0,cache->fp);
+	fflush(cache->fp);
+
+	for(int i = 1; i < 3; i++)
+		cache->dirty[i] = calloc(align(ctx->level[i].size,ROMFS_BLOCK_SIZE) / ROMFS_BLOCK_SIZE,1);
+	cache->buffer = malloc(ROMFS_STREAM_BUFFER_SIZE);
+	cache->hashes = malloc(ROMFS_STREAM_BUFFER_SIZE / ROMFS_BLOCK_SIZE * 0x20);
+	if(!cache->dirty[1] || !cache->dirty[2] || !cache->buffer || !cache->hashes){
+		fprintf(stderr,"[ROMFS ERROR] Not enough memory\n");
+		return MEM_ERROR;
+	}
+
+	ctx->u_dataLen = 0;
+	cache->entryNum = 0;
+	int result = UpdateRomfsCacheData(ctx,cache,ctx->fs);
+	if(result)
+		return result;
+
+	// Level 2 was updated along with the data, the levels above it are only rehashed where it changed
+	RehashIvfcLevel(ctx,cache,1);
+	RehashIvfcLevel(ctx,cache,0);
+
 	for(int i = 2; i >= 0; i--){
-		u32 numHashes = align(ctx->level[i+1].size,ROMFS_BLOCK_SIZE) / ROMFS_BLOCK_SIZE;
-		for(u32 j = 0; j < numHashes; j++){
-			u8 *datapos = (u8*)(ctx->level[i+1].pos + ROMFS_BLOCK_SIZE * j);
-			u8 *hashpos = (u8*)(ctx->level[i].pos + 0x20 * j);
-			ctr_sha(datapos, ROMFS_BLOCK_SIZE, hashpos, CTR_SHA_256);
+		if(WriteRomfsOutFileBlocks(ctx,cache,i)){
+			fprintf(stderr,"[ROMFS ERROR] Failed to write RomFS to outfile\n");
+			return FAILED_TO_CREATE_OUTFILE;
 		}
 	}
-	
-	return;
+
+	WriteRomfsCache(ctx,cache,metadataHash);
+	ctx->patched = true;
+
+	return 0;
+}
+
+int UpdateRomfsCacheData(romfs_buildctx *ctx, romfs_cachectx *cache, fs_dir *fs)
+{
+	u64 dataOffset = ctx->level[3].size - ctx->m_dataLen;
+
+	for(u32 i = 0; i < fs->u_file; i++){
+		fs_file *file = &fs->file[i];
+		romfs_cacheentry *entry = &cache->entry[cache->entryNum++];
+		if(file->size)
+			ctx->u_dataLen = align(ctx->u_dataLen,0x10);
+		u64 offset = dataOffset + ctx->u_dataLen;
+
+		// Only a file last modified well before the cache was saved is trusted by its modification time,
+		// anything else is read and compared against its block hashes
+		u64 modTime = fs_GetFileModTime(file);
+		u32 pathLen = fs_strlen(file->path) * sizeof(fs_char);
+		bool clean = modTime && modTime == entry->modTime && modTime + ROMFS_CACHE_RACY_TIME <= cache->saveTime;
+		clean = clean && offset == entry->dataOffset && file->size == entry->size;
+		clean = clean && pathLen == entry->pathLen && memcmp(file->path,entry->path,pathLen) == 0;
+		entry->modTime = modTime;
+		entry->dataOffset = offset;
+		entry->size = file->size;
+		entry->pathLen = pathLen;
+		entry->path = file->path;
+
+		if(file->size && !clean){
+			int result = UpdateRomfsCacheFile(ctx,cache,file,offset);
+			if(result) return result;
+		}
+		ctx->u_dataLen += file->size;
+	}
+
+	fs_dir *dir = (fs_dir*)fs->dir;
+	for(u32 i = 0; i < fs->u_dir; i++){
+		int result = UpdateRomfsCacheData(ctx,cache,&dir[i]);
+		if(result) return result;
+	}
+
+	return 0;
+}
+
+int UpdateRomfsCacheFile(romfs_buildctx *ctx, romfs_cachectx *cache, fs_file *file, u64 offset)
+{
+	FILE *fp = fs_OpenFile(file);
+	if(!fp){
+		fprintf(stderr,"[ROMFS ERROR] Failed to open RomFS file\n");
+		return FAILED_TO_IMPORT_FILE;
+	}
+
+	// Blocks are hashed and compared against level 2, only those that differ are rewritten.
+	// The first and last block may be shared with other data, which is read back from the outfile
+	int result = 0;
+	u64 end = offset + file->size;
+	u32 runMax = ROMFS_STREAM_BUFFER_SIZE / ROMFS_BLOCK_SIZE;
+	for(u64 block = offset / ROMFS_BLOCK_SIZE; block * ROMFS_BLOCK_SIZE < end; ){
+		u64 runPos = block * ROMFS_BLOCK_SIZE;
+		u32 run = min_u64(align(end - runPos,ROMFS_BLOCK_SIZE) / ROMFS_BLOCK_SIZE,runMax);
+		u64 runEnd = runPos + (u64)run * ROMFS_BLOCK_SIZE;
+		u64 dataPos = offset > runPos ? offset : runPos;
+		u64 dataEnd = min_u64(end,runEnd);
+		u64 outPos = ctx->level[3].offset + runPos;
+
+		bool readFirst = dataPos > runPos;
+		bool readLast = dataEnd < runEnd && !(readFirst && run == 1);
+		if((readFirst && ReadRomfsOutFile(ctx,cache->buffer,outPos,ROMFS_BLOCK_SIZE)) || (readLast && ReadRomfsOutFile(ctx,cache->buffer + runEnd - runPos - ROMFS_BLOCK_SIZE,outPos + runEnd - runPos - ROMFS_BLOCK_SIZE,ROMFS_BLOCK_SIZE))){
+			fprintf(stderr,"[ROMFS ERROR] Failed to read RomFS from outfile\n");
+			result = FAILED_TO_IMPORT_FILE;
+			break;
+		}
+		if(fread(cache->buffer + dataPos - runPos,dataEnd - dataPos,1,fp) != 1){
+			fprintf(stderr,"[ROMFS ERROR] Failed to read RomFS file data\n");
+			result = FAILED_TO_IMPORT_FILE;
+			break;
+		}
+
+		HashIvfcBlocks(cache->buffer,cache->hashes,run);
+		u8 *level2 = ctx->level[2].pos + 0x20 * block;
+		for(u32 i = 0; i < run && !result; ){
+			if(memcmp(cache->hashes + 0x20 * i,level2 + 0x20 * i,0x20) == 0){
+				i++;
+				continue;
+			}
+
+			u32 changed = 1;
+			while(i + changed < run && memcmp(cache->hashes + 0x20 * (i + changed),level2 + 0x20 * (i + changed),0x20) != 0)
+				changed++;
+
+			memcpy(level2 + 0x20 * i,cache->hashes + 0x20 * i,0x20 * changed);
+			for(u64 j = block + i; j < block + i + changed; j++)
+				cache->dirty[2][j * 0x20 / ROMFS_BLOCK_SIZE] = 1;
+			if(WriteRomfsOutFile(ctx,cache->buffer + (u64)i * ROMFS_BLOCK_SIZE,outPos + (u64)i * ROMFS_BLOCK_SIZE,(u64)changed * ROMFS_BLOCK_SIZE)){
+				fprintf(stderr,"[ROMFS ERROR] Failed to write RomFS to outfile\n");
+				result = FAILED_TO_CREATE_OUTFILE;
+			}
+			i += changed;
+		}
+		if(result)
+			break;
+		block += run;
+	}
+	fclose(fp);
+
+	return result;
+}
+
+int ReadRomfsOutFile(romfs_buildctx *ctx, u8 *data, u64 offset, u64 size)
+{
+	if(ReadFile_64(data,size,ctx->outOffset + offset,ctx->outFile))
+		return -1;
+	if(ctx->ncchKey)
+		CryptNCCHSectionParallel(data,size,offset,ctx->ncchCtx,ctx->ncchKey,ncch_romfs);
+	return 0;
+}
+
+int WriteRomfsOutFile(romfs_buildctx *ctx, u8 *data, u64 offset, u64 size)
+{
+	// data is crypted in place
+	if(ctx->ncchKey)
+		CryptNCCHSectionParallel(data,size,offset,ctx->ncchCtx,ctx->ncchKey,ncch_romfs);
+	return WriteBuffer(data,size,ctx->outOffset + offset,ctx->outFile);
+}
+
+int WriteRomfsOutFileBlocks(romfs_buildctx *ctx, romfs_cachectx *cache, int level)
+{
+	// Level 0 is always rewritten, levels 1 and 2 only where they changed
+	u8 *data = level == 0 ? (u8*)ctx->ivfcHdr : ctx->level[level].pos;
+	u32 blockNum = align(ctx->level[level].size,ROMFS_BLOCK_SIZE) / ROMFS_BLOCK_SIZE;
+	u32 runMax = ROMFS_STREAM_BUFFER_SIZE / ROMFS_BLOCK_SIZE;
+	for(u32 i = 0; i < blockNum; ){
+		if(level && !cache->dirty[level][i]){
+			i++;
+			continue;
+		}
+
+		u32 run = 1;
+		while(i + run < blockNum && run < runMax && (!level || cache->dirty[level][i + run]))
+			run++;
+
+		// Crypted in a copy, the level is still needed in plaintext for the cache
+		u64 size = (u64)run * ROMFS_BLOCK_SIZE;
+		memcpy(cache->buffer,data + (u64)i * ROMFS_BLOCK_SIZE,size);
+		if(WriteRomfsOutFile(ctx,cache->buffer,ctx->level[level].offset + (u64)i * ROMFS_BLOCK_SIZE,size))
+			return -1;
+		i += run;
+	}
+
+	return 0;
+}
+
+void RehashIvfcLevel(romfs_buildctx *ctx, romfs_cachectx *cache, int level)
+{
+	// Rehash the changed blocks of the level below, marking the blocks of this level holding their hashes
+	u32 blockNum = align(ctx->level[level+1].size,ROMFS_BLOCK_SIZE) / ROMFS_BLOCK_SIZE;
+	u8 *dirty = cache->dirty[level+1];
+	for(u32 i = 0; i < blockNum; ){
+		if(!dirty[i]){
+			i++;
+			continue;
+		}
+
+		u32 run = 1;
+		while(i + run < blockNum && dirty[i + run])
+			run++;
+
+		HashIvfcBlocks(ctx->level[level+1].pos + (u64)i * ROMFS_BLOCK_SIZE,ctx->level[level].pos + 0x20 * (u64)i,run);
+
+		if(level)
+			for(u32 j = i; j < i + run; j++)
+				cache->dirty[level][(u64)j * 0x20 / ROMFS_BLOCK_SIZE] = 1;
+		i += run;
+	}
+}
+
+void SaveRomfsCache(romfs_buildctx *ctx, romfs_cachectx *cache, u8 metadataHash[0x20])
+{
+	cache->fp = fopen(ctx->cachePath,"wb+");
+	if(!cache->fp){
+		fprintf(stderr,"[ROMFS WARNING] Failed to create RomFS cache '%s'\n",ctx->cachePath);
+		return;
+	}
+
+	WriteRomfsCache(ctx,cache,metadataHash);
+}
+
+void WriteRomfsCache(romfs_buildctx *ctx, romfs_cachectx *cache, u8 metadataHash[0x20])
+{
+	// Levels 0-2 hold the hashes of every level 3 block, so changed files can be found without the data
+	int result = Good;
+	u64 pos = ROMFS_CACHE_LEVEL_OFFSET;
+	for(int i = 0; i < 3; i++){
+		result |= WriteBuffer(i == 0 ? (u8*)ctx->ivfcHdr : ctx->level[i].pos,ctx->level[i].size,pos,cache->fp);
+		pos += ctx->level[i].size;
+	}
+
+	u64 tableSize = 0;
+	for(u32 i = 0; i < cache->entryNum; i++)
+		tableSize += 28 + cache->entry[i].pathLen;
+
+	u8 *table = malloc(tableSize ? tableSize : 1);
+	if(!table)
+		return;
+	u64 tablePos = 0;
+	for(u32 i = 0; i < cache->entryNum; i++){
+		u64_to_u8(table + tablePos,cache->entry[i].modTime,LE);
+		u64_to_u8(table + tablePos + 8,cache->entry[i].dataOffset,LE);
+		u64_to_u8(table + tablePos + 16,cache->entry[i].size,LE);
+		u32_to_u8(table + tablePos + 24,cache->entry[i].pathLen,LE);
+		memcpy(table + tablePos + 28,cache->entry[i].path,cache->entry[i].pathLen);
+		tablePos += 28 + cache->entry[i].pathLen;
+	}
+	result |= WriteBuffer(table,tableSize,pos,cache->fp);
+	free(table);
+	if(fflush(cache->fp) != 0 || result != Good){
+		fprintf(stderr,"[ROMFS WARNING] Failed to write RomFS cache '%s'\n",ctx->cachePath);
+		return;
+	}
+
+	// The header goes last, marking the cache as consistent
+	romfs_cachehdr hdr;
+	memset(&hdr,0,sizeof(romfs_cachehdr));
+	memcpy(hdr.magic,"RFSC",4);
+	u32_to_u8(hdr.version,ROMFS_CACHE_VERSION,LE);
+	u64_to_u8(hdr.romfsSize,ctx->romfsSize,LE);
+	u32_to_u8(hdr.fileNum,cache->entryNum,LE);
+	u64_to_u8(hdr.entryTableSize,tableSize,LE);
+	u64_to_u8(hdr.saveTime,(u64)time(NULL) * 1000000000,LE);
+	memcpy(hdr.metadataHash,metadataHash,0x20);
+	WriteBuffer(&hdr,sizeof(romfs_cachehdr),0,cache->fp);
+	fflush(cache->fp);
+}
+
+void FreeRomfsCache(romfs_cachectx *cache)
+{
+	if(cache->fp)
+		fclose(cache->fp);
+	free(cache->entry);
+	free(cache->entryTable);
+	for(int i = 1; i < 3; i++)
+		free(cache->dirty[i]);
+	free(cache->buffer);
+	free(cache->hashes);
 }
 
 /*
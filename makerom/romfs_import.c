@@ -24,6 +24,9 @@ int PrepareImportRomFsBinaryFromFile(ncch_settings *ncchset, romfs_buildctx *ctx
 
 int ImportRomFsBinaryFromFile(romfs_buildctx *ctx)
 {
+	if(!ctx->output) // Streamed NCCH, FinaliseNcch() copies the binary straight into the outfile
+		return 0;
+
 	ReadFile_64(ctx->output,ctx->romfsSize,0,ctx->romfsBinary);
 	if(memcmp(ctx->output,"IVFC",4) != 0){
 		fprintf(stderr,"[ROMFS ERROR] Invalid RomFS Binary.\n");
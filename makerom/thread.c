@@ -0,0 +1,96 @@
+#include "lib.h"
+
+#ifdef _WIN32
+static DWORD WINAPI thread_entry(LPVOID arg)
+{
+	thread_context *ctx = (thread_context*)arg;
+	ctx->function(ctx->arg);
+	return 0;
+}
+#else
+static void* thread_entry(void *arg)
+{
+	thread_context *ctx = (thread_context*)arg;
+	ctx->function(ctx->arg);
+	return NULL;
+}
+#endif
+
+bool thread_start(thread_context *ctx, thread_function function, void *arg)
+{
+	ctx->function = function;
+	ctx->arg = arg;
+
+#ifdef _WIN32
+	ctx->handle = CreateThread(NULL,0,thread_entry,ctx,0,NULL);
+	ctx->started = (ctx->handle != NULL);
+#else
+	ctx->started = (pthread_create(&ctx->handle,NULL,thread_entry,ctx) == 0);
+#endif
+
+	return ctx->started;
+}
+
+void thread_join(thread_context *ctx)
+{
+	if(!ctx->started){
+		ctx->function(ctx->arg);
+		return;
+	}
+
+#ifdef _WIN32
+	WaitForSingleObject(ctx->handle,INFINITE);
+	CloseHandle(ctx->handle);
+#else
+	pthread_join(ctx->handle,NULL);
+#endif
+	ctx->started = false;
+}
+
+u32 thread_cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? count : 1;
+#endif
+}
+
+void mutex_init(mutex_context *ctx)
+{
+#ifdef _WIN32
+	InitializeCriticalSection(&ctx->section);
+#else
+	pthread_mutex_init(&ctx->mutex,NULL);
+#endif
+}
+
+void mutex_lock(mutex_context *ctx)
+{
+#ifdef _WIN32
+	EnterCriticalSection(&ctx->section);
+#else
+	pthread_mutex_lock(&ctx->mutex);
+#endif
+}
+
+void mutex_unlock(mutex_context *ctx)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(&ctx->section);
+#else
+	pthread_mutex_unlock(&ctx->mutex);
+#endif
+}
+
+void mutex_destroy(mutex_context *ctx)
+{
+#ifdef _WIN32
+	DeleteCriticalSection(&ctx->section);
+#else
+	pthread_mutex_destroy(&ctx->mutex);
+#endif
+}
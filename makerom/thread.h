@@ -0,0 +1,38 @@
+#pragma once
+
+#ifndef _WIN32
+	#include <pthread.h>
+#endif
+
+typedef void (*thread_function)(void *arg);
+
+typedef struct
+{
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	pthread_t handle;
+#endif
+	thread_function function;
+	void *arg;
+	bool started;
+} thread_context;
+
+typedef struct
+{
+#ifdef _WIN32
+	CRITICAL_SECTION section;
+#else
+	pthread_mutex_t mutex;
+#endif
+} mutex_context;
+
+// Threads that could not be started are run by thread_join() on the calling thread
+bool thread_start(thread_context *ctx, thread_function function, void *arg);
+void thread_join(thread_context *ctx);
+u32 thread_cpu_count(void);
+
+void mutex_init(mutex_context *ctx);
+void mutex_lock(mutex_context *ctx);
+void mutex_unlock(mutex_context *ctx);
+void mutex_destroy(mutex_context *ctx);
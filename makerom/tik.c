@@ -1,4 +1,5 @@
 #include "lib.h"
+#include "ncch.h"
 #include "cia.h"
 #include "tik.h"
 
@@ -68,7 +69,7 @@ int SignTicketHeader(tik_hdr *hdr, tik_signature *sig, keys_struct *keys)
 {
 	memset(sig,0,sizeof(tik_signature));
 	u32_to_u8(sig->sigType,RSA_2048_SHA256,BE);
-	return ctr_sig((u8*)hdr,sizeof(tik_hdr),sig->data,keys->rsa.xsPub,keys->rsa.xsPvt,RSA_2048_SHA256,CTR_RSA_SIGN);
+	return ctr_sig_sign(keys->rsa.xsCtx,(u8*)hdr,sizeof(tik_hdr),sig->data,RSA_2048_SHA256);
 }
 
 int CryptTitleKey(u8 *EncTitleKey, u8 *DecTitleKey, u8 *TitleID, keys_struct *keys, u8 mode)
@@ -1,4 +1,5 @@
 #include "lib.h"
+#include "ncch.h"
 #include "cia.h"
 #include "tmd.h"
 
@@ -69,7 +70,7 @@ int SignTMDHeader(tmd_hdr *hdr, tmd_signature *sig, keys_struct *keys)
 {
 	memset(sig,0,sizeof(tmd_signature));
 	u32_to_u8(sig->sigType,RSA_2048_SHA256,BE);
-	return ctr_sig((u8*)hdr,sizeof(tmd_hdr),sig->data,keys->rsa.cpPub,keys->rsa.cpPvt,RSA_2048_SHA256,CTR_RSA_SIGN);
+	return ctr_sig_sign(keys->rsa.cpCtx,(u8*)hdr,sizeof(tmd_hdr),sig->data,RSA_2048_SHA256);
 }
 
 int SetupTMDInfoRecord(tmd_content_info_record *info_record, u8 *content_record, u16 ContentCount)
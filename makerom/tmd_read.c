@@ -1,4 +1,5 @@
 #include "lib.h"
+#include "ncch.h"
 #include "cia.h"
 #include "tmd.h"
 
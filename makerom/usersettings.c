@@ -4,6 +4,8 @@
 void DisplayHelp(char *app_name);
 void SetDefaults(user_settings *set);
 int SetArgument(int argc, int i, char *argv[], user_settings *set);
+int CheckOutputCombination(user_settings *set);
+bool IsOutputFormat(user_settings *set, output_format format);
 int CheckArgumentCombination(user_settings *set);
 void PrintNeedsArg(char *arg);
 void PrintArgInvalid(char *arg);
@@ -150,14 +152,22 @@ int SetArgument(int argc, int i, char *argv[], user_settings *set)
 			PrintArgReqParam("-f",1);
 			return USR_ARG_REQ_PARAM;
 		}
-		if(strcasecmp(argv[i+1],"cxi") == 0 || strcasecmp(argv[i+1],"exec") == 0 ) set->common.outFormat = CXI;
-		else if(strcasecmp(argv[i+1],"cfa") == 0 || strcasecmp(argv[i+1],"data") == 0 ) set->common.outFormat = CFA;
-		else if(strcasecmp(argv[i+1],"cci") == 0 || strcasecmp(argv[i+1],"card") == 0 ) set->common.outFormat = CCI;
-		else if(strcasecmp(argv[i+1],"cia") == 0) set->common.outFormat = CIA;
+		if(set->common.outFormatNum >= MAX_OUTPUT_NUM){
+			fprintf(stderr,"[SETTING ERROR] Too many output formats\n");
+			return USR_BAD_ARG;
+		}
+		output_format *format = &set->common.outFormat;
+		if(set->common.outFormatNum)
+			format = &set->common.extraOutFormat[set->common.outFormatNum-1];
+		if(strcasecmp(argv[i+1],"cxi") == 0 || strcasecmp(argv[i+1],"exec") == 0 ) *format = CXI;
+		else if(strcasecmp(argv[i+1],"cfa") == 0 || strcasecmp(argv[i+1],"data") == 0 ) *format = CFA;
+		else if(strcasecmp(argv[i+1],"cci") == 0 || strcasecmp(argv[i+1],"card") == 0 ) *format = CCI;
+		else if(strcasecmp(argv[i+1],"cia") == 0) *format = CIA;
 		else {
 			fprintf(stderr,"[SETTING ERROR] Invalid output format '%s'\n",argv[i+1]);
 			return USR_BAD_ARG;
 		}		
+		set->common.outFormatNum++;
 		return 2;
 	}
 	else if(strcmp(argv[i],"-o") == 0){
@@ -165,8 +175,17 @@ int SetArgument(int argc, int i, char *argv[], user_settings *set)
 			PrintArgReqParam("-o",1);
 			return USR_ARG_REQ_PARAM;
 		}
-		set->common.outFileName = argv[i+1];
-		set->common.outFileName_mallocd = false;
+		if(set->common.outFileNameNum >= MAX_OUTPUT_NUM){
+			fprintf(stderr,"[SETTING ERROR] Too many output files\n");
+			return USR_BAD_ARG;
+		}
+		if(set->common.outFileNameNum)
+			set->common.extraOutFileName[set->common.outFileNameNum-1] = argv[i+1];
+		else{
+			set->common.outFileName = argv[i+1];
+			set->common.outFileName_mallocd = false;
+		}
+		set->common.outFileNameNum++;
 		return 2;
 	}
 	// Key Options
@@ -357,6 +376,22 @@ int SetArgument(int argc, int i, char *argv[], user_settings *set)
 		set->ncch.romfsPath = argv[i+1];
 		return 2;
 	}
+	else if(strcmp(argv[i],"-romfscache") == 0){
+		if(ParamNum){
+			PrintNoNeedParam("-romfscache");
+			return USR_BAD_ARG;
+		}
+		set->ncch.useRomFsCache = true;
+		return 1;
+	}
+	else if(strcmp(argv[i],"-ncchcache") == 0){
+		if(ParamNum != 1){
+			PrintArgReqParam("-ncchcache",1);
+			return USR_ARG_REQ_PARAM;
+		}
+		set->ncch.cacheDir = argv[i+1];
+		return 2;
+	}
 	// Cci Options
 #ifndef PUBLIC_BUILD
 	else if(strcmp(argv[i],"-devcardcci") == 0){
@@ -617,14 +652,72 @@ int SetArgument(int argc, int i, char *argv[], user_settings *set)
 	return USR_UNK_ARG;
 }
 
+int CheckOutputCombination(user_settings *set)
+{
+	if(set->common.outFormatNum <= 1 && set->common.outFileNameNum <= 1)
+		return 0;
+
+	if(set->common.outFormatNum != set->common.outFileNameNum){
+		fprintf(stderr,"[SETTING ERROR] Each \"-f\" needs its own \"-o\" when making several outputs\n");
+		return USR_BAD_ARG;
+	}
+	if(!set->ncch.buildNcch0){
+		fprintf(stderr,"[SETTING ERROR] Several outputs can only be made when building content 0\n");
+		return USR_BAD_ARG;
+	}
+
+	// One of each container, and one CXI or CFA
+	output_format *format = set->common.extraOutFormat;
+	u32 extraNum = set->common.outFormatNum-1;
+	for(u32 i = 0; i < set->common.outFormatNum; i++){
+		output_format a = i ? format[i-1] : set->common.outFormat;
+		for(u32 j = i+1; j < set->common.outFormatNum; j++){
+			output_format b = format[j-1];
+			if(a == b || ((a == CXI || a == CFA) && (b == CXI || b == CFA))){
+				fprintf(stderr,"[SETTING ERROR] Only one output of each type can be made\n");
+				return USR_BAD_ARG;
+			}
+		}
+	}
+
+	// A CXI/CFA output comes first, as content 0 is streamed straight to it
+	for(u32 i = 0; i < extraNum; i++){
+		if(format[i] != CXI && format[i] != CFA)
+			continue;
+		output_format tmpFormat = set->common.outFormat;
+		char *tmpName = set->common.outFileName;
+		set->common.outFormat = format[i];
+		set->common.outFileName = set->common.extraOutFileName[i];
+		format[i] = tmpFormat;
+		set->common.extraOutFileName[i] = tmpName;
+	}
+
+	return 0;
+}
+
+bool IsOutputFormat(user_settings *set, output_format format)
+{
+	if(set->common.outFormat == format)
+		return true;
+	for(u32 i = 0; i + 1 < set->common.outFormatNum; i++){
+		if(set->common.extraOutFormat[i] == format)
+			return true;
+	}
+	return false;
+}
+
 int CheckArgumentCombination(user_settings *set)
 {
+	int result = CheckOutputCombination(set);
+	if(result) return result;
+
+	bool outputContainer = IsOutputFormat(set,CCI) || IsOutputFormat(set,CIA);
 	for(int i = 0; i < CIA_MAX_CONTENT; i++){
-		if( i > CCI_MAX_CONTENT-1 && set->common.contentPath[i] && set->common.outFormat == CCI){
+		if( i > CCI_MAX_CONTENT-1 && set->common.contentPath[i] && IsOutputFormat(set,CCI)){
 			fprintf(stderr,"[SETTING ERROR] Content indexes > %d are invalid for CCI\n",CCI_MAX_CONTENT-1);
 			return USR_BAD_ARG;
 		}
-		if(set->common.contentPath[i] && (set->common.outFormat == CXI || set->common.outFormat == CFA)){
+		if(set->common.contentPath[i] && !outputContainer){
 			fprintf(stderr,"[SETTING ERROR] You cannot specify content while outputting CXI/CFA files\n");
 			return USR_BAD_ARG;
 		}
@@ -638,7 +731,7 @@ int CheckArgumentCombination(user_settings *set)
 		return USR_BAD_ARG;
 	}
 
-	if(set->common.outFormat == CIA && set->cci.cverCiaPath){
+	if(IsOutputFormat(set,CIA) && !IsOutputFormat(set,CCI) && set->cci.cverCiaPath){
 		fprintf(stderr,"[SETTING ERROR] You cannot use argument \"-genupdatenote\" when generating a CIA\n");
 		return USR_BAD_ARG;
 	}
@@ -700,6 +793,14 @@ int CheckArgumentCombination(user_settings *set)
 		PrintArgInvalid("-romfs");
 		return USR_BAD_ARG;
 	}
+	if(!set->ncch.buildNcch0 && set->ncch.cacheDir){
+		PrintArgInvalid("-ncchcache");
+		return USR_BAD_ARG;
+	}
+	if(set->ncch.useRomFsCache && (set->common.outFormat != CXI && set->common.outFormat != CFA)){
+		fprintf(stderr,"[SETTING ERROR] Argument \"-romfscache\" can only be used when generating a CXI/CFA\n");
+		return USR_BAD_ARG;
+	}
 
 	return 0;
 }
@@ -714,6 +815,7 @@ void free_RsfSettings(rsf_settings *set)
 {
 	//Option
 	free(set->Option.PageSize);
+	free(set->Option.CompressMode);
 	/*
 	for(u32 i = 0; i < set->Option.AppendSystemCallNum; i++){
 		free(set->Option.AppendSystemCall[i]);
@@ -973,6 +1075,7 @@ void DisplayHelp(char *app_name)
 	//printf("                                    'cci' CTR Card Image\n");
 	//printf("                                    'cia' CTR Importable Archive\n");
 	printf(" -o             <file>              Output File\n");
+	printf("                                    Repeat '-f' and '-o' to make several outputs at once\n");
 	//printf(" -v                                 Verbose\n");
 	printf(" -DNAME=VALUE                       Substitute values in Spec files\n");
 	printf("KEY OPTIONS:\n");
@@ -1002,6 +1105,8 @@ void DisplayHelp(char *app_name)
 	printf(" -exheader      <exhdr path>        ExHeader Template File\n");
 	printf(" -plain-region  <pln region path>   PlainRegion File\n");
 	printf(" -romfs         <romfs path>        RomFS File\n");	
+	printf(" -romfscache                        Rebuild RomFS incrementally using '<outfile>.romfscache'\n");
+	printf(" -ncchcache     <dir>               Reuse NCCHs built from the same inputs, kept in <dir>\n");
 	printf("CCI OPTIONS:\n");
 	printf(" -content       <filepath>:<index>  Specify content files\n");
 #ifndef PUBLIC_BUILD
@@ -2,6 +2,7 @@
 
 #define CCI_MAX_CONTENT 8
 #define CIA_MAX_CONTENT 65536
+#define MAX_OUTPUT_NUM 3 // A CXI/CFA, a CIA and a CCI
 
 
 typedef enum
@@ -63,6 +64,7 @@ typedef struct
 
 		// Strings
 		char *PageSize;
+		char *CompressMode;
 		
 		// String Collections
 		//u32 AppendSystemCallNum; // DELETE
@@ -234,6 +236,13 @@ typedef struct
 		char *outFileName;
 		output_format outFormat;
 
+		// Further "-f"/"-o" pairs, all outputs are made from the same content 0
+		u32 outFormatNum;
+		u32 outFileNameNum;
+		output_format extraOutFormat[MAX_OUTPUT_NUM-1];
+		char *extraOutFileName[MAX_OUTPUT_NUM-1];
+		char *tmpNcch0Path; // Content 0 is streamed here when none of the outputs is a CXI/CFA
+
 		// Keys
 		keys_struct keys; 
 	
@@ -265,6 +274,8 @@ typedef struct
 		char *exheaderPath; // for .code details
 		char *plainRegionPath; // prebuilt Plain Region
 		char *romfsPath; // Prebuild _cleartext_ romfs binary
+		bool useRomFsCache; // Rebuild the romfs incrementally, against a cache kept next to the outfile
+		char *cacheDir; // Built NCCHs are kept here, named by a hash of their inputs
 	} ncch; // Ncch0 Build
 	
 	struct{ 
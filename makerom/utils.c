@@ -1,6 +1,20 @@
+#ifdef __linux__
+	#define _GNU_SOURCE // copy_file_range()
+#endif
 #include "lib.h"
 #include "utf.h"
 
+#include <errno.h>
+#ifndef _WIN32
+	#include <sys/mman.h>
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+	#define HAVE_COPY_FILE_RANGE
+#endif
+
+const u32 COPY_FILE_BUFFER_SIZE = 0x400000;
+
 // Memory
 void char_to_u8_array(unsigned char destination[], char source[], int size, int endianness, int base)
 {	
@@ -310,16 +324,102 @@ u8* ImportFile(char *file, u64 size)
 	return data;
 }
 
-void WriteBuffer(void *buffer, u64 size, u64 offset, FILE *output)
+int WriteBuffer(void *buffer, u64 size, u64 offset, FILE *output)
 {
-	fseek_64(output,offset);
-	fwrite(buffer,size,1,output);
+	if(fseek_64(output,offset) != 0)
+		return Fail;
+	if(size && fwrite(buffer,size,1,output) != 1)
+		return Fail;
+	return Good;
 } 
 
-void ReadFile_64(void *outbuff, u64 size, u64 offset, FILE *file)
+int ReadFile_64(void *outbuff, u64 size, u64 offset, FILE *file)
+{
+	if(fseek_64(file,offset) != 0)
+		return Fail;
+	if(size && fread(outbuff,size,1,file) != 1)
+		return Fail;
+	return Good;
+}
+
+int CopyFileData(FILE *src, u64 srcOffset, FILE *dst, u64 dstOffset, u64 size)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	// Let the kernel copy (or reflink) the data, falling back to a buffered copy where it can't
+	fflush(dst);
+	loff_t inPos = srcOffset;
+	loff_t outPos = dstOffset;
+	while(size){
+		ssize_t copied = copy_file_range(fileno(src),&inPos,fileno(dst),&outPos,min_u64(size,0x40000000),0);
+		if(copied < 0 && errno == EINTR)
+			continue;
+		// Only copies the kernel can't do between these files are retried through a buffer, real IO errors are reported
+		if(copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+			break;
+		if(copied < 0)
+			return FAILED_TO_CREATE_OUTFILE;
+		if(copied == 0) // The source ended early
+			return FAILED_TO_IMPORT_FILE;
+		srcOffset += copied;
+		dstOffset += copied;
+		size -= copied;
+	}
+	if(!size)
+		return 0;
+#endif
+
+	u64 bufferSize = min_u64(size,COPY_FILE_BUFFER_SIZE);
+	u8 *buffer = malloc(bufferSize);
+	if(!buffer)
+		return MEM_ERROR;
+	for(u64 pos = 0; pos < size; pos += bufferSize){
+		u64 len = min_u64(size-pos,bufferSize);
+		int result = 0;
+		if(ReadFile_64(buffer,len,srcOffset+pos,src))
+			result = FAILED_TO_IMPORT_FILE;
+		else if(WriteBuffer(buffer,len,dstOffset+pos,dst))
+			result = FAILED_TO_CREATE_OUTFILE;
+		if(result){
+			free(buffer);
+			return result;
+		}
+	}
+	free(buffer);
+	return 0;
+}
+
+int MapFile(mapped_file *map, FILE *fp, u64 size, bool writable)
 {
-	fseek_64(file,offset);
-	fread(outbuff,size,1,file);
+	memset(map,0,sizeof(mapped_file));
+	map->size = size;
+
+#ifndef _WIN32
+	// Writes to the mapping are private to it, and never reach the file
+	void *data = mmap(NULL,size,writable ? PROT_READ|PROT_WRITE : PROT_READ,MAP_PRIVATE,fileno(fp),0);
+	if(data != MAP_FAILED){
+		map->buffer = data;
+		map->mapped = true;
+		return 0;
+	}
+#endif
+
+	// Can't be mapped (empty file, pipe, ...), so read it instead
+	map->buffer = malloc(size ? size : 1);
+	if(!map->buffer)
+		return MEM_ERROR;
+	ReadFile_64(map->buffer,size,0,fp);
+	return 0;
+}
+
+void UnmapFile(mapped_file *map)
+{
+#ifndef _WIN32
+	if(map->mapped)
+		munmap(map->buffer,map->size);
+	else
+#endif
+		free(map->buffer);
+	memset(map,0,sizeof(mapped_file));
 }
 
 int fseek_64(FILE *fp, u64 file_pos)
@@ -6,6 +6,13 @@ typedef struct
 	u8 *buffer;
 } buffer_struct;
 
+typedef struct
+{
+	u64 size;
+	u8 *buffer;
+	bool mapped; // Otherwise buffer is a malloc'd copy of the file
+} mapped_file;
+
 // Memory
 void char_to_u8_array(unsigned char destination[], char source[], int size, int endianness, int base);
 void endian_memcpy(u8 *destination, u8 *source, u32 size, int endianness);
@@ -47,8 +54,11 @@ u64 wGetFileSize_u64(u16 *filename);
 
 //IO Misc
 u8* ImportFile(char *file, u64 size);
-void WriteBuffer(void *buffer, u64 size, u64 offset, FILE *output);
-void ReadFile_64(void *outbuff, u64 size, u64 offset, FILE *file);
+int WriteBuffer(void *buffer, u64 size, u64 offset, FILE *output);
+int ReadFile_64(void *outbuff, u64 size, u64 offset, FILE *file);
+int CopyFileData(FILE *src, u64 srcOffset, FILE *dst, u64 dstOffset, u64 size);
+int MapFile(mapped_file *map, FILE *fp, u64 size, bool writable);
+void UnmapFile(mapped_file *map);
 int fseek_64(FILE *fp, u64 file_pos);
 
 //Data Size conversion